@@ -1,10 +1,18 @@
 #include <dhm/common.h>
+#include <dhm/elementwise.h>
+#include <dhm/keystore.h>
+#include <dhm/mapped_matrix.h>
 #include <dhm/matrix.h>
 #include <dhm/operation.h>
+#include <dhm/planner.h>
 #include <dhm/protocol.h>
+#include <dhm/verify.h>
 
 #include <boost/program_options.hpp>
+#include <chrono>
+#include <cmath>
 #include <iostream>
+#include <numeric>
 
 using namespace dhm;
 namespace po = boost::program_options;
@@ -16,21 +24,122 @@ void showHelp() {
   exit(1);
 }
 
-template <class R1, class R2>
-bool equal(R1 &&Range1, R2 &&Range2, float eps = 0.001) {
-  return std::equal(std::begin(Range1), std::end(Range1), std::begin(Range2),
-                    std::end(Range2), [eps](auto &&Fst, auto &&Snd) {
-                      return std::fabs(Fst - Snd) < eps;
-                    });
+struct Verification {
+  VerifyMode mode = VERIFY_FAST;
+  /* largest relative error accepted for approximate results */
+  double tolerance = 0.001;
+  unsigned rounds = DefaultFreivaldsRounds;
+  /* results must match exactly, e.g. with BGV */
+  bool exact = false;
+};
+
+/* Print error of the result, throw if it is too large */
+void checkError(const std::string &op_name, const ErrorSum &error,
+                const Verification &verification) {
+  if (verification.exact) {
+    if (error.Distance != 0)
+      throw std::runtime_error(op_name + ": data mismatch!");
+    std::cout << op_name << ": exact match" << std::endl;
+    return;
+  }
+  std::cout << std::setprecision(3) << std::fixed;
+  std::cout << op_name << ": eps " << error.relative() << " ("
+            << (verification.mode == VERIFY_FAST ? "fast" : "full")
+            << " check)" << std::endl;
+  if (error.relative() > verification.tolerance)
+    throw std::runtime_error(op_name + ": data mismatch!");
+}
+
+/* Print capacity consumed by every stage of the workers' kernels and what
+ * is left in results
+ */
+void reportNoiseBudget(const std::string &op_name, const NoiseBudget &budget) {
+  if (budget.result_capacity == NoiseBudget::Unknown)
+    return;
+  std::cout << std::setprecision(1) << std::fixed;
+  std::cout << op_name << ": capacity " << budget.input_capacity
+            << " bits in operands, " << budget.result_capacity
+            << " left in results";
+  if (budget.result_precision != NoiseBudget::Unknown)
+    std::cout << ", precision " << budget.result_precision << " bits";
+  std::cout << std::endl;
+  for (unsigned i = 0; i < STAGE_COUNT; ++i) {
+    auto &stage = budget.stages[i];
+    if (stage.count)
+      std::cout << op_name << ":   " << std::setw(10) << toString(HeStage(i))
+                << " x" << stage.count << ": " << stage.total / stage.count
+                << " bits on average, " << stage.max << " at most"
+                << std::endl;
+  }
 }
 
-template <class R1, class R2> double dist(R1 &&Range1, R2 &&Range2) {
-  auto It1 = std::begin(Range1), Ite = std::end(Range1);
-  auto It2 = std::begin(Range2);
-  double dist = 0;
-  while (It1 != Ite)
-    dist += std::fabs(*It1++ - *It2++);
-  return dist;
+/* Open matrix file, or create it and fill with random data if missing */
+MappedMatrix<double> openOrGenerate(const std::string &path, unsigned rows,
+                                    unsigned columns) {
+  if (MappedMatrix<double>::exists(path))
+    return MappedMatrix<double>::open(path);
+  auto matrix = MappedMatrix<double>::create(path, rows, columns);
+  for (size_t i = 0; i < matrix.rows(); ++i) {
+    auto row = makeRandomArray<double>(matrix.columns());
+    std::copy(row.begin(), row.end(), matrix.beginRow(i));
+  }
+  return matrix;
+}
+
+/* Run operation on memory-mapped matrices, result is written to out_file */
+void runStreaming(Operation op, CommunicationProtocol<double> &protocol,
+                  const MappedMatrix<double> &A, const MappedMatrix<double> &B,
+                  const std::string &out_file, unsigned tile_rows,
+                  const Verification &verification) {
+  StreamingOperation<double> streaming(protocol, tile_rows);
+  const char *op_name = opToString(op);
+  std::cout << op_name << ": streaming matrix [" << A.rows() << " x "
+            << A.columns() << "] in tiles of " << tile_rows << " rows"
+            << std::endl;
+
+  if (op == OP_ECHO) {
+    auto res = MappedMatrix<double>::create(out_file, A.rows(), A.columns());
+    streaming.echo(A, res);
+    if (verification.mode == VERIFY_NONE)
+      return;
+    if (!identical(A.data(), res.data(), A.size()))
+      throw std::runtime_error("echo: data mismatch!");
+    std::cout << "echo: success!" << std::endl;
+    return;
+  }
+
+  ErrorSum error;
+  if (op == OP_ADD || op == OP_HADD) {
+    if (A.rows() != B.rows() || A.columns() != B.columns())
+      throw std::runtime_error("error: incompatible matrix sizes");
+    auto res = MappedMatrix<double>::create(out_file, A.rows(), A.columns());
+    streaming.add(A, B, res);
+    if (verification.mode == VERIFY_NONE)
+      return;
+    error = compareSum(A.data(), B.data(), res.data(), res.size());
+  } else if (op == OP_MUL) {
+    if (A.columns() != B.rows())
+      throw std::runtime_error("error: incompatible matrix sizes");
+    auto res = MappedMatrix<double>::create(out_file, A.rows(), B.columns());
+    streaming.multiply(A, B, res);
+    if (verification.mode == VERIFY_NONE)
+      return;
+    if (verification.mode == VERIFY_FAST) {
+      error = freivalds(A, B, res, verification.rounds);
+    } else {
+      std::vector<double> expected(B.columns());
+      for (size_t i = 0; i < A.rows(); ++i) {
+        std::fill(expected.begin(), expected.end(), 0.0);
+        for (size_t k = 0; k < A.columns(); ++k)
+          for (size_t j = 0; j < B.columns(); ++j)
+            expected[j] += A(i, k) * B(k, j);
+        error += compareArrays(expected.data(), res.beginRow(i), B.columns());
+      }
+    }
+  } else {
+    throw std::runtime_error("unsupported operation in streaming mode");
+  }
+  checkError(op_name, error, verification);
 }
 
 int main(int argc, char *argv[]) try {
@@ -38,18 +147,65 @@ int main(int argc, char *argv[]) try {
   std::vector<std::string> worker_addrs;
   unsigned a_rows = 512, a_columns = 512, b_rows = 512, b_columns = 512;
   unsigned common_size = 0;
+  unsigned batch = 4096;
+  std::string a_file = "A.dhm", b_file = "B.dhm", out_file = "result.dhm";
+  unsigned tile_rows = 1024;
+  TcpOptions tcp_options;
+  double speculate = 0;
+  unsigned rebalance = 0;
+  std::string workers_file;
+  unsigned local_threads = 0;
+  double local_share = 0;
+  std::string keystore_dir;
+  unsigned precision = 20, security = 128;
+  std::string autotune_file;
+  std::string scheme_str = "ckks";
+  unsigned plaintext_modulus = 0;
+  std::string chain_str = "sub,relu";
+  std::string reduce_str = "none";
+  std::string verify_str = "fast";
+  std::string relay_str = "none";
+  Verification verification;
 
   // clang-format off
   options.add_options()
     ("help,h", "Show help")
     ("show-data", "Print array data")
-    ("worker,w", po::value(&worker_addrs), "Worker address ([host]:port). At least one worker must be specified")
-    ("op", po::value(&operation_str), "Operation to perform.\nSupported opperations: 'echo', 'add'")
+    ("worker,w", po::value(&worker_addrs), "Worker address ([host]:port). At least one worker must be specified, here or in --workers-file")
+    ("workers-file", po::value(&workers_file), "File with worker addresses, one per line. It is watched during operations: listed workers join, others (including ones given by -w) are drained. Enables --rebalance")
+    ("op", po::value(&operation_str), "Operation to perform.\nSupported opperations: 'echo', 'add', 'mul', 'hadd', 'hmul', 'pmul', 'bmul', 'map'")
     ("ah", po::value(&a_rows), "Height of matrix A")
     ("aw", po::value(&a_columns), "Width of matrix A")
     ("bh", po::value(&b_rows), "Height of matrix B")
     ("bw", po::value(&b_columns), "Width of matrix B")
-    ("size", po::value(&common_size), "Set all sizes to the same value. Overrides ah, aw, bh, bw");
+    ("size", po::value(&common_size), "Set all sizes to the same value. Overrides ah, aw, bh, bw")
+    ("batch", po::value(&batch), "Number of products for 'bmul', each of [ah x aw] by [bh x bw] matrices")
+    ("chain", po::value(&chain_str), "Element-wise steps for 'map', e.g. 'sub,mul,axpy:0.5,relu'. Steps add, sub, mul (Hadamard) and axpy take the next operand, scale, shift, relu, abs and square do not")
+    ("reduce", po::value(&reduce_str), "Reduction of 'map' result: 'none', 'row-sum', 'row-norm', 'row-max', 'column-sum', 'sum', 'norm' or 'max-abs'")
+    ("stream", "Stream memory-mapped matrices from files instead of generating them in memory")
+    ("a-file", po::value(&a_file), "File with matrix A for --stream. Generated if missing")
+    ("b-file", po::value(&b_file), "File with matrix B for --stream. Generated if missing")
+    ("out-file", po::value(&out_file), "Result file for --stream")
+    ("tile-rows", po::value(&tile_rows), "Rows per tile in --stream mode")
+    ("streams", po::value(&tcp_options.streams), "TCP streams per worker. Large transfers are striped across them")
+    ("socket-buffer", po::value(&tcp_options.socket_buffer), "Socket send/receive buffer size in bytes, 0 for system default")
+    ("local", po::value(&local_threads)->implicit_value(0), "Hybrid mode: compute a share of rows on this machine with the given number of threads (all cores by default) while transferring the rest to workers")
+    ("local-share", po::value(&local_share), "Fraction of rows computed locally in hybrid mode. By default it is sized from measured local and remote throughput")
+    ("select", po::value(&tcp_options.select_workers), "Use at most this many least loaded workers per operation, 0 for all")
+    ("no-load-query", "Do not ask workers for their load before operations")
+    ("relay", po::value(&relay_str), "Broadcast data shared by all workers (B of products, public keys) once, relayed by workers along a 'binomial' or 'chain' tree, instead of sending a copy to each worker ('none')")
+    ("speculate", po::value(&speculate)->implicit_value(0.75), "Tail-latency mode: once this fraction of chunks is done, duplicate the rest onto idle workers. Failed workers' chunks are re-dispatched")
+    ("rebalance", po::value(&rebalance)->implicit_value(4), "Elastic mode: split rows into this many chunks per worker, handed out as workers finish, so that joining workers take a share of the remaining work")
+    ("keystore", po::value(&keystore_dir), "Directory with encryption keys for hadd/hmul. Keys are generated and saved there on first use")
+    ("scheme", po::value(&scheme_str), "Encryption scheme for hadd/hmul/pmul: 'ckks' (approximate) or 'bgv' (exact integers)")
+    ("plaintext-modulus", po::value(&plaintext_modulus), "BGV plaintext modulus, chosen automatically by default")
+    ("precision", po::value(&precision), "Bits of precision of encrypted results")
+    ("security", po::value(&security), "Security level of encryption parameters: 128, 192 or 256")
+    ("verify", po::value(&verify_str), "Result verification: 'none', 'fast' (probabilistic Freivalds' check of products in O(n^2)) or 'full' (products are recomputed)")
+    ("tolerance", po::value(&verification.tolerance), "Largest relative error of approximate results accepted by verification")
+    ("verify-rounds", po::value(&verification.rounds), "Rounds of Freivalds' check, each halves the chance to miss a wrong product")
+    ("autotune", po::value(&autotune_file)->implicit_value("dhm-params.cache"), "Benchmark candidate encryption parameters and cache the fastest ones in the given file")
+    ("no-budget-check", "Do not probe encryption parameters on one row before the operation. By default it fails early if results would run out of capacity or precision");
   // clang-format on
   po::parse_command_line(argc, argv, options);
 
@@ -58,32 +214,128 @@ int main(int argc, char *argv[]) try {
   po::notify(vm);
   if (vm.count("help"))
     showHelp();
-  if (!vm.count("worker")) {
+  if (!vm.count("worker") && workers_file.empty()) {
     std::cerr << "Error: worker not specified\n\n";
     showHelp();
   }
   if (vm.count("size"))
     a_rows = a_columns = b_rows = b_columns = common_size;
+  if (!workers_file.empty() && !rebalance)
+    rebalance = 4;
+
+  tcp_options.query_load = !vm.count("no-load-query");
+  tcp_options.relay = parseRelayTree(relay_str);
 
   bool show_data = vm.count("show-data");
+  bool stream = vm.count("stream");
   Operation op = parseOperation(operation_str);
 
+  MappedMatrix<double> mapped_a, mapped_b;
+  if (stream) {
+    if (op == OP_HMUL || op == OP_PMUL || op == OP_BATCHED_MUL ||
+        op == OP_ELEMENTWISE)
+      throw std::runtime_error("error: " + operation_str +
+                               " not supported in streaming mode");
+    if (!tile_rows)
+      throw std::runtime_error("error: invalid tile size");
+    mapped_a = openOrGenerate(a_file, a_rows, a_columns);
+    if (op != OP_ECHO)
+      mapped_b = openOrGenerate(b_file, b_rows, b_columns);
+    a_columns = mapped_a.columns();
+  }
+
   boost::asio::io_context io_context;
-  TcpCommunicationProtocol<double> tcp_protocol(io_context);
+  TcpCommunicationProtocol<double> tcp_protocol(io_context, tcp_options);
+  std::unique_ptr<HybridProtocol<double>> hybrid_protocol;
   std::unique_ptr<EncryptionProtocol> enc_protocol;
-  CommunicationProtocol<double> *protocol = &tcp_protocol;
+  /* protocol for operations on plain data */
+  CommunicationProtocol<double> *plain_protocol = &tcp_protocol;
+  if (vm.count("local") || vm.count("local-share")) {
+    if (local_share < 0 || local_share > 1)
+      throw std::runtime_error("error: invalid local share");
+    hybrid_protocol =
+        std::make_unique<HybridProtocol<double>>(tcp_protocol, local_threads);
+    hybrid_protocol->setLocalShare(local_share);
+    plain_protocol = hybrid_protocol.get();
+  }
+  CommunicationProtocol<double> *protocol = plain_protocol;
+  auto report_hybrid = [&] {
+    if (!hybrid_protocol)
+      return;
+    auto rows = hybrid_protocol->getRowsDone();
+    std::cout << operation_str << ": local slot computed " << rows[0]
+              << " of " << std::accumulate(rows.begin(), rows.end(), size_t(0))
+              << " rows" << std::endl;
+  };
+
+  if (scheme_str != "ckks" && scheme_str != "bgv")
+    throw std::runtime_error("error: unknown scheme '" + scheme_str + "'");
+  bool exact = scheme_str == "bgv";
+  verification.mode = parseVerifyMode(verify_str);
+  verification.exact =
+      exact && (op == OP_HADD || op == OP_HMUL || op == OP_PMUL);
+  if (!verification.rounds)
+    throw std::runtime_error("error: invalid number of verification rounds");
 
-  if (op == OP_HADD || op == OP_HMUL) {
-    EncContextOptions opts(4 * a_columns, 119, 20, 2);
-    enc_protocol = std::make_unique<EncryptionProtocol>(&tcp_protocol, opts);
+  if (op == OP_HADD || op == OP_HMUL || op == OP_PMUL) {
+    if (hybrid_protocol)
+      throw std::runtime_error("error: " + operation_str +
+                               " is not supported in hybrid mode");
+    /* inputs are in [-100; 100], hmul results are prefix sums of columns */
+    unsigned magnitude_bits =
+        op == OP_HADD ? 8 : 14 + std::ceil(std::log2(a_columns));
+    if (op == OP_HMUL)
+      magnitude_bits += std::ceil(std::log2(b_columns));
+    auto row_width = std::max(a_columns, b_columns);
+    PlanRequest plan =
+        exact ? PlanRequest::bgv(op, row_width, magnitude_bits, security,
+                                 plaintext_modulus)
+              : PlanRequest(op, row_width, precision, magnitude_bits,
+                            security);
+    auto opts = autotune_file.empty()
+                    ? planParameters(plan)
+                    : autotune(plan, autotune_file, &std::cout);
+    if (exact)
+      std::cout << operation_str << ": BGV m " << opts.m << " p " << opts.p
+                << " bits " << opts.bits << " c " << opts.c << std::endl;
+    else
+      std::cout << operation_str << ": CKKS m " << opts.m << " bits "
+                << opts.bits << " precision " << opts.precision << " c "
+                << opts.c << std::endl;
+    auto keys = keystore_dir.empty() ? KeySet::generate(opts)
+                                     : KeyStore(keystore_dir).get(opts);
+    if (!vm.count("no-budget-check")) {
+      auto probe = probeParameters(plan, *keys);
+      std::cout << std::setprecision(1) << std::fixed << operation_str
+                << ": probe leaves " << projectedCapacity(plan, probe)
+                << " bits of capacity" << std::endl;
+      checkBudget(plan, probe);
+    }
+    enc_protocol = std::make_unique<EncryptionProtocol>(&tcp_protocol, keys);
     protocol = enc_protocol.get();
   }
 
   for (auto &&addr : worker_addrs)
     tcp_protocol.addWorker(addr);
+  if (!workers_file.empty())
+    tcp_protocol.watchWorkersFile(workers_file);
+  auto configure = [&](auto &operation) {
+    if (speculate)
+      operation.enableSpeculation(speculate);
+    if (rebalance)
+      operation.enableRebalancing(rebalance);
+  };
+
+  if (stream) {
+    runStreaming(op, op == OP_ECHO ? *plain_protocol : *protocol, mapped_a,
+                 mapped_b, out_file, tile_rows, verification);
+    report_hybrid();
+    return 0;
+  }
 
   if (op == OP_ECHO) {
-    Echo echo(tcp_protocol);
+    Echo echo(*plain_protocol);
+    configure(echo);
     auto matrix = Matrix<double>::random(a_rows, a_columns);
     std::cout << "echo: matrix [" << matrix.rows() << " x " << matrix.columns()
               << "]" << std::endl;
@@ -92,9 +344,93 @@ int main(int argc, char *argv[]) try {
       print(matrix, "input");
       print(res, "result");
     }
-    if (!std::equal(matrix.begin(), matrix.end(), res.begin()))
-      throw std::runtime_error("echo: data mismatch!");
-    std::cout << "echo: success!" << std::endl;
+    if (verification.mode != VERIFY_NONE) {
+      if (!identical(matrix.data(), res.data(), matrix.size()))
+        throw std::runtime_error("echo: data mismatch!");
+      std::cout << "echo: success!" << std::endl;
+    }
+    report_hybrid();
+    return 0;
+  }
+
+  if (op == OP_BATCHED_MUL) {
+    if (a_columns != b_rows)
+      throw std::runtime_error("error: incompatible matrix sizes");
+    BatchShape shape{a_rows, a_columns, b_columns};
+    auto As = Matrix<double>::random(batch, a_rows * a_columns);
+    auto Bs = Matrix<double>::random(batch, b_rows * b_columns);
+    std::cout << "bmul: " << batch << " products of [" << a_rows << " x "
+              << a_columns << "] by [" << b_rows << " x " << b_columns << "]"
+              << std::endl;
+    BatchedMultiplier<double> multiplier(*plain_protocol);
+    configure(multiplier);
+    auto start = std::chrono::steady_clock::now();
+    auto res = multiplier.multiply(As, Bs, shape);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    double flops = 2.0 * batch * a_rows * a_columns * b_columns;
+    std::cout << std::setprecision(3) << std::fixed;
+    std::cout << "bmul: " << elapsed.count() << " s, "
+              << batch / elapsed.count() << " products/s, "
+              << flops / elapsed.count() * 1e-9 << " GFLOP/s" << std::endl;
+
+    if (verification.mode != VERIFY_NONE) {
+      ErrorSum error;
+      Matrix<double> A(a_rows, a_columns), B(b_rows, b_columns),
+          C(a_rows, b_columns);
+      for (unsigned i = 0; i < batch; ++i) {
+        std::copy(As.beginRow(i), As.endRow(i), A.begin());
+        std::copy(Bs.beginRow(i), Bs.endRow(i), B.begin());
+        if (verification.mode == VERIFY_FAST) {
+          std::copy(res.beginRow(i), res.endRow(i), C.begin());
+          error += freivalds(A, B, C, verification.rounds);
+        } else {
+          auto expected = A * B;
+          error += compareArrays(expected.data(), res.beginRow(i),
+                                 expected.size());
+        }
+      }
+      checkError("bmul", error, verification);
+    }
+    report_hybrid();
+    return 0;
+  }
+
+  if (op == OP_ELEMENTWISE) {
+    auto chain = parseChain(chain_str);
+    chain.Reduce = parseReduction(reduce_str);
+    std::vector<Matrix<double>> matrices;
+    std::vector<const Matrix<double> *> operands;
+    for (unsigned i = 0; i < chain.operandCount(); ++i)
+      matrices.push_back(Matrix<double>::random(a_rows, a_columns));
+    for (auto &&M : matrices)
+      operands.push_back(&M);
+    std::cout << "map: " << operands.size() << " matrices [" << a_rows
+              << " x " << a_columns << "], chain '" << chain_str
+              << "', reduction " << toString(chain.Reduce) << std::endl;
+    ElementwiseOperation<double> elementwise(*plain_protocol);
+    configure(elementwise);
+    auto res = elementwise.run(chain, operands);
+    std::cout << "map: result [" << res.rows() << " x " << res.columns()
+              << "]" << std::endl;
+    if (show_data)
+      print(res, "result");
+
+    if (verification.mode != VERIFY_NONE) {
+      /* the same chain computed here with scalar kernels */
+      std::vector<const double *> data;
+      for (auto *M : operands)
+        data.push_back(M->data());
+      Matrix<double> expected(res.rows(), res.columns());
+      runElementwise(chain, data.data(), a_rows, a_columns, expected.data(),
+                     0, simd::kernels<double>(simd::SCALAR));
+      finishReduction(chain.Reduce, expected.data(), expected.size());
+      checkError("map",
+                 compareArrays(expected.data(), res.data(), res.size()),
+                 verification);
+    }
+    report_hybrid();
     return 0;
   }
 
@@ -112,35 +448,54 @@ int main(int argc, char *argv[]) try {
     if (a_rows != b_rows || a_columns != b_columns)
       throw std::runtime_error("error: incompatible matrix sizes");
     Adder adder(*protocol);
+    configure(adder);
     res = adder.add(A, B);
-    expected_res = A + B;
+    if (show_data)
+      expected_res = A + B;
   } else if (op == OP_MUL || op == OP_HMUL) {
     if (a_columns != b_rows)
       throw std::runtime_error("error: incompatible matrix sizes");
-    if (op == OP_HMUL && (a_rows != a_columns || b_rows != b_columns))
-      throw std::runtime_error("error: non-square matricies not supported in hmul");
+    /* hmul encrypts B column by column */
+    if (op == OP_HMUL)
+      B.setOrder(COLUMN_MAJOR);
     Multiplier multiplier(*protocol);
+    configure(multiplier);
     res = multiplier.multiply(A, B);
-    expected_res = A * B;
     if (op == OP_HMUL)
       undiff(res);
+  } else if (op == OP_PMUL) {
+    if (a_columns != b_rows)
+      throw std::runtime_error("error: incompatible matrix sizes");
+    PlainWeightsMultiplier multiplier(*enc_protocol);
+    configure(multiplier);
+    res = multiplier.multiply(A, B);
   } else {
     throw std::runtime_error("unsupported operation");
   }
+  if (enc_protocol)
+    reportNoiseBudget(operation_str, enc_protocol->getNoiseBudget());
 
+  bool is_product = op != OP_ADD && op != OP_HADD;
+  /* full check and printing need the expected product */
+  if (is_product && (show_data || verification.mode == VERIFY_FULL))
+    expected_res = A * B;
   if (show_data) {
     print(A, "A");
     print(B, "B");
     print(res, "result");
     print(expected_res, "expected");
   }
-  auto abssum = std::accumulate(
-      expected_res.begin(), expected_res.end(), 0.0,
-      [](double acc, double value) { return acc + std::fabs(value); });
-  auto distance = dist(expected_res, res);
-  auto eps = distance / abssum;
-  std::cout << std::setprecision(3) << std::fixed;
-  std::cout << operation_str << ": eps " << eps << std::endl;
+  if (verification.mode != VERIFY_NONE) {
+    ErrorSum error;
+    if (!is_product)
+      error = compareSum(A.data(), B.data(), res.data(), res.size());
+    else if (verification.mode == VERIFY_FAST)
+      error = freivalds(A, B, res, verification.rounds);
+    else
+      error = compareArrays(expected_res.data(), res.data(), res.size());
+    checkError(operation_str, error, verification);
+  }
+  report_hybrid();
   return 0;
 } catch (std::exception &e) {
   std::cerr << e.what() << std::endl;
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <vector>
+
+namespace dhm {
+
+/* Size-classed pool of 64-byte aligned memory blocks. Freed blocks are kept
+ * in per-class free lists and reused, so that steady-state allocations
+ * neither call malloc nor fault in fresh pages.
+ *
+ * Every power of two is split into 4 classes, so at most 25% of a block is
+ * wasted. Thread-safe
+ */
+class BufferPool {
+public:
+  static constexpr size_t Alignment = 64;
+  static constexpr size_t MinBlockSize = 64;
+  static constexpr unsigned ClassesPerOctave = 4;
+  static constexpr unsigned NumClasses = 58 * ClassesPerOctave + 1;
+
+  /* enough for steady-state tiles, see configure() for larger working sets */
+  static constexpr size_t DefaultMaxCachedBytes = size_t(64) << 20;
+
+  /* total size of cached free blocks, extra ones are returned to system */
+  explicit BufferPool(size_t max_cached_bytes = DefaultMaxCachedBytes)
+      : max_cached_bytes(max_cached_bytes) {}
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+  ~BufferPool() { trim(); }
+
+  static BufferPool &global() {
+    static BufferPool pool;
+    return pool;
+  }
+
+  void *allocate(size_t size) {
+    auto cls = sizeClass(size);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto &free_list = free_lists[cls];
+      if (!free_list.empty()) {
+        void *ptr = free_list.back();
+        free_list.pop_back();
+        cached_bytes -= classSize(cls);
+        return ptr;
+      }
+    }
+    void *ptr = std::aligned_alloc(Alignment, classSize(cls));
+    if (!ptr)
+      throw std::bad_alloc();
+    return ptr;
+  }
+
+  /* size must be the same as passed to allocate() */
+  void deallocate(void *ptr, size_t size) {
+    if (!ptr)
+      return;
+    auto cls = sizeClass(size);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (cached_bytes + classSize(cls) <= max_cached_bytes) {
+        free_lists[cls].push_back(ptr);
+        cached_bytes += classSize(cls);
+        return;
+      }
+    }
+    std::free(ptr);
+  }
+
+  /* Change the cap on cached free blocks, largest ones are returned to system
+   * until the cache fits into the new cap
+   */
+  void configure(size_t new_max_cached_bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    max_cached_bytes = new_max_cached_bytes;
+    for (unsigned cls = NumClasses;
+         cls-- > 0 && cached_bytes > max_cached_bytes;) {
+      auto &free_list = free_lists[cls];
+      while (!free_list.empty() && cached_bytes > max_cached_bytes) {
+        std::free(free_list.back());
+        free_list.pop_back();
+        cached_bytes -= classSize(cls);
+      }
+    }
+  }
+
+  size_t getMaxCachedBytes() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return max_cached_bytes;
+  }
+
+  /* Return all cached blocks to system */
+  void trim() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &&free_list : free_lists) {
+      for (void *ptr : free_list)
+        std::free(ptr);
+      free_list.clear();
+    }
+    cached_bytes = 0;
+  }
+
+  static unsigned sizeClass(size_t size) {
+    if (size <= MinBlockSize)
+      return 0;
+    /* size lies in (2^octave; 2^(octave+1)] */
+    unsigned octave = 63 - __builtin_clzll(size - 1);
+    size_t step = (size_t(1) << octave) / ClassesPerOctave;
+    unsigned sub = (size - 1 - (size_t(1) << octave)) / step;
+    return (octave - 6) * ClassesPerOctave + sub + 1;
+  }
+
+  static size_t classSize(unsigned cls) {
+    if (cls == 0)
+      return MinBlockSize;
+    unsigned octave = (cls - 1) / ClassesPerOctave + 6;
+    unsigned sub = (cls - 1) % ClassesPerOctave;
+    size_t step = (size_t(1) << octave) / ClassesPerOctave;
+    size_t size = (size_t(1) << octave) + (sub + 1) * step;
+    /* aligned_alloc requires size to be multiple of alignment */
+    return (size + Alignment - 1) / Alignment * Alignment;
+  }
+
+private:
+  std::mutex mutex;
+  std::array<std::vector<void *>, NumClasses> free_lists;
+  size_t cached_bytes = 0;
+  size_t max_cached_bytes;
+};
+
+/* Standard allocator drawing 64-byte aligned memory from the global pool */
+template <class T> struct PoolAllocator {
+  using value_type = T;
+
+  PoolAllocator() = default;
+  template <class U> PoolAllocator(const PoolAllocator<U> &) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(BufferPool::global().allocate(n * sizeof(T)));
+  }
+  void deallocate(T *ptr, size_t n) {
+    BufferPool::global().deallocate(ptr, n * sizeof(T));
+  }
+
+  template <class U> bool operator==(const PoolAllocator<U> &) const {
+    return true;
+  }
+  template <class U> bool operator!=(const PoolAllocator<U> &) const {
+    return false;
+  }
+};
+
+/* Uninitialized byte buffer taken from the global pool */
+class Buffer {
+  char *ptr = nullptr;
+  size_t sz = 0;
+
+public:
+  Buffer() = default;
+  explicit Buffer(size_t size)
+      : ptr(static_cast<char *>(BufferPool::global().allocate(size))),
+        sz(size) {}
+  Buffer(const Buffer &) = delete;
+  Buffer &operator=(const Buffer &) = delete;
+  Buffer(Buffer &&Other) { *this = std::move(Other); }
+  Buffer &operator=(Buffer &&Other) {
+    std::swap(ptr, Other.ptr);
+    std::swap(sz, Other.sz);
+    return *this;
+  }
+  ~Buffer() { BufferPool::global().deallocate(ptr, sz); }
+
+  char *data() { return ptr; }
+  const char *data() const { return ptr; }
+  size_t size() const { return sz; }
+  bool empty() const { return !sz; }
+  std::string_view view() const { return std::string_view(ptr, sz); }
+};
+
+/* Bump allocator over pool blocks for short-lived data, e.g. everything
+ * allocated while processing one request. Memory is released all at once
+ * by reset(), individual deallocations are no-op. Not thread-safe
+ */
+class Arena {
+  static constexpr size_t BlockSize = 1 << 20;
+
+  struct Block {
+    char *ptr;
+    size_t size;
+  };
+  std::vector<Block> blocks;
+  /* bytes used in the last block */
+  size_t used = 0;
+
+public:
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+  ~Arena() { reset(); }
+
+  void *allocate(size_t size, size_t align = BufferPool::Alignment) {
+    assert(align <= BufferPool::Alignment && "unsupported alignment");
+    size_t offset = (used + align - 1) / align * align;
+    if (blocks.empty() || offset + size > blocks.back().size) {
+      /* large allocations get dedicated block */
+      size_t block_size = std::max(size, BlockSize);
+      blocks.push_back(Block{
+          static_cast<char *>(BufferPool::global().allocate(block_size)),
+          block_size});
+      offset = 0;
+    }
+    used = offset + size;
+    return blocks.back().ptr + offset;
+  }
+
+  /* Return all memory to the pool */
+  void reset() {
+    for (auto &&block : blocks)
+      BufferPool::global().deallocate(block.ptr, block.size);
+    blocks.clear();
+    used = 0;
+  }
+};
+
+/* Standard allocator over Arena, which must outlive all allocated data */
+template <class T> struct ArenaAllocator {
+  using value_type = T;
+
+  Arena *arena;
+
+  ArenaAllocator(Arena &a) : arena(&a) {}
+  template <class U>
+  ArenaAllocator(const ArenaAllocator<U> &Other) : arena(Other.arena) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(arena->allocate(n * sizeof(T)));
+  }
+  void deallocate(T *, size_t) {}
+
+  template <class U> bool operator==(const ArenaAllocator<U> &Other) const {
+    return arena == Other.arena;
+  }
+  template <class U> bool operator!=(const ArenaAllocator<U> &Other) const {
+    return arena != Other.arena;
+  }
+};
+
+} // namespace dhm
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace dhm {
+
+/* Kernels multiplying many small row-major matrices, C_i = A_i * B_i with
+ * A_i of [M x K] and B_i of [K x N]. Items of a batch are stored back to
+ * back in contiguous buffers
+ */
+
+/* Kernel for one item, dimensions are ignored by fixed-size kernels */
+template <class T>
+using SmallGemmKernel = void (*)(const T *A, const T *B, T *C, unsigned M,
+                                 unsigned K, unsigned N);
+
+/* Generic kernel for any shape. Rows of B are scaled and accumulated into
+ * the result row, so all accesses are contiguous
+ */
+template <class T>
+void smallGemm(const T *__restrict A, const T *__restrict B, T *__restrict C,
+               unsigned M, unsigned K, unsigned N) {
+  for (unsigned I = 0; I < M; ++I) {
+    T *Row = C + size_t(I) * N;
+    std::fill_n(Row, N, T(0));
+    for (unsigned P = 0; P < K; ++P) {
+      T Scale = A[size_t(I) * K + P];
+      const T *BRow = B + size_t(P) * N;
+      for (unsigned J = 0; J < N; ++J)
+        Row[J] += Scale * BRow[J];
+    }
+  }
+}
+
+/* Same loops with compile-time bounds, so that the compiler unrolls and
+ * vectorizes them for the exact shape
+ */
+template <class T, unsigned M, unsigned K, unsigned N>
+void smallGemmFixed(const T *__restrict A, const T *__restrict B,
+                    T *__restrict C, unsigned, unsigned, unsigned) {
+  for (unsigned I = 0; I < M; ++I) {
+    T *Row = C + I * N;
+    for (unsigned J = 0; J < N; ++J)
+      Row[J] = A[I * K] * B[J];
+#pragma GCC unroll 16
+    for (unsigned P = 1; P < K; ++P) {
+      T Scale = A[I * K + P];
+      for (unsigned J = 0; J < N; ++J)
+        Row[J] += Scale * B[P * N + J];
+    }
+  }
+}
+
+/* Square shapes with a fixed-size kernel */
+constexpr unsigned MinFixedGemm = 2;
+constexpr unsigned MaxFixedGemm = 64;
+
+template <class T, unsigned... Offsets>
+const SmallGemmKernel<T> *
+fixedSquareKernels(std::integer_sequence<unsigned, Offsets...>) {
+  static const SmallGemmKernel<T> Kernels[] = {
+      &smallGemmFixed<T, MinFixedGemm + Offsets, MinFixedGemm + Offsets,
+                      MinFixedGemm + Offsets>...};
+  return Kernels;
+}
+
+/* Specialized kernel for square shapes of MinFixedGemm..MaxFixedGemm,
+ * generic one otherwise
+ */
+template <class T>
+SmallGemmKernel<T> selectSmallGemm(unsigned M, unsigned K, unsigned N) {
+  if (M == K && K == N && M >= MinFixedGemm && M <= MaxFixedGemm)
+    return fixedSquareKernels<T>(
+        std::make_integer_sequence<unsigned,
+                                   MaxFixedGemm - MinFixedGemm + 1>())
+        [M - MinFixedGemm];
+  return &smallGemm<T>;
+}
+
+/* Batches with fewer multiply-adds are processed in the calling thread */
+constexpr size_t ParallelBatchThreshold = 1 << 20;
+
+/* C_i = A_i * B_i for Count items. Items are split among Threads threads,
+ * 0 means hardware concurrency
+ */
+template <class T>
+void batchedGemm(const T *A, const T *B, T *C, size_t Count, unsigned M,
+                 unsigned K, unsigned N, unsigned Threads = 0) {
+  auto Kernel = selectSmallGemm<T>(M, K, N);
+  size_t ASize = size_t(M) * K, BSize = size_t(K) * N, CSize = size_t(M) * N;
+  if (!Threads)
+    Threads = std::max(1u, std::thread::hardware_concurrency());
+  if (Count * ASize * N < ParallelBatchThreshold)
+    Threads = 1;
+  Threads = std::max<size_t>(1, std::min<size_t>(Threads, Count));
+
+  auto Run = [=](size_t First, size_t Last) {
+    for (size_t I = First; I < Last; ++I)
+      Kernel(A + I * ASize, B + I * BSize, C + I * CSize, M, K, N);
+  };
+  std::vector<std::thread> Workers;
+  for (unsigned Thread = 1; Thread < Threads; ++Thread)
+    Workers.emplace_back(Run, Count * Thread / Threads,
+                         Count * (Thread + 1) / Threads);
+  Run(0, Count / Threads);
+  for (auto &&W : Workers)
+    W.join();
+}
+
+} // namespace dhm
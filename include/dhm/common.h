@@ -1,9 +1,16 @@
 #pragma once
 
 #include <boost/array.hpp>
+#include "frame.h"
+#include "matrix.h"
 #include <boost/asio.hpp>
 #include <helib/helib.h>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <memory>
+#include <streambuf>
+#include <string_view>
 
 namespace dhm {
 
@@ -11,15 +18,13 @@ using boost::asio::ip::tcp;
 
 template <class DataT> DataT receive(tcp::socket &socket) {
   DataT value;
-  auto sz = socket.receive(boost::asio::buffer(&value, sizeof value));
-  assert(sz == sizeof value);
+  boost::asio::read(socket, boost::asio::buffer(&value, sizeof value));
   return value;
 }
 
 /* receive value unless eof reached */
 template <class DataT> bool try_receive(DataT &value, tcp::socket &socket) try {
-  auto sz = socket.receive(boost::asio::buffer(&value, sizeof value));
-  assert(sz == sizeof value);
+  boost::asio::read(socket, boost::asio::buffer(&value, sizeof value));
   return true;
 } catch (boost::system::system_error &e) {
   if (e.code() == boost::asio::error::eof)
@@ -28,25 +33,15 @@ template <class DataT> bool try_receive(DataT &value, tcp::socket &socket) try {
 }
 
 template <class DataT> void send(const DataT &value, tcp::socket &socket) {
-  socket.send(boost::asio::buffer(&value, sizeof value));
+  boost::asio::write(socket, boost::asio::buffer(&value, sizeof value));
 }
 
-inline void send_buf(const void *data, unsigned size, tcp::socket &socket) {
-  const char *ptr = (const char *)data;
-  while (size > 0) {
-    size_t chunk_sz = socket.send(boost::asio::buffer(ptr, size));
-    size -= chunk_sz;
-    ptr += chunk_sz;
-  }
+inline void send_buf(const void *data, size_t size, tcp::socket &socket) {
+  boost::asio::write(socket, boost::asio::buffer(data, size));
 }
 
-inline void receive_buf(void *data, unsigned size, tcp::socket &socket) {
-  char *ptr = (char *)data;
-  while (size > 0) {
-    auto chunk_sz = socket.receive(boost::asio::buffer(ptr, size));
-    size -= chunk_sz;
-    ptr += chunk_sz;
-  }
+inline void receive_buf(void *data, size_t size, tcp::socket &socket) {
+  boost::asio::read(socket, boost::asio::buffer(data, size));
 }
 
 template <class DataT>
@@ -55,13 +50,22 @@ void send_buf(const std::vector<DataT> &data, tcp::socket &socket) {
 }
 
 template <class DataT>
-std::vector<DataT> receive_buf(unsigned size, tcp::socket &socket) {
+std::vector<DataT> receive_buf(size_t size, tcp::socket &socket) {
   std::vector<DataT> data(size);
   receive_buf(data.data(), size * sizeof(DataT), socket);
   return data;
 }
 
-enum Operation : unsigned { OP_ECHO, OP_ADD, OP_MUL, OP_HADD, OP_HMUL };
+enum Operation : unsigned {
+  OP_ECHO,
+  OP_ADD,
+  OP_MUL,
+  OP_HADD,
+  OP_HMUL,
+  OP_PMUL,        /* encrypted A times plaintext B */
+  OP_BATCHED_MUL, /* many small independent products, see BatchShape */
+  OP_ELEMENTWISE, /* element-wise chain and reduction, see elementwise.h */
+};
 
 inline const char *opToString(Operation op) {
   switch (op) {
@@ -75,6 +79,12 @@ inline const char *opToString(Operation op) {
     return "hadd";
   case OP_HMUL:
     return "hmul";
+  case OP_PMUL:
+    return "pmul";
+  case OP_BATCHED_MUL:
+    return "bmul";
+  case OP_ELEMENTWISE:
+    return "map";
   default:
     return "<invalid_operation>";
   }
@@ -91,43 +101,99 @@ inline Operation parseOperation(const std::string &op) {
     return OP_HADD;
   if (op == "hmul")
     return OP_HMUL;
+  if (op == "pmul")
+    return OP_PMUL;
+  if (op == "bmul")
+    return OP_BATCHED_MUL;
+  if (op == "map")
+    return OP_ELEMENTWISE;
   throw std::runtime_error("invalid operation '" + op + "'");
 }
 
 struct MatrixHeader {
   std::array<unsigned, 2> data;
+  /* storage order of the payload following the header */
+  StorageOrder order = ROW_MAJOR;
+
   unsigned &rows() { return data[0]; }
   unsigned &columns() { return data[1]; }
 
   MatrixHeader() = default;
-  MatrixHeader(unsigned r, unsigned c) {
+  MatrixHeader(unsigned r, unsigned c, StorageOrder order = ROW_MAJOR)
+      : order(order) {
     data[0] = r;
     data[1] = c;
   }
 
-  void send(tcp::socket &socket) {
-    auto sz = socket.send(boost::asio::buffer(data));
+  size_t size() const { return size_t(data[0]) * data[1]; }
+
+  /* number of contiguous rows or columns and their length */
+  unsigned lines() const { return order == ROW_MAJOR ? data[0] : data[1]; }
+  unsigned lineSize() const {
+    return order == ROW_MAJOR ? data[1] : data[0];
+  }
+
+  void write(PayloadWriter &out) const {
+    out.write(data);
+    out.write(order);
   }
-  static MatrixHeader receive(tcp::socket &socket) {
+  static MatrixHeader read(PayloadReader &in) {
     MatrixHeader hdr;
-    size_t sz = 0;
-    sz = socket.receive(boost::asio::buffer(hdr.data));
-    assert(sz == sizeof(unsigned) * 2);
+    hdr.data = in.read<decltype(data)>();
+    hdr.order = in.read<StorageOrder>();
+    if (hdr.order != ROW_MAJOR && hdr.order != COLUMN_MAJOR)
+      throw std::runtime_error("invalid storage order");
     return hdr;
   }
 };
+static_assert(sizeof(MatrixHeader) == 12, "unexpected MatrixHeader padding");
+
+/* OP_BATCHED_MUL request is BatchShape followed by [count x m*k] matrix of
+ * A_i and [count x k*n] matrix of B_i, one row-major item per row. Result is
+ * [count x m*n] matrix of A_i * B_i
+ */
+struct BatchShape {
+  unsigned m;
+  unsigned k;
+  unsigned n;
+};
+
+enum EncScheme : unsigned {
+  SCHEME_CKKS, /* approximate arithmetic on reals */
+  SCHEME_BGV,  /* exact arithmetic on integers modulo p */
+};
 
 struct EncContextOptions {
+  EncScheme scheme = SCHEME_CKKS;
   unsigned m;
   unsigned bits;
-  unsigned precision;
+  /* CKKS only */
+  unsigned precision = 0;
   unsigned c;
+  /* BGV only: plaintext modulus. Values are decoded into (-p/2; p/2] */
+  unsigned p = 0;
 
   EncContextOptions() = default;
   EncContextOptions(unsigned m, unsigned bits, unsigned precision, unsigned c)
       : m(m), bits(bits), precision(precision), c(c) {}
 
+  static EncContextOptions bgv(unsigned m, unsigned bits, unsigned c,
+                               unsigned p) {
+    EncContextOptions opts(m, bits, 0, c);
+    opts.scheme = SCHEME_BGV;
+    opts.p = p;
+    return opts;
+  }
+
   helib::Context buildContext() const {
+    if (scheme == SCHEME_BGV)
+      return helib::ContextBuilder<helib::BGV>()
+          .m(m)
+          .p(p)
+          .r(1)
+          .bits(bits)
+          .c(c)
+          .build();
     return helib::ContextBuilder<helib::CKKS>()
         .m(m)
         .bits(bits)
@@ -135,7 +201,27 @@ struct EncContextOptions {
         .c(c)
         .build();
   }
+
+  std::unique_ptr<helib::Context> buildContextPtr() const {
+    if (scheme == SCHEME_BGV)
+      return std::unique_ptr<helib::Context>(helib::ContextBuilder<helib::BGV>()
+                                                 .m(m)
+                                                 .p(p)
+                                                 .r(1)
+                                                 .bits(bits)
+                                                 .c(c)
+                                                 .buildPtr());
+    return std::unique_ptr<helib::Context>(
+        helib::ContextBuilder<helib::CKKS>()
+            .m(m)
+            .bits(bits)
+            .precision(precision)
+            .c(c)
+            .buildPtr());
+  }
 };
+static_assert(sizeof(EncContextOptions) == 24,
+              "unexpected EncContextOptions padding");
 
 inline std::string stringify(const helib::Ctxt &c) {
   std::ostringstream os;
@@ -149,36 +235,67 @@ inline std::string stringify(const helib::PubKey &pk) {
   return os.str();
 }
 
+/* BGV plaintexts are integers, values are rounded */
+inline helib::PtxtArray encode(const helib::Context &context,
+                               const std::vector<double> &data) {
+  if (context.isCKKS())
+    return helib::PtxtArray(context, data);
+  std::vector<long> values(data.size());
+  std::transform(data.begin(), data.end(), values.begin(),
+                 [](double value) { return std::lround(value); });
+  return helib::PtxtArray(context, values);
+}
+
 inline helib::Ctxt encrypt(const std::vector<double> &data,
                            const helib::PubKey &pk) {
-  helib::PtxtArray m(pk.getContext(), data);
+  auto m = encode(pk.getContext(), data);
   helib::Ctxt c(pk);
   m.encrypt(c);
   return c;
 }
 
 inline std::vector<double> decrypt(const helib::Ctxt &c, const helib::SecKey &sk) {
-  helib::PtxtArray res(sk.getContext());
+  auto &context = sk.getContext();
+  helib::PtxtArray res(context);
   res.decrypt(c, sk);
   std::vector<double> vres;
-  res.store(vres);
+  if (context.isCKKS()) {
+    res.store(vres);
+    return vres;
+  }
+  std::vector<long> values;
+  res.store(values);
+  long p = context.getP();
+  for (auto value : values)
+    vres.push_back(value > p / 2 ? value - p : value);
   return vres;
 }
 
-inline helib::Ctxt readCtxt(const helib::PubKey &pk, const std::vector<char> &text) {
-  std::string str(text.begin(), text.end());
-  std::istringstream is(str);
+/* Read-only streambuf over external memory, allows deserializing received
+ * data without copying it into std::string first
+ */
+class MemoryStreamBuf : public std::streambuf {
+public:
+  explicit MemoryStreamBuf(std::string_view text) {
+    char *ptr = const_cast<char *>(text.data());
+    setg(ptr, ptr, ptr + text.size());
+  }
+};
+
+inline helib::Ctxt readCtxt(const helib::PubKey &pk, std::string_view text) {
+  MemoryStreamBuf buf(text);
+  std::istream is(&buf);
   return helib::Ctxt::readFrom(is, pk);
 }
 
-inline helib::Ctxt readCtxt(const helib::PubKey &pk, const std::string &text) {
-  std::istringstream is(text);
-  return helib::Ctxt::readFrom(is, pk);
+inline helib::Ctxt readCtxt(const helib::PubKey &pk, const std::vector<char> &text) {
+  return readCtxt(pk, std::string_view(text.data(), text.size()));
 }
 
 inline helib::PubKey readKey(const helib::Context &ctx,
-                             const std::string &text) {
-  std::istringstream is(text);
+                             std::string_view text) {
+  MemoryStreamBuf buf(text);
+  std::istream is(&buf);
   return helib::PubKey::readFrom(is, ctx);
 }
 
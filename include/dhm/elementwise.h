@@ -0,0 +1,490 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace dhm {
+
+/* Element-wise operations on equally sized matrices, applied as a short
+ * chain in one pass over operands, optionally followed by a reduction.
+ * The chain starts with the first operand X, steps taking an operand use
+ * the next operand matrix as B, scalar a is given per step
+ */
+enum ElementwiseOp : uint32_t {
+  EW_ADD,    /* X + B */
+  EW_SUB,    /* X - B */
+  EW_MUL,    /* X * B, Hadamard product */
+  EW_AXPY,   /* a * X + B */
+  EW_SCALE,  /* a * X */
+  EW_SHIFT,  /* X + a */
+  EW_RELU,   /* max(X, 0) */
+  EW_ABS,    /* |X| */
+  EW_SQUARE, /* X * X */
+  EW_OP_COUNT
+};
+
+constexpr bool takesOperand(ElementwiseOp Op) { return Op <= EW_AXPY; }
+
+/* Row reductions give [rows x 1] result. Others are computed by every
+ * worker over its rows and combined by the client, see combinePartial()
+ */
+enum Reduction : uint32_t {
+  RED_NONE,
+  RED_ROW_SUM,
+  RED_ROW_NORM,   /* Euclidean norm of every row */
+  RED_ROW_MAX,
+  RED_COLUMN_SUM, /* [1 x columns] */
+  RED_SUM,        /* [1 x 1] */
+  RED_NORM,       /* Frobenius norm, [1 x 1] */
+  RED_MAX_ABS,    /* max |x|, [1 x 1] */
+  RED_COUNT
+};
+
+constexpr bool isRowReduction(Reduction R) {
+  return R == RED_ROW_SUM || R == RED_ROW_NORM || R == RED_ROW_MAX;
+}
+
+struct ElementwiseStep {
+  ElementwiseOp Op;
+  uint32_t Reserved;
+  double Scalar;
+};
+
+constexpr unsigned MaxChainLength = 8;
+
+/* OP_ELEMENTWISE request is the chain, sent as is, followed by
+ * operandCount() matrices of the same size. Result is the chain applied to
+ * them, or its reduction, see reducedShape()
+ */
+struct ElementwiseChain {
+  uint32_t Length = 0;
+  Reduction Reduce = RED_NONE;
+  ElementwiseStep Steps[MaxChainLength] = {};
+
+  ElementwiseChain &then(ElementwiseOp Op, double Scalar = 0) {
+    if (Length == MaxChainLength)
+      throw std::runtime_error("element-wise chain is too long");
+    Steps[Length++] = ElementwiseStep{Op, 0, Scalar};
+    return *this;
+  }
+
+  /* the first operand and one per step taking operand */
+  unsigned operandCount() const {
+    unsigned Count = 1;
+    for (unsigned I = 0; I < Length; ++I)
+      Count += takesOperand(Steps[I].Op);
+    return Count;
+  }
+
+  /* Throws if the chain came malformed over the wire */
+  void validate() const {
+    if (Length > MaxChainLength || Reduce >= RED_COUNT)
+      throw std::runtime_error("invalid element-wise chain");
+    for (unsigned I = 0; I < Length; ++I)
+      if (Steps[I].Op >= EW_OP_COUNT)
+        throw std::runtime_error("invalid element-wise operation");
+  }
+};
+static_assert(sizeof(ElementwiseChain) == 8 + 16 * MaxChainLength,
+              "chain is sent as is");
+
+inline const char *toString(ElementwiseOp Op) {
+  static const char *Names[] = {"add",   "sub", "mul", "axpy",  "scale",
+                                "shift", "relu", "abs", "square"};
+  return Op < EW_OP_COUNT ? Names[Op] : "unknown";
+}
+
+inline const char *toString(Reduction R) {
+  static const char *Names[] = {"none",       "row-sum", "row-norm",
+                                "row-max",    "column-sum", "sum",
+                                "norm",       "max-abs"};
+  return R < RED_COUNT ? Names[R] : "unknown";
+}
+
+inline Reduction parseReduction(const std::string &Name) {
+  for (uint32_t R = 0; R < RED_COUNT; ++R)
+    if (Name == toString(Reduction(R)))
+      return Reduction(R);
+  throw std::runtime_error("invalid reduction '" + Name + "'");
+}
+
+/* Comma-separated steps, scalar follows the colon: "sub,relu,scale:0.5" */
+inline ElementwiseChain parseChain(const std::string &Str) {
+  ElementwiseChain Chain;
+  size_t Pos = 0;
+  while (Pos < Str.size()) {
+    size_t End = std::min(Str.find(',', Pos), Str.size());
+    std::string Step = Str.substr(Pos, End - Pos);
+    size_t Colon = Step.find(':');
+    std::string Name = Step.substr(0, Colon);
+    double Scalar = Colon == std::string::npos
+                        ? 0
+                        : std::stod(Step.substr(Colon + 1));
+    uint32_t Op = 0;
+    while (Op < EW_OP_COUNT && Name != toString(ElementwiseOp(Op)))
+      ++Op;
+    if (Op == EW_OP_COUNT)
+      throw std::runtime_error("invalid element-wise operation '" + Name +
+                               "'");
+    Chain.then(ElementwiseOp(Op), Scalar);
+    Pos = End + 1;
+  }
+  return Chain;
+}
+
+/* Shape of the result of one worker for its [Rows x Cols] part */
+inline std::pair<size_t, size_t> reducedShape(Reduction R, size_t Rows,
+                                              size_t Cols) {
+  if (R == RED_NONE)
+    return {Rows, Cols};
+  if (isRowReduction(R))
+    return {Rows, 1};
+  if (R == RED_COLUMN_SUM)
+    return {1, Cols};
+  return {1, 1};
+}
+
+/* Merge partial result of one worker into Acc */
+template <class T>
+void combinePartial(Reduction R, T *Acc, const T *Partial, size_t Size) {
+  for (size_t I = 0; I < Size; ++I)
+    Acc[I] = R == RED_MAX_ABS ? std::max(Acc[I], Partial[I])
+                              : Acc[I] + Partial[I];
+}
+
+/* Partial norms are sums of squares */
+template <class T> void finishReduction(Reduction R, T *Acc, size_t Size) {
+  if (R == RED_NORM)
+    for (size_t I = 0; I < Size; ++I)
+      Acc[I] = std::sqrt(Acc[I]);
+}
+
+namespace simd {
+
+/* Kernels are written once over GCC vector types of Bytes bytes and
+ * compiled for every instruction set by wrappers with target attribute.
+ * Vectors are never passed by value, so that the kernels are always
+ * inlined into the wrappers and get their instruction set
+ */
+template <class T, unsigned Bytes> struct Vec {
+  typedef T Type
+      __attribute__((vector_size(Bytes), aligned(alignof(T)), may_alias));
+};
+
+template <ElementwiseOp Op, class V, class T>
+[[gnu::always_inline]] inline void step(V &X, const V &B, T A) {
+  if constexpr (Op == EW_ADD)
+    X = X + B;
+  else if constexpr (Op == EW_SUB)
+    X = X - B;
+  else if constexpr (Op == EW_MUL)
+    X = X * B;
+  else if constexpr (Op == EW_AXPY)
+    X = A * X + B;
+  else if constexpr (Op == EW_SCALE)
+    X = A * X;
+  else if constexpr (Op == EW_SHIFT)
+    X = X + A;
+  else if constexpr (Op == EW_RELU)
+    X = X > 0 ? X : V{};
+  else if constexpr (Op == EW_ABS)
+    X = X < 0 ? -X : X;
+  else if constexpr (Op == EW_SQUARE)
+    X = X * X;
+}
+
+/* X = Op(X, B) for N elements, B is unused by operations without operand */
+template <class T, unsigned Bytes, ElementwiseOp Op>
+[[gnu::always_inline]] inline void mapLoop(T *X, const T *B, T A, size_t N) {
+  using V = typename Vec<T, Bytes>::Type;
+  constexpr size_t W = Bytes / sizeof(T);
+  size_t I = 0;
+  for (; I + W <= N; I += W) {
+    V &XV = *reinterpret_cast<V *>(X + I);
+    if constexpr (takesOperand(Op))
+      step<Op>(XV, *reinterpret_cast<const V *>(B + I), A);
+    else
+      step<Op>(XV, XV, A);
+  }
+  for (; I < N; ++I)
+    step<Op>(X[I], takesOperand(Op) ? B[I] : X[I], A);
+}
+
+template <class T, unsigned Bytes>
+[[gnu::always_inline]] inline void applyChain(const ElementwiseChain &Chain,
+                                              const T *const *Operands,
+                                              T *X, size_t N) {
+  unsigned K = 0;
+  for (unsigned S = 0; S < Chain.Length; ++S) {
+    auto Op = Chain.Steps[S].Op;
+    const T *B = takesOperand(Op) ? Operands[K++] : nullptr;
+    T A = T(Chain.Steps[S].Scalar);
+    switch (Op) {
+    case EW_ADD:
+      mapLoop<T, Bytes, EW_ADD>(X, B, A, N);
+      break;
+    case EW_SUB:
+      mapLoop<T, Bytes, EW_SUB>(X, B, A, N);
+      break;
+    case EW_MUL:
+      mapLoop<T, Bytes, EW_MUL>(X, B, A, N);
+      break;
+    case EW_AXPY:
+      mapLoop<T, Bytes, EW_AXPY>(X, B, A, N);
+      break;
+    case EW_SCALE:
+      mapLoop<T, Bytes, EW_SCALE>(X, B, A, N);
+      break;
+    case EW_SHIFT:
+      mapLoop<T, Bytes, EW_SHIFT>(X, B, A, N);
+      break;
+    case EW_RELU:
+      mapLoop<T, Bytes, EW_RELU>(X, B, A, N);
+      break;
+    case EW_ABS:
+      mapLoop<T, Bytes, EW_ABS>(X, B, A, N);
+      break;
+    case EW_SQUARE:
+      mapLoop<T, Bytes, EW_SQUARE>(X, B, A, N);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+/* Basic reductions of N elements continuing from Acc */
+enum Fold { FOLD_SUM, FOLD_SUM_SQUARES, FOLD_MAX, FOLD_MAX_ABS };
+
+template <Fold F, class V>
+[[gnu::always_inline]] inline void fold(V &Acc, const V &X) {
+  if constexpr (F == FOLD_SUM)
+    Acc = Acc + X;
+  else if constexpr (F == FOLD_SUM_SQUARES)
+    Acc = Acc + X * X;
+  else if constexpr (F == FOLD_MAX)
+    Acc = X > Acc ? X : Acc;
+  else
+    Acc = (X < 0 ? -X : X) > Acc ? (X < 0 ? -X : X) : Acc;
+}
+
+template <class T, unsigned Bytes, Fold F>
+[[gnu::always_inline]] inline T foldLoop(const T *X, size_t N, T Acc) {
+  using V = typename Vec<T, Bytes>::Type;
+  constexpr size_t W = Bytes / sizeof(T);
+  size_t I = 0;
+  if (N >= W) {
+    V AccV = *reinterpret_cast<const V *>(X);
+    if constexpr (F == FOLD_SUM_SQUARES)
+      AccV = AccV * AccV;
+    else if constexpr (F == FOLD_MAX_ABS)
+      AccV = AccV < 0 ? -AccV : AccV;
+    for (I = W; I + W <= N; I += W)
+      fold<F>(AccV, *reinterpret_cast<const V *>(X + I));
+    for (size_t L = 0; L < W; ++L) {
+      T Lane = AccV[L];
+      if constexpr (F == FOLD_SUM || F == FOLD_SUM_SQUARES)
+        Acc += Lane;
+      else
+        Acc = std::max(Acc, Lane);
+    }
+  }
+  for (; I < N; ++I)
+    fold<F>(Acc, X[I]);
+  return Acc;
+}
+
+template <class T, unsigned Bytes>
+[[gnu::always_inline]] inline T foldAny(Fold F, const T *X, size_t N,
+                                        T Acc) {
+  switch (F) {
+  case FOLD_SUM:
+    return foldLoop<T, Bytes, FOLD_SUM>(X, N, Acc);
+  case FOLD_SUM_SQUARES:
+    return foldLoop<T, Bytes, FOLD_SUM_SQUARES>(X, N, Acc);
+  case FOLD_MAX:
+    return foldLoop<T, Bytes, FOLD_MAX>(X, N, Acc);
+  default:
+    return foldLoop<T, Bytes, FOLD_MAX_ABS>(X, N, Acc);
+  }
+}
+
+/* Kernels for one instruction set */
+template <class T> struct KernelSet {
+  const char *Name;
+  void (*Apply)(const ElementwiseChain &Chain, const T *const *Operands,
+                T *X, size_t N);
+  T (*Fold)(Fold F, const T *X, size_t N, T Acc);
+  /* Acc += X */
+  void (*Accumulate)(T *Acc, const T *X, size_t N);
+};
+
+/* Scalar fallback is compiled for the baseline instruction set */
+template <class T>
+void applyScalar(const ElementwiseChain &Chain, const T *const *Operands,
+                 T *X, size_t N) {
+  applyChain<T, sizeof(T)>(Chain, Operands, X, N);
+}
+template <class T> T foldScalar(Fold F, const T *X, size_t N, T Acc) {
+  return foldAny<T, sizeof(T)>(F, X, N, Acc);
+}
+template <class T> void accumulateScalar(T *Acc, const T *X, size_t N) {
+  mapLoop<T, sizeof(T), EW_ADD>(Acc, X, T(), N);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+template <class T>
+__attribute__((target("avx2"))) void
+applyAvx2(const ElementwiseChain &Chain, const T *const *Operands, T *X,
+          size_t N) {
+  applyChain<T, 32>(Chain, Operands, X, N);
+}
+template <class T>
+__attribute__((target("avx2"))) T foldAvx2(Fold F, const T *X, size_t N,
+                                           T Acc) {
+  return foldAny<T, 32>(F, X, N, Acc);
+}
+template <class T>
+__attribute__((target("avx2"))) void accumulateAvx2(T *Acc, const T *X,
+                                                    size_t N) {
+  mapLoop<T, 32, EW_ADD>(Acc, X, T(), N);
+}
+
+template <class T>
+__attribute__((target("avx512f"))) void
+applyAvx512(const ElementwiseChain &Chain, const T *const *Operands, T *X,
+            size_t N) {
+  applyChain<T, 64>(Chain, Operands, X, N);
+}
+template <class T>
+__attribute__((target("avx512f"))) T foldAvx512(Fold F, const T *X, size_t N,
+                                                T Acc) {
+  return foldAny<T, 64>(F, X, N, Acc);
+}
+template <class T>
+__attribute__((target("avx512f"))) void accumulateAvx512(T *Acc, const T *X,
+                                                         size_t N) {
+  mapLoop<T, 64, EW_ADD>(Acc, X, T(), N);
+}
+#endif
+
+enum Level { SCALAR, AVX2, AVX512 };
+
+/* Widest instruction set supported by this CPU */
+inline Level detectLevel() {
+#if defined(__x86_64__) || defined(__i386__)
+  static Level Detected = __builtin_cpu_supports("avx512f") ? AVX512
+                          : __builtin_cpu_supports("avx2") ? AVX2
+                                                            : SCALAR;
+  return Detected;
+#else
+  return SCALAR;
+#endif
+}
+
+template <class T> KernelSet<T> kernels(Level L = detectLevel()) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (L == AVX512)
+    return {"avx512", &applyAvx512<T>, &foldAvx512<T>, &accumulateAvx512<T>};
+  if (L == AVX2)
+    return {"avx2", &applyAvx2<T>, &foldAvx2<T>, &accumulateAvx2<T>};
+#endif
+  return {"scalar", &applyScalar<T>, &foldScalar<T>, &accumulateScalar<T>};
+}
+
+} // namespace simd
+
+/* Elements processed at once. Block of the chain stays in L1 cache while
+ * all steps are applied to it, so memory is passed only once
+ */
+constexpr size_t ElementwiseBlock = 512;
+
+/* Smaller inputs are processed in the calling thread */
+constexpr size_t ParallelElementwiseThreshold = 1 << 20;
+
+/* Apply Chain to row-major [Rows x Cols] Operands (Chain.operandCount() of
+ * them) and write the result, see reducedShape(), into Dst. Rows are split
+ * among Threads threads, 0 means hardware concurrency
+ */
+template <class T>
+void runElementwise(const ElementwiseChain &Chain, const T *const *Operands,
+                    size_t Rows, size_t Cols, T *Dst, unsigned Threads = 0,
+                    simd::KernelSet<T> Kernels = simd::kernels<T>()) {
+  Reduction R = Chain.Reduce;
+  unsigned StepOperands = Chain.operandCount() - 1;
+  simd::Fold Fold = R == RED_ROW_SUM || R == RED_SUM ? simd::FOLD_SUM
+                    : R == RED_ROW_NORM || R == RED_NORM
+                        ? simd::FOLD_SUM_SQUARES
+                    : R == RED_ROW_MAX ? simd::FOLD_MAX
+                                       : simd::FOLD_MAX_ABS;
+  T Identity = R == RED_ROW_MAX ? std::numeric_limits<T>::lowest() : T();
+  bool Partial = R != RED_NONE && !isRowReduction(R);
+  size_t PartialSize = R == RED_COLUMN_SUM ? Cols : 1;
+
+  if (!Threads)
+    Threads = std::max(1u, std::thread::hardware_concurrency());
+  if (Rows * Cols < ParallelElementwiseThreshold)
+    Threads = 1;
+  Threads = std::max<size_t>(1, std::min<size_t>(Threads, Rows));
+  /* partial results of every thread */
+  std::vector<T> Partials(Partial ? Threads * PartialSize : 0, Identity);
+
+  auto Run = [&](unsigned Thread, size_t First, size_t Last) {
+    alignas(64) T Buffer[ElementwiseBlock];
+    const T *StepOps[MaxChainLength];
+    T *Acc = Partial ? Partials.data() + Thread * PartialSize : nullptr;
+    for (size_t I = First; I < Last; ++I) {
+      T RowAcc = Identity;
+      for (size_t J = 0; J < Cols; J += ElementwiseBlock) {
+        size_t N = std::min(ElementwiseBlock, Cols - J), Offset = I * Cols + J;
+        T *X = R == RED_NONE ? Dst + Offset : Buffer;
+        std::memcpy(X, Operands[0] + Offset, N * sizeof(T));
+        for (unsigned K = 0; K < StepOperands; ++K)
+          StepOps[K] = Operands[K + 1] + Offset;
+        Kernels.Apply(Chain, StepOps, X, N);
+        if (isRowReduction(R))
+          RowAcc = Kernels.Fold(Fold, X, N, RowAcc);
+        else if (R == RED_COLUMN_SUM)
+          Kernels.Accumulate(Acc + J, X, N);
+        else if (Partial)
+          *Acc = Kernels.Fold(Fold, X, N, *Acc);
+      }
+      if (isRowReduction(R))
+        Dst[I] = R == RED_ROW_NORM ? std::sqrt(RowAcc) : RowAcc;
+    }
+  };
+  std::vector<std::thread> Workers;
+  for (unsigned Thread = 1; Thread < Threads; ++Thread)
+    Workers.emplace_back(Run, Thread, Rows * Thread / Threads,
+                         Rows * (Thread + 1) / Threads);
+  Run(0, 0, Rows / Threads);
+  for (auto &&W : Workers)
+    W.join();
+
+  if (Partial) {
+    std::copy_n(Partials.data(), PartialSize, Dst);
+    for (unsigned Thread = 1; Thread < Threads; ++Thread)
+      combinePartial(R, Dst, Partials.data() + Thread * PartialSize,
+                     PartialSize);
+  }
+}
+
+/* X = Op(X, B) for a single step, e.g. in-place addition of matrices */
+template <class T>
+void applyInPlace(ElementwiseOp Op, T *X, const T *B, size_t N,
+                  double Scalar = 0) {
+  ElementwiseChain Chain;
+  Chain.then(Op, Scalar);
+  const T *Operands[] = {B};
+  simd::kernels<T>().Apply(Chain, Operands, X, N);
+}
+
+} // namespace dhm
@@ -0,0 +1,508 @@
+#pragma once
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <list>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace dhm {
+
+using boost::asio::ip::tcp;
+
+enum FrameType : uint8_t {
+  FRAME_REQUEST,        /* client -> worker, payload starts with Operation */
+  FRAME_RESPONSE,       /* worker -> client, result of the request */
+  FRAME_ERROR,          /* worker -> client, payload is an error message */
+  FRAME_HELLO,          /* client -> worker, first frame of every stream */
+  FRAME_CANCEL,         /* client -> worker, request_id is no longer needed */
+  FRAME_LOAD_QUERY,     /* client -> worker, asks for FRAME_LOAD */
+  FRAME_LOAD,           /* worker -> client, payload is WorkerLoad */
+  FRAME_REJECTED,       /* worker -> client, request not admitted, retry */
+  FRAME_BROADCAST,      /* sender -> worker, data to relay to a subtree */
+  FRAME_BROADCAST_DONE, /* worker -> sender, the subtree has the data */
+  FRAME_SHARED_REFS,    /* client -> worker, see SharedRef */
+  FRAME_SHARED_MISSING, /* worker -> client, referenced data was evicted */
+};
+
+enum FrameFlags : uint8_t {
+  /* payload is split into equal stripes, i-th stripe is sent over i-th
+   * stream of the connection. Header always goes over the first stream
+   */
+  FRAME_STRIPED = 1,
+};
+
+/* Every message on the wire is a frame: FrameHeader followed by `length`
+ * bytes of payload. Responses carry request_id of the corresponding request,
+ * so several requests may be in flight on one connection and completed in
+ * any order
+ */
+struct FrameHeader {
+  static constexpr uint32_t Magic = 0x464d4844; // "DHMF"
+  static constexpr uint16_t CurrentVersion = 8;
+
+  uint32_t magic = Magic;
+  uint16_t version = CurrentVersion;
+  uint8_t type = FRAME_REQUEST;
+  uint8_t flags = 0;
+  uint64_t request_id = 0;
+  uint64_t length = 0;
+
+  FrameHeader() = default;
+  FrameHeader(FrameType type, uint64_t request_id, uint64_t length = 0)
+      : type(type), request_id(request_id), length(length) {}
+
+  void validate() const {
+    if (magic != Magic)
+      throw std::runtime_error("invalid frame");
+    if (version != CurrentVersion)
+      throw std::runtime_error("unsupported protocol version " +
+                               std::to_string(version));
+  }
+};
+static_assert(sizeof(FrameHeader) == 24, "unexpected FrameHeader padding");
+
+/* Frames smaller than this are not striped by default */
+constexpr size_t DefaultStripeThreshold = 1 << 20;
+
+/* Payload of FRAME_HELLO. Client may open several streams to a worker,
+ * streams with the same session_id form a single connection
+ */
+struct StreamHello {
+  static constexpr uint32_t MaxStreams = 64;
+
+  uint64_t session_id;
+  uint32_t stream_index;
+  uint32_t stream_count;
+  /* SO_SNDBUF/SO_RCVBUF to be used on both sides, 0 for system default */
+  uint32_t socket_buffer;
+  uint32_t reserved;
+};
+
+/* Payload of FRAME_LOAD. Worker runs at most max_concurrent requests and
+ * queues up to max_queue more, as long as their estimated memory fits into
+ * memory_budget. Requests beyond that are answered with FRAME_REJECTED
+ */
+struct WorkerLoad {
+  uint32_t running;
+  uint32_t queued;
+  uint32_t max_concurrent;
+  uint32_t max_queue;
+  uint64_t memory_reserved;
+  uint64_t memory_budget;
+
+  /* Requests which may be admitted right now */
+  uint32_t freeSlots() const {
+    auto capacity = max_concurrent + max_queue;
+    return running + queued < capacity ? capacity - running - queued : 0;
+  }
+  uint64_t freeMemory() const {
+    return memory_reserved < memory_budget ? memory_budget - memory_reserved
+                                           : 0;
+  }
+  /* Fraction of concurrency in use, above 1 if requests are queued */
+  double utilization() const {
+    return double(running + queued) / std::max(max_concurrent, 1u);
+  }
+};
+static_assert(sizeof(WorkerLoad) == 32, "unexpected WorkerLoad padding");
+
+/* Payload of FRAME_BROADCAST is BroadcastHeader, layout_size bytes of relay
+ * layout (see relay.h) and `size` bytes of shared data. Broadcasts are never
+ * striped, so that data may be forwarded as it arrives. Receiver answers
+ * with FRAME_BROADCAST_DONE once its whole subtree has the data, or with
+ * FRAME_ERROR
+ */
+struct BroadcastHeader {
+  uint64_t share_id;
+  uint64_t size;
+  uint64_t layout_size;
+};
+static_assert(sizeof(BroadcastHeader) == 24,
+              "unexpected BroadcastHeader padding");
+
+/* Payload of FRAME_SHARED_REFS is an array of SharedRef, sent right before
+ * the request with the same request_id, offsets are non-decreasing. With
+ * zero size, cached data share_id is inserted into request payload at
+ * offset. If the worker does not have the data, the request is answered
+ * with FRAME_SHARED_MISSING. Otherwise `size` bytes at offset are data
+ * share_id sent inline, which the worker keeps for further requests
+ */
+struct SharedRef {
+  uint64_t offset;
+  uint64_t share_id;
+  uint64_t size;
+};
+static_assert(sizeof(SharedRef) == 24, "unexpected SharedRef padding");
+
+/* Builds frame payload. Small values are copied into internal storage,
+ * large buffers may be referenced with writeRef() to avoid copying
+ */
+class PayloadWriter {
+  struct Segment {
+    const char *external; /* nullptr for data in `owned` */
+    size_t offset;
+    size_t size;
+  };
+  std::vector<char> owned;
+  std::vector<Segment> segments;
+  size_t total = 0;
+
+public:
+  void writeRaw(const void *data, size_t size) {
+    if (!size)
+      return;
+    if (segments.empty() || segments.back().external)
+      segments.push_back(Segment{nullptr, owned.size(), 0});
+    const char *ptr = static_cast<const char *>(data);
+    owned.insert(owned.end(), ptr, ptr + size);
+    segments.back().size += size;
+    total += size;
+  }
+
+  /* data is not copied and must stay valid until payload is sent */
+  void writeRef(const void *data, size_t size) {
+    if (!size)
+      return;
+    segments.push_back(Segment{static_cast<const char *>(data), 0, size});
+    total += size;
+  }
+
+  template <class T> void write(const T &value) {
+    static_assert(std::is_trivially_copyable_v<T>, "type is not POD");
+    writeRaw(&value, sizeof value);
+  }
+
+  /* length-prefixed string */
+  void writeString(const std::string &str) {
+    write<uint64_t>(str.size());
+    writeRaw(str.data(), str.size());
+  }
+
+  size_t size() const { return total; }
+  bool empty() const { return !total; }
+
+  void clear() {
+    owned.clear();
+    segments.clear();
+    total = 0;
+  }
+
+  std::vector<boost::asio::const_buffer> buffers() const {
+    std::vector<boost::asio::const_buffer> res;
+    for (auto &&seg : segments) {
+      const char *ptr = seg.external ? seg.external : owned.data() + seg.offset;
+      res.emplace_back(ptr, seg.size);
+    }
+    return res;
+  }
+};
+
+/* Sequential reader of received frame payload */
+class PayloadReader {
+  const char *ptr = nullptr;
+  /* bytes left in the current segment and in total */
+  size_t available = 0;
+  size_t remaining = 0;
+  std::vector<boost::asio::const_buffer> segments;
+  size_t next_segment = 0;
+  /* copies of values spanning segments, see take() */
+  std::list<std::vector<char>> joined;
+
+  void nextSegment() {
+    while (!available && next_segment < segments.size()) {
+      auto &segment = segments[next_segment++];
+      ptr = static_cast<const char *>(segment.data());
+      available = segment.size();
+    }
+  }
+
+public:
+  PayloadReader() = default;
+  PayloadReader(const void *data, size_t size)
+      : ptr(static_cast<const char *>(data)), available(size),
+        remaining(size) {}
+  PayloadReader(const std::vector<char> &data)
+      : PayloadReader(data.data(), data.size()) {}
+  /* Payload made of several buffers, e.g. with shared data of a worker */
+  explicit PayloadReader(std::vector<boost::asio::const_buffer> buffers)
+      : segments(std::move(buffers)) {
+    for (auto &&segment : segments)
+      remaining += segment.size();
+    nextSegment();
+  }
+
+  /* Returns pointer to the next size bytes and skips them. Bytes spanning
+   * segments are copied, such pointer is valid only while the reader is
+   */
+  const char *take(size_t size) {
+    if (size > remaining)
+      throw std::runtime_error("truncated payload");
+    nextSegment();
+    if (size <= available) {
+      const char *res = ptr;
+      ptr += size;
+      available -= size;
+      remaining -= size;
+      return res;
+    }
+    auto &copy = joined.emplace_back(size);
+    readRaw(copy.data(), size);
+    return copy.data();
+  }
+
+  void readRaw(void *data, size_t size) {
+    if (size > remaining)
+      throw std::runtime_error("truncated payload");
+    auto *dst = static_cast<char *>(data);
+    while (size) {
+      nextSegment();
+      size_t chunk = std::min(size, available);
+      std::memcpy(dst, ptr, chunk);
+      dst += chunk;
+      ptr += chunk;
+      available -= chunk;
+      remaining -= chunk;
+      size -= chunk;
+    }
+  }
+
+  template <class T> T read() {
+    static_assert(std::is_trivially_copyable_v<T>, "type is not POD");
+    T value;
+    readRaw(&value, sizeof value);
+    return value;
+  }
+
+  template <class T> std::vector<T> readVector(size_t count) {
+    std::vector<T> res(count);
+    readRaw(res.data(), count * sizeof(T));
+    return res;
+  }
+
+  std::string readString() {
+    auto size = read<uint64_t>();
+    const char *data = take(size);
+    return std::string(data, size);
+  }
+
+  /* length-prefixed string, not copied out of the payload */
+  std::string_view readStringView() {
+    auto size = read<uint64_t>();
+    return std::string_view(take(size), size);
+  }
+
+  size_t size() const { return remaining; }
+  bool empty() const { return !remaining; }
+};
+
+/* Disable Nagle's algorithm and set kernel buffer sizes */
+inline void tuneSocket(tcp::socket &socket, unsigned buffer_size) {
+  socket.set_option(tcp::no_delay(true));
+  if (buffer_size) {
+    socket.set_option(boost::asio::socket_base::send_buffer_size(buffer_size));
+    socket.set_option(
+        boost::asio::socket_base::receive_buffer_size(buffer_size));
+  }
+}
+
+/* Run fn(i) for i in [0; count) in parallel, fn(0) runs in the calling
+ * thread. The first exception is rethrown after all calls are finished
+ */
+template <class Fn> void runParallel(size_t count, Fn fn) {
+  std::vector<std::exception_ptr> errors(count);
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < count; ++i)
+    threads.emplace_back([&fn, &errors, i] {
+      try {
+        fn(i);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    });
+  try {
+    fn(0);
+  } catch (...) {
+    errors[0] = std::current_exception();
+  }
+  for (auto &&thread : threads)
+    thread.join();
+  for (auto &&error : errors)
+    if (error)
+      std::rethrow_exception(error);
+}
+
+/* Run one asynchronous operation per stream, started by
+ * start(i, handler), and wait for all of them in the calling thread, so
+ * that striped transfers need no threads of their own. The io_context of
+ * streams must not be run by other threads. The first error is thrown once
+ * all operations are finished
+ */
+template <class StartFn>
+void runOnStreams(std::vector<tcp::socket> &streams, size_t count,
+                  StartFn start) {
+  boost::system::error_code error;
+  for (size_t i = 0; i < count; ++i)
+    start(i, [&error](const boost::system::error_code &ec, size_t) {
+      if (ec && !error)
+        error = ec;
+    });
+  auto &ctx = static_cast<boost::asio::io_context &>(
+      streams[0].get_executor().context());
+  ctx.restart();
+  ctx.run();
+  if (error)
+    throw boost::system::system_error(error);
+}
+
+/* Number of streams the frame payload is spread over */
+inline size_t stripeCount(const FrameHeader &hdr, size_t streams) {
+  return (hdr.flags & FRAME_STRIPED) ? streams : 1;
+}
+
+inline size_t stripeSize(const FrameHeader &hdr, size_t streams) {
+  auto count = stripeCount(hdr, streams);
+  return (hdr.length + count - 1) / count;
+}
+
+/* Split payload buffers into per-stream sequences, the first one is
+ * prefixed with `first` buffers
+ */
+template <class BufferT>
+std::vector<std::vector<BufferT>>
+splitStripes(const FrameHeader &hdr, const std::vector<BufferT> &payload,
+             size_t streams, std::vector<BufferT> first = {}) {
+  std::vector<std::vector<BufferT>> res(stripeCount(hdr, streams));
+  res[0] = std::move(first);
+  size_t stripe = stripeSize(hdr, streams);
+  size_t stream = 0, filled = 0;
+  for (auto buf : payload) {
+    while (buf.size()) {
+      if (filled == stripe) {
+        ++stream;
+        filled = 0;
+      }
+      size_t chunk = std::min(buf.size(), stripe - filled);
+      res[stream].emplace_back(buf.data(), chunk);
+      buf += chunk;
+      filled += chunk;
+    }
+  }
+  return res;
+}
+
+/* Split frame into per-stream buffer sequences. hdr must outlive them */
+inline std::vector<std::vector<boost::asio::const_buffer>>
+stripeFrame(const FrameHeader &hdr, const PayloadWriter &payload,
+            size_t streams) {
+  return splitStripes(hdr, payload.buffers(), streams,
+                      {boost::asio::buffer(&hdr, sizeof hdr)});
+}
+
+/* Send frame over the connection made of `streams`. Payloads of at least
+ * stripe_threshold bytes are striped across all streams
+ */
+inline void sendFrame(FrameHeader hdr, const PayloadWriter &payload,
+                      std::vector<tcp::socket> &streams,
+                      size_t stripe_threshold) {
+  hdr.length = payload.size();
+  if (streams.size() > 1 && hdr.length >= stripe_threshold)
+    hdr.flags |= FRAME_STRIPED;
+  auto stripes = stripeFrame(hdr, payload, streams.size());
+  if (stripes.size() == 1) {
+    boost::asio::write(streams[0], stripes[0]);
+    return;
+  }
+  runOnStreams(streams, stripes.size(), [&](size_t i, auto done) {
+    boost::asio::async_write(streams[i], stripes[i], done);
+  });
+}
+
+/* Receive payload scattered over buffers of hdr.length bytes in total */
+inline void receivePayload(const FrameHeader &hdr,
+                           const std::vector<boost::asio::mutable_buffer> &dst,
+                           std::vector<tcp::socket> &streams) {
+  auto stripes = splitStripes(hdr, dst, streams.size());
+  if (stripes.size() == 1) {
+    boost::asio::read(streams[0], stripes[0]);
+    return;
+  }
+  runOnStreams(streams, stripes.size(), [&](size_t i, auto done) {
+    boost::asio::async_read(streams[i], stripes[i], done);
+  });
+}
+
+/* Receive payload of the frame, whose header was just received */
+inline void receivePayload(const FrameHeader &hdr, void *dst,
+                           std::vector<tcp::socket> &streams) {
+  receivePayload(
+      hdr,
+      std::vector<boost::asio::mutable_buffer>{
+          boost::asio::buffer(dst, hdr.length)},
+      streams);
+}
+
+/* Receive payload without storing it, e.g. of a rejected request */
+inline void discardPayload(const FrameHeader &hdr,
+                           std::vector<tcp::socket> &streams) {
+  constexpr size_t ScratchSize = 1 << 16;
+  using Handler =
+      std::function<void(const boost::system::error_code &, size_t)>;
+  size_t count = stripeCount(hdr, streams.size());
+  size_t stripe = stripeSize(hdr, streams.size());
+  std::vector<char> scratch(ScratchSize * count);
+  std::vector<size_t> left(count);
+  std::vector<Handler> steps(count);
+  for (size_t i = 0; i < count; ++i) {
+    size_t first = std::min<size_t>(i * stripe, hdr.length);
+    left[i] = std::min<size_t>(first + stripe, hdr.length) - first;
+  }
+  if (count == 1) {
+    for (; left[0]; left[0] -= std::min(ScratchSize, left[0]))
+      boost::asio::read(streams[0],
+                        boost::asio::buffer(scratch.data(),
+                                            std::min(ScratchSize, left[0])));
+    return;
+  }
+  runOnStreams(streams, count, [&](size_t i, Handler done) {
+    steps[i] = [&, i, done](const boost::system::error_code &ec, size_t) {
+      if (ec || !left[i])
+        return done(ec, 0);
+      size_t chunk = std::min(ScratchSize, left[i]);
+      left[i] -= chunk;
+      boost::asio::async_read(
+          streams[i],
+          boost::asio::buffer(scratch.data() + i * ScratchSize, chunk),
+          steps[i]);
+    };
+    steps[i]({}, 0);
+  });
+}
+
+/* Receive and validate frame header. Returns false on eof */
+inline bool tryReceiveFrameHeader(FrameHeader &hdr, tcp::socket &socket) try {
+  boost::asio::read(socket, boost::asio::buffer(&hdr, sizeof hdr));
+  hdr.validate();
+  return true;
+} catch (boost::system::system_error &e) {
+  if (e.code() == boost::asio::error::eof)
+    return false;
+  throw;
+}
+
+inline FrameHeader receiveFrameHeader(tcp::socket &socket) {
+  FrameHeader hdr;
+  if (!tryReceiveFrameHeader(hdr, socket))
+    throw std::runtime_error("connection closed by peer");
+  return hdr;
+}
+
+} // namespace dhm
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <helib/helib.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace dhm {
+
+/* Rows of matrices are encrypted one per ciphertext, starting from slot 0.
+ * Slots beyond the row width are zero, so context may have more slots than
+ * the matrix has columns
+ */
+
+/* Stages of the kernels below whose cost in capacity is tracked */
+enum HeStage : unsigned {
+  STAGE_MUL,        /* ciphertext product with relinearization */
+  STAGE_MUL_PLAIN,  /* product by encoded plaintext */
+  STAGE_TOTAL_SUMS, /* helib::totalSums() */
+  STAGE_SHIFT,      /* shift or rotation of slots */
+  STAGE_ADD,        /* sum of ciphertexts */
+  STAGE_COMPACT,    /* mod-switching of results, see compactResult() */
+  STAGE_COUNT
+};
+
+inline const char *toString(HeStage stage) {
+  static const char *names[] = {"mul",   "mul-plain", "total-sums",
+                                "shift", "add",       "compact"};
+  return stage < STAGE_COUNT ? names[stage] : "unknown";
+}
+
+/* Capacity (Ctxt::capacity(), log2 of modulus over noise) consumed by
+ * stages of kernels, and what is left in results. Plain data, so that
+ * workers return it with results as is and clients merge it
+ */
+struct NoiseBudget {
+  struct Stage {
+    uint64_t count;
+    /* bits consumed in total and by a single application at most */
+    double total;
+    double max;
+  };
+  static constexpr double Unknown = std::numeric_limits<double>::infinity();
+
+  Stage stages[STAGE_COUNT] = {};
+  /* the lowest capacity of operands and of results, bits */
+  double input_capacity = Unknown;
+  double result_capacity = Unknown;
+  /* the lowest CKKS precision of results, see precisionBits() */
+  double result_precision = Unknown;
+
+  void record(HeStage stage, double before, double after) {
+    auto &s = stages[stage];
+    ++s.count;
+    s.total += before - after;
+    s.max = s.count == 1 ? before - after : std::max(s.max, before - after);
+  }
+  void recordInput(const helib::Ctxt &c) {
+    input_capacity = std::min(input_capacity, c.capacity());
+  }
+  void recordResult(const helib::Ctxt &c);
+
+  void merge(const NoiseBudget &other) {
+    for (unsigned i = 0; i < STAGE_COUNT; ++i) {
+      auto &s = stages[i];
+      auto &o = other.stages[i];
+      if (!o.count)
+        continue;
+      s.max = s.count ? std::max(s.max, o.max) : o.max;
+      s.count += o.count;
+      s.total += o.total;
+    }
+    input_capacity = std::min(input_capacity, other.input_capacity);
+    result_capacity = std::min(result_capacity, other.result_capacity);
+    result_precision = std::min(result_precision, other.result_precision);
+  }
+};
+
+static_assert(sizeof(NoiseBudget) == 24 * STAGE_COUNT + 24,
+              "unexpected NoiseBudget padding");
+
+/* Apply fn to c, charging capacity it consumes to stage of budget. Nothing
+ * is measured without budget
+ */
+template <class Fn>
+inline void tracked(NoiseBudget *budget, HeStage stage, helib::Ctxt &c,
+                    Fn fn) {
+  if (!budget)
+    return fn();
+  double before = c.capacity();
+  fn();
+  budget->record(stage, before, c.capacity());
+}
+
+/* Row v of A times matrix B, given as ciphertexts of rows of B^T. Slot j of
+ * the result holds sum of (A * B)[i] for i <= j, see undiff()
+ */
+inline helib::Ctxt multiply(const helib::Ctxt &v,
+                            const std::vector<helib::Ctxt> &matrix,
+                            NoiseBudget *budget = nullptr) {
+  assert(!matrix.empty());
+
+  helib::Ctxt res = v;
+
+  tracked(budget, STAGE_MUL, res, [&] { res *= matrix[0]; });
+  tracked(budget, STAGE_TOTAL_SUMS, res, [&] { helib::totalSums(res); });
+
+  for (unsigned i = 1; i < matrix.size(); ++i) {
+    auto tmp = v;
+    tracked(budget, STAGE_MUL, tmp, [&] { tmp *= matrix[i]; });
+    tracked(budget, STAGE_TOTAL_SUMS, tmp, [&] { helib::totalSums(tmp); });
+    tracked(budget, STAGE_SHIFT, tmp, [&] { helib::shift(tmp, i); });
+    tracked(budget, STAGE_ADD, res, [&] { res += tmp; });
+  }
+  return res;
+}
+
+/* Generalized diagonal of plaintext matrix, see encodeDiagonals() */
+struct EncodedDiagonal {
+  long shift;
+  helib::EncodedPtxt ptxt;
+};
+
+/* Diagonals of [rows x columns] matrix B for the slot count n: k-th
+ * diagonal holds B[(j + k) % n][j] in slot j, so that row v of A is
+ * multiplied as sum_k rotate(v, -k) * diagonal_k. Diagonals consisting of
+ * padding only are skipped. Requires rows <= n and columns <= n
+ */
+inline std::vector<EncodedDiagonal>
+encodeDiagonals(const helib::Context &context, const double *B, size_t rows,
+                size_t columns) {
+  size_t n = context.getNSlots();
+  assert(rows <= n && columns <= n && "matrix does not fit into slots");
+  std::vector<EncodedDiagonal> diagonals;
+  std::vector<double> diagonal(n);
+  for (size_t k = 0; k < n; ++k) {
+    bool empty = true;
+    for (size_t j = 0; j < n; ++j) {
+      size_t i = (j + k) % n;
+      diagonal[j] = (j < columns && i < rows) ? B[i * columns + j] : 0;
+      empty = empty && (j >= columns || i >= rows);
+    }
+    if (empty)
+      continue;
+    diagonals.push_back(EncodedDiagonal{long(k), helib::EncodedPtxt()});
+    if (context.isCKKS()) {
+      helib::PtxtArray(context, diagonal).encode(diagonals.back().ptxt);
+    } else {
+      /* BGV slots hold integers modulo p */
+      std::vector<long> values(n);
+      std::transform(diagonal.begin(), diagonal.end(), values.begin(),
+                     [](double value) { return std::lround(value); });
+      helib::PtxtArray(context, values).encode(diagonals.back().ptxt);
+    }
+  }
+  return diagonals;
+}
+
+/* Row v of A times plaintext matrix B given by its encoded diagonals.
+ * Ciphertext-plaintext products need neither relinearization nor
+ * totalSums, unlike multiply()
+ */
+inline helib::Ctxt
+multiplyDiagonals(const helib::Ctxt &v,
+                  const std::vector<EncodedDiagonal> &diagonals,
+                  NoiseBudget *budget = nullptr) {
+  assert(!diagonals.empty());
+
+  helib::Ctxt res = v;
+  tracked(budget, STAGE_SHIFT, res,
+          [&] { helib::rotate(res, -diagonals[0].shift); });
+  tracked(budget, STAGE_MUL_PLAIN, res,
+          [&] { res.multByConstant(diagonals[0].ptxt); });
+  for (unsigned k = 1; k < diagonals.size(); ++k) {
+    auto tmp = v;
+    tracked(budget, STAGE_SHIFT, tmp,
+            [&] { helib::rotate(tmp, -diagonals[k].shift); });
+    tracked(budget, STAGE_MUL_PLAIN, tmp,
+            [&] { tmp.multByConstant(diagonals[k].ptxt); });
+    tracked(budget, STAGE_ADD, res, [&] { res += tmp; });
+  }
+  return res;
+}
+
+/* Bits of capacity a compacted result keeps above its noise, so that it
+ * still decrypts correctly
+ */
+constexpr long MinResultCapacity = 4;
+
+/* Bits of CKKS precision: log2 of the scaling factor over the error bound */
+inline double precisionBits(const helib::Ctxt &c) {
+  return (NTL::log(c.getRatFactor()) - NTL::log(c.errorBound())) /
+         std::log(2.0);
+}
+
+inline void NoiseBudget::recordResult(const helib::Ctxt &c) {
+  result_capacity = std::min(result_capacity, c.capacity());
+  if (c.isCKKS())
+    result_precision = std::min(result_precision, precisionBits(c));
+}
+
+/* Mod-switch result c down to the fewest primes that keep it decryptable
+ * and, for CKKS, keep min(precision, current precision - 1) bits, so that
+ * it is serialized with fewer DoubleCRT rows. Mod-switching scales noise
+ * down with the modulus until rounding noise dominates, which is what
+ * limits the drop. Levels are bisected on trial copies, each of them costs
+ * less than a single product. Returns number of primes dropped
+ */
+inline long compactResult(helib::Ctxt &c, unsigned precision) {
+  c.cleanUp();
+  const helib::IndexSet &primes = c.getPrimeSet();
+  double required = 0;
+  if (c.isCKKS())
+    required = std::min<double>(precision, precisionBits(c) - 1);
+
+  auto prefix = [&primes](long count) {
+    helib::IndexSet s = primes;
+    while (s.card() > count)
+      s.remove(s.last());
+    return s;
+  };
+  auto acceptable = [&](const helib::Ctxt &trial) {
+    return trial.bitCapacity() >= MinResultCapacity &&
+           (!trial.isCKKS() || precisionBits(trial) >= required);
+  };
+
+  long total = primes.card();
+  long lo = 1, hi = total;
+  while (lo < hi) {
+    long mid = (lo + hi) / 2;
+    helib::Ctxt trial = c;
+    trial.modDownToSet(prefix(mid));
+    if (acceptable(trial))
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  if (lo < total)
+    c.modDownToSet(prefix(lo));
+  return total - lo;
+}
+
+} // namespace dhm
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <limits>
+#include <ostream>
+#include <vector>
+
+namespace dhm {
+
+/* Log-linear histogram in the spirit of HdrHistogram. Values below
+ * 2^SubBucketBits are counted exactly, larger ones in buckets whose width
+ * is at most 2^-SubBucketBits of their values. Memory does not depend on
+ * the range of values and recording is O(1)
+ */
+class Histogram {
+public:
+  static constexpr unsigned SubBucketBits = 7;
+  static constexpr uint64_t SubBucketCount = uint64_t(1) << SubBucketBits;
+
+  Histogram() : counts((64 - SubBucketBits + 1) * SubBucketCount) {}
+
+  void record(uint64_t value) {
+    ++counts[bucketIndex(value)];
+    ++total;
+    min_value = std::min(min_value, value);
+    max_value = std::max(max_value, value);
+    sum += double(value);
+    sum_squares += double(value) * double(value);
+  }
+
+  void merge(const Histogram &other) {
+    for (size_t i = 0; i < counts.size(); ++i)
+      counts[i] += other.counts[i];
+    total += other.total;
+    min_value = std::min(min_value, other.min_value);
+    max_value = std::max(max_value, other.max_value);
+    sum += other.sum;
+    sum_squares += other.sum_squares;
+  }
+
+  uint64_t count() const { return total; }
+  uint64_t min() const { return total ? min_value : 0; }
+  uint64_t max() const { return max_value; }
+  double mean() const { return total ? sum / total : 0; }
+  double stddev() const {
+    if (!total)
+      return 0;
+    return std::sqrt(std::max(0.0, sum_squares / total - mean() * mean()));
+  }
+
+  /* Largest value counted together with the value at percentile p, p is
+   * in [0; 100]
+   */
+  uint64_t percentile(double p) const {
+    if (!total)
+      return 0;
+    auto target = std::max<uint64_t>(1, uint64_t(std::ceil(p / 100 * total)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+      seen += counts[i];
+      if (seen >= target)
+        return std::min(bucketHighest(i), max_value);
+    }
+    return max_value;
+  }
+
+  /* Percentile distribution in HdrHistogram text format (.hgrm), values
+   * are divided by unit. Percentiles get ticks_per_half steps per halving
+   * of the distance to 100%
+   */
+  void printDistribution(std::ostream &os, double unit,
+                         unsigned ticks_per_half = 5) const {
+    auto flags = os.flags();
+    os << std::fixed << std::setw(12) << "Value" << " " << std::setw(14)
+       << "Percentile" << " " << std::setw(10) << "TotalCount" << " "
+       << std::setw(14) << "1/(1-Percentile)" << "\n\n";
+    auto line = [&](double quantile) {
+      uint64_t value = percentile(quantile * 100);
+      uint64_t below = 0;
+      for (size_t i = 0; i <= bucketIndex(value); ++i)
+        below += counts[i];
+      os << std::setprecision(3) << std::setw(12) << value / unit << " "
+         << std::setprecision(12) << std::setw(14) << quantile << " "
+         << std::setw(10) << below << " ";
+      if (quantile < 1)
+        os << std::setprecision(2) << std::setw(14) << 1 / (1 - quantile);
+      os << "\n";
+    };
+    if (total) {
+      for (unsigned k = 0;; ++k) {
+        double quantile = 1 - std::pow(0.5, double(k) / ticks_per_half);
+        /* the rest is the maximum */
+        if ((1 - quantile) * total < 1)
+          break;
+        line(quantile);
+      }
+      line(1);
+    }
+    os << std::setprecision(3) << "#[Mean    = " << std::setw(12)
+       << mean() / unit << ", StdDeviation   = " << std::setw(12)
+       << stddev() / unit << "]\n"
+       << "#[Max     = " << std::setw(12) << max() / unit
+       << ", Total count    = " << std::setw(12) << total << "]\n"
+       << "#[Buckets = " << std::setw(12) << counts.size() / SubBucketCount
+       << ", SubBuckets     = " << std::setw(12) << SubBucketCount << "]\n";
+    os.flags(flags);
+  }
+
+private:
+  /* Value v >= 2^SubBucketBits with the highest bit at SubBucketBits + e
+   * is counted in bucket e * SubBucketCount + (v >> e)
+   */
+  static size_t bucketIndex(uint64_t value) {
+    if (value < SubBucketCount)
+      return value;
+    unsigned e = 63 - __builtin_clzll(value) - SubBucketBits;
+    return e * SubBucketCount + (value >> e);
+  }
+
+  static uint64_t bucketHighest(size_t index) {
+    if (index < 2 * SubBucketCount)
+      return index;
+    unsigned e = index / SubBucketCount - 1;
+    uint64_t top = index - e * SubBucketCount;
+    return ((top + 1) << e) - 1;
+  }
+
+  std::vector<uint64_t> counts;
+  uint64_t total = 0;
+  uint64_t min_value = std::numeric_limits<uint64_t>::max();
+  uint64_t max_value = 0;
+  double sum = 0;
+  double sum_squares = 0;
+};
+
+} // namespace dhm
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "common.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace dhm {
+
+/* Context and secret key (with public and key-switching keys) for the given
+ * options. key_id identifies the public key, so that workers may cache
+ * objects derived from it across requests
+ */
+struct KeySet {
+  EncContextOptions options;
+  uint64_t key_id = 0;
+  std::unique_ptr<helib::Context> context;
+  std::unique_ptr<helib::SecKey> sk;
+
+  /* Build context and generate fresh keys. Slow */
+  static std::shared_ptr<KeySet> generate(const EncContextOptions &opts) {
+    auto keys = std::make_shared<KeySet>();
+    keys->options = opts;
+    keys->key_id = std::random_device()() |
+                   (uint64_t(std::random_device()()) << 32);
+    keys->context = opts.buildContextPtr();
+    keys->sk = std::make_unique<helib::SecKey>(*keys->context);
+    keys->sk->GenSecKey();
+    helib::addSome1DMatrices(*keys->sk);
+    return keys;
+  }
+};
+
+/* On-disk key file: KeyFileHeader, then binary context and binary secret
+ * key of the given sizes
+ */
+struct KeyFileHeader {
+  static constexpr uint64_t Magic = 0x0259454b4d4844; // "DHMKEY\2"
+
+  uint64_t magic;
+  EncContextOptions options;
+  uint64_t key_id;
+  uint64_t context_size;
+  uint64_t key_size;
+};
+
+/* Directory of key files, one per EncContextOptions. Keys are loaded only
+ * when requested, files are memory-mapped and deserialized in place.
+ * Missing keys are generated and saved for the next runs
+ */
+class KeyStore {
+  std::string directory;
+
+public:
+  explicit KeyStore(std::string directory) : directory(std::move(directory)) {}
+
+  std::string path(const EncContextOptions &opts) const {
+    if (opts.scheme == SCHEME_BGV)
+      return directory + "/bgv-m" + std::to_string(opts.m) + "-p" +
+             std::to_string(opts.p) + "-bits" + std::to_string(opts.bits) +
+             "-c" + std::to_string(opts.c) + ".key";
+    return directory + "/ckks-m" + std::to_string(opts.m) + "-bits" +
+           std::to_string(opts.bits) + "-p" + std::to_string(opts.precision) +
+           "-c" + std::to_string(opts.c) + ".key";
+  }
+
+  std::shared_ptr<KeySet> get(const EncContextOptions &opts) const {
+    if (auto keys = load(opts))
+      return keys;
+    auto keys = KeySet::generate(opts);
+    save(*keys);
+    return keys;
+  }
+
+  /* Returns nullptr if there is no key file for opts */
+  std::shared_ptr<KeySet> load(const EncContextOptions &opts) const {
+    auto file = path(opts);
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+      if (errno == ENOENT)
+        return nullptr;
+      throw std::runtime_error("cannot open '" + file +
+                               "': " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(KeyFileHeader)) {
+      close(fd);
+      throw std::runtime_error("'" + file + "' is not a key file");
+    }
+    void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+      throw std::runtime_error(std::string("mmap failed: ") + strerror(errno));
+    std::unique_ptr<void, std::function<void(void *)>> mapping(
+        ptr, [size = st.st_size](void *ptr) { munmap(ptr, size); });
+
+    const char *base = static_cast<const char *>(ptr);
+    KeyFileHeader hdr;
+    std::memcpy(&hdr, base, sizeof hdr);
+    /* files of older versions are regenerated */
+    if (hdr.magic != KeyFileHeader::Magic)
+      return nullptr;
+    if (sizeof hdr + hdr.context_size + hdr.key_size > (size_t)st.st_size ||
+        std::memcmp(&hdr.options, &opts, sizeof opts) != 0)
+      throw std::runtime_error("'" + file + "': invalid key file");
+
+    auto keys = std::make_shared<KeySet>();
+    keys->options = opts;
+    keys->key_id = hdr.key_id;
+    {
+      MemoryStreamBuf buf(
+          std::string_view(base + sizeof hdr, hdr.context_size));
+      std::istream is(&buf);
+      keys->context.reset(helib::Context::readPtrFrom(is));
+    }
+    {
+      MemoryStreamBuf buf(std::string_view(
+          base + sizeof hdr + hdr.context_size, hdr.key_size));
+      std::istream is(&buf);
+      keys->sk = std::make_unique<helib::SecKey>(
+          helib::SecKey::readFrom(is, *keys->context));
+    }
+    return keys;
+  }
+
+  /* File is written under temporary name and renamed, so concurrent
+   * clients never see partially written keys
+   */
+  void save(const KeySet &keys) const {
+    std::ostringstream context_os, key_os;
+    keys.context->writeTo(context_os);
+    keys.sk->writeTo(key_os);
+    auto context_data = context_os.str();
+    auto key_data = key_os.str();
+    KeyFileHeader hdr{KeyFileHeader::Magic, keys.options, keys.key_id,
+                      context_data.size(), key_data.size()};
+
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+      throw std::runtime_error("cannot create '" + directory +
+                               "': " + strerror(errno));
+    auto file = path(keys.options);
+    auto tmp_file = file + ".tmp" + std::to_string(getpid());
+    {
+      std::ofstream os(tmp_file, std::ios::binary);
+      os.write(reinterpret_cast<const char *>(&hdr), sizeof hdr);
+      os << context_data << key_data;
+      if (!os)
+        throw std::runtime_error("cannot write '" + tmp_file + "'");
+    }
+    if (std::rename(tmp_file.c_str(), file.c_str()) != 0) {
+      unlink(tmp_file.c_str());
+      throw std::runtime_error("cannot write '" + file +
+                               "': " + strerror(errno));
+    }
+  }
+};
+
+} // namespace dhm
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace dhm {
+
+/* On-disk matrix format: MappedMatrixHeader followed by row-major payload.
+ * Header is padded to 64 bytes, so payload stays aligned in the mapping
+ */
+struct MappedMatrixHeader {
+  static constexpr uint64_t Magic = 0x0154414d4d4844; // "DHMMAT\1"
+
+  uint64_t magic;
+  uint64_t rows;
+  uint64_t columns;
+  uint64_t elem_size;
+  uint64_t reserved[4];
+};
+static_assert(sizeof(MappedMatrixHeader) == 64, "header must be 64 bytes");
+
+/* Matrix backed by a memory-mapped file. Allows to work with matrices
+ * which do not fit into RAM, pages are loaded and evicted by the kernel
+ */
+template <class T> class MappedMatrix {
+  int Fd = -1;
+  char *Base = nullptr;
+  size_t MappedSize = 0;
+  size_t Rows = 0;
+  size_t Columns = 0;
+
+  MappedMatrix(int Fd, size_t MappedSize, bool Writable)
+      : Fd(Fd), MappedSize(MappedSize) {
+    int Prot = Writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *Ptr = mmap(nullptr, MappedSize, Prot, MAP_SHARED, Fd, 0);
+    if (Ptr == MAP_FAILED) {
+      close(Fd);
+      throw std::runtime_error(std::string("mmap failed: ") +
+                               strerror(errno));
+    }
+    Base = static_cast<char *>(Ptr);
+    madvise(Base, MappedSize, MADV_SEQUENTIAL);
+  }
+
+  MappedMatrixHeader &header() {
+    return *reinterpret_cast<MappedMatrixHeader *>(Base);
+  }
+
+public:
+  using value_type = T;
+
+  MappedMatrix() = default;
+  MappedMatrix(const MappedMatrix &) = delete;
+  MappedMatrix &operator=(const MappedMatrix &) = delete;
+  MappedMatrix(MappedMatrix &&Other) { *this = std::move(Other); }
+  MappedMatrix &operator=(MappedMatrix &&Other) {
+    std::swap(Fd, Other.Fd);
+    std::swap(Base, Other.Base);
+    std::swap(MappedSize, Other.MappedSize);
+    std::swap(Rows, Other.Rows);
+    std::swap(Columns, Other.Columns);
+    return *this;
+  }
+  ~MappedMatrix() {
+    if (Base)
+      munmap(Base, MappedSize);
+    if (Fd >= 0)
+      close(Fd);
+  }
+
+  /* Create (or truncate) file and map it for writing */
+  static MappedMatrix create(const std::string &Path, size_t Rows,
+                             size_t Cols) {
+    int Fd = ::open(Path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (Fd < 0)
+      throw std::runtime_error("cannot create '" + Path +
+                               "': " + strerror(errno));
+    size_t FileSize = sizeof(MappedMatrixHeader) + Rows * Cols * sizeof(T);
+    if (ftruncate(Fd, FileSize) != 0) {
+      close(Fd);
+      throw std::runtime_error("cannot resize '" + Path +
+                               "': " + strerror(errno));
+    }
+    MappedMatrix M(Fd, FileSize, true);
+    M.header() = MappedMatrixHeader{
+        MappedMatrixHeader::Magic, Rows, Cols, sizeof(T), {}};
+    M.Rows = Rows;
+    M.Columns = Cols;
+    return M;
+  }
+
+  /* Map existing file, header is validated against T */
+  static MappedMatrix open(const std::string &Path, bool Writable = false) {
+    int Fd = ::open(Path.c_str(), Writable ? O_RDWR : O_RDONLY);
+    if (Fd < 0)
+      throw std::runtime_error("cannot open '" + Path +
+                               "': " + strerror(errno));
+    struct stat St;
+    if (fstat(Fd, &St) != 0 ||
+        (size_t)St.st_size < sizeof(MappedMatrixHeader)) {
+      close(Fd);
+      throw std::runtime_error("'" + Path + "' is not a matrix file");
+    }
+    MappedMatrix M(Fd, St.st_size, Writable);
+    auto &Hdr = M.header();
+    if (Hdr.magic != MappedMatrixHeader::Magic ||
+        Hdr.elem_size != sizeof(T) ||
+        sizeof(MappedMatrixHeader) + Hdr.rows * Hdr.columns * sizeof(T) >
+            M.MappedSize)
+      throw std::runtime_error("'" + Path + "': invalid matrix header");
+    M.Rows = Hdr.rows;
+    M.Columns = Hdr.columns;
+    return M;
+  }
+
+  static bool exists(const std::string &Path) {
+    return access(Path.c_str(), F_OK) == 0;
+  }
+
+  size_t rows() const { return Rows; }
+  size_t columns() const { return Columns; }
+  size_t size() const { return Rows * Columns; }
+  bool empty() const { return !size(); }
+
+  T *data() {
+    return reinterpret_cast<T *>(Base + sizeof(MappedMatrixHeader));
+  }
+  const T *data() const {
+    return reinterpret_cast<const T *>(Base + sizeof(MappedMatrixHeader));
+  }
+
+  T *beginRow(size_t Row) { return data() + Row * Columns; }
+  T *endRow(size_t Row) { return beginRow(Row + 1); }
+  const T *beginRow(size_t Row) const { return data() + Row * Columns; }
+  const T *endRow(size_t Row) const { return beginRow(Row + 1); }
+
+  T &operator()(size_t I, size_t J) { return data()[I * Columns + J]; }
+  const T &operator()(size_t I, size_t J) const {
+    return data()[I * Columns + J];
+  }
+
+  /* Hint kernel that rows [FirstRow; FirstRow + NumRows) are needed soon */
+  void prefetch(size_t FirstRow, size_t NumRows) const {
+    adviseRows(FirstRow, NumRows, MADV_WILLNEED);
+  }
+
+  /* Hint kernel that rows [FirstRow; FirstRow + NumRows) are not needed
+   * anymore. Data is not lost, pages are just dropped from process memory
+   */
+  void release(size_t FirstRow, size_t NumRows) const {
+    adviseRows(FirstRow, NumRows, MADV_DONTNEED);
+  }
+
+private:
+  void adviseRows(size_t FirstRow, size_t NumRows, int Advice) const {
+    static const size_t PageSz = sysconf(_SC_PAGESIZE);
+    size_t First =
+        sizeof(MappedMatrixHeader) + FirstRow * Columns * sizeof(T);
+    size_t Last = First + NumRows * Columns * sizeof(T);
+    /* only pages lying completely inside the range are touched */
+    First = (First + PageSz - 1) / PageSz * PageSz;
+    Last = Last / PageSz * PageSz;
+    if (First < Last)
+      madvise(Base + First, Last - First, Advice);
+  }
+};
+
+} // namespace dhm
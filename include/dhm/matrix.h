@@ -1,38 +1,110 @@
 #pragma once
 
+#include "allocator.h"
+#include "elementwise.h"
+
 #include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <random>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
 namespace dhm {
 
-template <class T> std::vector<T> makeRandomArray(size_t Size) {
+template <class T, class Alloc = std::allocator<T>>
+std::vector<T, Alloc> makeRandomArray(size_t Size) {
   static std::default_random_engine Gen;
 
-  std::vector<T> Arr(Size);
+  std::vector<T, Alloc> Arr(Size);
   std::uniform_int_distribution<int> Distrib(-100, 100);
 
   std::generate(Arr.begin(), Arr.end(), [&]() -> T { return Distrib(Gen); });
   return Arr;
 }
 
-template <class T> class Matrix {
-  std::vector<T> Data;
+/* Element (I, J) is stored at I * Columns + J for ROW_MAJOR and at
+ * J * Rows + I for COLUMN_MAJOR. Values are sent over the wire as is
+ */
+enum StorageOrder : unsigned { ROW_MAJOR, COLUMN_MAJOR };
+
+/* Matrices smaller than this are transposed in the calling thread */
+constexpr size_t ParallelTransposeThreshold = 1 << 16;
+
+/* Call F(I, J) for every element of [Rows x Cols] matrix, going over
+ * Block x Block tiles, so that both row-major and column-major accesses
+ * stay cache-friendly. Tile rows are split among Threads threads, 0 means
+ * hardware concurrency
+ */
+template <class Fn>
+void forEachBlocked(size_t Rows, size_t Cols, Fn F, size_t Block = 64,
+                    unsigned Threads = 0) {
+  size_t BlockRows = (Rows + Block - 1) / Block;
+  if (!Threads)
+    Threads = std::max(1u, std::thread::hardware_concurrency());
+  if (Rows * Cols < ParallelTransposeThreshold)
+    Threads = 1;
+  Threads = std::max<size_t>(1, std::min<size_t>(Threads, BlockRows));
+
+  auto Run = [&](size_t FirstBlock, size_t LastBlock) {
+    for (size_t II = FirstBlock * Block; II < std::min(LastBlock * Block, Rows);
+         II += Block)
+      for (size_t JJ = 0; JJ < Cols; JJ += Block) {
+        size_t IEnd = std::min(II + Block, Rows);
+        size_t JEnd = std::min(JJ + Block, Cols);
+        for (size_t I = II; I < IEnd; ++I)
+          for (size_t J = JJ; J < JEnd; ++J)
+            F(I, J);
+      }
+  };
+  std::vector<std::thread> Workers;
+  for (unsigned T = 1; T < Threads; ++T)
+    Workers.emplace_back(Run, BlockRows * T / Threads,
+                         BlockRows * (T + 1) / Threads);
+  Run(0, BlockRows / Threads);
+  for (auto &&W : Workers)
+    W.join();
+}
+
+/* Dense matrix in row- or column-major order. By default storage is taken
+ * from the global BufferPool, so it is 64-byte aligned and reused between
+ * matrices of similar size. Short-lived matrices may use ArenaAllocator
+ */
+template <class T, class Alloc = PoolAllocator<T>> class Matrix {
+  std::vector<T, Alloc> Data;
+  size_t Rows;
   size_t Columns;
+  StorageOrder Order;
 
 public:
   using value_type = T;
+  using allocator_type = Alloc;
+
+  Matrix() : Data(), Rows(0), Columns(0), Order(ROW_MAJOR) {}
+  Matrix(size_t Rows, size_t Cols, const Alloc &A = Alloc())
+      : Matrix(Rows, Cols, ROW_MAJOR, A) {}
+  Matrix(size_t Rows, size_t Cols, StorageOrder Order,
+         const Alloc &A = Alloc())
+      : Data(Rows * Cols, A), Rows(Rows), Columns(Cols), Order(Order) {}
+  Matrix(std::vector<T, Alloc> Values, size_t Cols,
+         StorageOrder Order = ROW_MAJOR)
+      : Data(std::move(Values)), Rows(Cols ? Data.size() / Cols : 0),
+        Columns(Cols), Order(Order) {}
+  template <class OtherAlloc,
+            class = std::enable_if_t<!std::is_same_v<OtherAlloc, Alloc>>>
+  Matrix(const std::vector<T, OtherAlloc> &Values, size_t Cols,
+         const Alloc &A = Alloc())
+      : Data(Values.begin(), Values.end(), A),
+        Rows(Cols ? Values.size() / Cols : 0), Columns(Cols),
+        Order(ROW_MAJOR) {}
 
-  Matrix() : Data(), Columns(0) {}
-  Matrix(size_t Rows, size_t Cols) : Data(Rows * Cols), Columns(Cols) {}
-  Matrix(std::vector<T> Values, size_t Cols)
-      : Data(std::move(Values)), Columns(Cols) {}
+  Alloc get_allocator() const { return Data.get_allocator(); }
 
   size_t columns() const { return Columns; }
-  size_t rows() const { return size() / columns(); }
+  size_t rows() const { return Rows; }
   size_t size() const { return Data.size(); }
+  StorageOrder order() const { return Order; }
   T *data() { return Data.data(); }
   const T *data() const { return Data.data(); }
   auto begin() { return Data.begin(); }
@@ -42,59 +114,179 @@ public:
 
   bool empty() const { return !size(); }
 
-  T *beginRow(size_t Row) { return &Data[Row * Columns]; }
+  /* Rows are contiguous only in row-major matrices */
+  T *beginRow(size_t Row) {
+    assert(Order == ROW_MAJOR && "row is not contiguous");
+    return Data.data() + Row * Columns;
+  }
   T *endRow(size_t Row) { return beginRow(Row + 1); }
-  const T *beginRow(size_t Row) const { return &Data[Row * Columns]; }
+  const T *beginRow(size_t Row) const {
+    assert(Order == ROW_MAJOR && "row is not contiguous");
+    return Data.data() + Row * Columns;
+  }
   const T *endRow(size_t Row) const { return beginRow(Row + 1); }
 
-  T &operator()(size_t I, size_t J) { return Data[I * Columns + J]; }
+  /* Columns are contiguous only in column-major matrices */
+  T *beginColumn(size_t Col) {
+    assert(Order == COLUMN_MAJOR && "column is not contiguous");
+    return Data.data() + Col * Rows;
+  }
+  T *endColumn(size_t Col) { return beginColumn(Col + 1); }
+  const T *beginColumn(size_t Col) const {
+    assert(Order == COLUMN_MAJOR && "column is not contiguous");
+    return Data.data() + Col * Rows;
+  }
+  const T *endColumn(size_t Col) const { return beginColumn(Col + 1); }
+
+  T &operator()(size_t I, size_t J) {
+    return Data[Order == ROW_MAJOR ? I * Columns + J : J * Rows + I];
+  }
   const T &operator()(size_t I, size_t J) const {
-    return Data[I * Columns + J];
+    return Data[Order == ROW_MAJOR ? I * Columns + J : J * Rows + I];
   }
 
-  Matrix &operator+=(const Matrix &Other) {
+  template <class OtherAlloc>
+  Matrix &operator+=(const Matrix<T, OtherAlloc> &Other) {
     assert(rows() == Other.rows() && columns() == Other.columns() &&
            "incompatible matrices");
-    for (size_t I = 0; I < Data.size(); ++I)
-      Data[I] += Other.Data[I];
+    if (Order == Other.order()) {
+      applyInPlace(EW_ADD, Data.data(), Other.data(), Data.size());
+    } else {
+      forEachBlocked(Rows, Columns,
+                     [&](size_t I, size_t J) { (*this)(I, J) += Other(I, J); });
+    }
     return *this;
   }
 
-  Matrix getTransposed() const {
-    Matrix<T> Result(rows(), columns());
-    for (size_t I = 0; I < rows(); ++I)
-      for (size_t J = 0; J < columns(); ++J)
-        Result(I, J) = (*this)(J, I);
-    return Result;
+  /* Transpose without moving data: [R x C] row-major storage is the same as
+   * [C x R] column-major storage of the transposed matrix
+   */
+  Matrix &transpose() {
+    std::swap(Rows, Columns);
+    Order = Order == ROW_MAJOR ? COLUMN_MAJOR : ROW_MAJOR;
+    return *this;
+  }
+
+  /* Rearrange data into NewOrder keeping the matrix itself. Square
+   * matrices are transposed in place, others via temporary buffer
+   */
+  Matrix &setOrder(StorageOrder NewOrder, unsigned Threads = 0) {
+    if (NewOrder == Order)
+      return *this;
+    if (Rows == Columns) {
+      T *Ptr = Data.data();
+      size_t N = Rows;
+      forEachBlocked(
+          N, N,
+          [Ptr, N](size_t I, size_t J) {
+            if (I < J)
+              std::swap(Ptr[I * N + J], Ptr[J * N + I]);
+          },
+          64, Threads);
+    } else {
+      Matrix Tmp(Rows, Columns, NewOrder, get_allocator());
+      forEachBlocked(
+          Rows, Columns, [&](size_t I, size_t J) { Tmp(I, J) = (*this)(I, J); },
+          64, Threads);
+      Data = std::move(Tmp.Data);
+    }
+    Order = NewOrder;
+    return *this;
   }
 
   static Matrix random(size_t Rows, size_t Cols) {
-    return Matrix(makeRandomArray<T>(Rows * Cols), Cols);
+    return Matrix(makeRandomArray<T, Alloc>(Rows * Cols), Cols);
   }
 
-  friend Matrix operator +(const Matrix &A, const Matrix &B) {
+  friend Matrix operator+(const Matrix &A, const Matrix &B) {
     return Matrix{A} += B;
   }
 
-  friend Matrix operator *(const Matrix &A, const Matrix &B) {
-    Matrix Result(A.rows(), B.columns());
-    for (size_t I = 0; I < A.rows(); ++I)
+  friend Matrix operator*(const Matrix &A, const Matrix &B) {
+    return gemm(A, B);
+  }
+};
+
+/* Read-only matrix over storage owned elsewhere, e.g. a request payload */
+template <class T> class MatrixView {
+  const T *Data;
+  size_t Rows;
+  size_t Columns;
+  StorageOrder Order;
+
+public:
+  MatrixView(const T *Data, size_t Rows, size_t Cols,
+             StorageOrder Order = ROW_MAJOR)
+      : Data(Data), Rows(Rows), Columns(Cols), Order(Order) {}
+
+  size_t columns() const { return Columns; }
+  size_t rows() const { return Rows; }
+  size_t size() const { return Rows * Columns; }
+  StorageOrder order() const { return Order; }
+  const T *data() const { return Data; }
+
+  const T *beginRow(size_t Row) const {
+    assert(Order == ROW_MAJOR && "row is not contiguous");
+    return Data + Row * Columns;
+  }
+  const T *beginColumn(size_t Col) const {
+    assert(Order == COLUMN_MAJOR && "column is not contiguous");
+    return Data + Col * Rows;
+  }
+  const T &operator()(size_t I, size_t J) const {
+    return Data[Order == ROW_MAJOR ? I * Columns + J : J * Rows + I];
+  }
+};
+
+/* Rows [First; Last) of row-major A * B for B in either order (Matrix or
+ * MatrixView), Result must be zero-initialized [A.rows() x B.columns()]
+ * row-major matrix.
+ * Column-major B is multiplied by dot products of contiguous rows and
+ * columns, row-major B by adding scaled rows of B to the result row
+ */
+template <class T, class Alloc, class BT, class ResAlloc>
+void gemmRows(const Matrix<T, Alloc> &A, const BT &B,
+              Matrix<T, ResAlloc> &Result, size_t First, size_t Last) {
+  assert(A.order() == ROW_MAJOR && "A must be row-major");
+  assert(A.columns() == B.rows() && "incompatible matrices");
+  assert(Result.rows() == A.rows() && Result.columns() == B.columns() &&
+         "incompatible result");
+  for (size_t I = First; I < Last; ++I) {
+    const T *Row = A.beginRow(I);
+    T *ResRow = Result.beginRow(I);
+    if (B.order() == COLUMN_MAJOR) {
       for (size_t J = 0; J < B.columns(); ++J) {
+        const T *Col = B.beginColumn(J);
         T Tmp = 0;
         for (size_t K = 0; K < A.columns(); ++K)
-          Tmp += A(I, K) * B(K, J);
-        Result(I, J) = Tmp;
+          Tmp += Row[K] * Col[K];
+        ResRow[J] = Tmp;
+      }
+    } else {
+      for (size_t K = 0; K < A.columns(); ++K) {
+        const T *BRow = B.beginRow(K);
+        T Scale = Row[K];
+        for (size_t J = 0; J < B.columns(); ++J)
+          ResRow[J] += Scale * BRow[J];
       }
-    return Result;
+    }
   }
-};
+}
 
-/* Equivalent to A * B.getTransposed() */
-template <class T>
-Matrix<T> mulT(const Matrix<T> &A, const Matrix<T> &B) {
-  Matrix<T> Result(A.rows(), B.columns());
+template <class T, class Alloc, class BT>
+Matrix<T, Alloc> gemm(const Matrix<T, Alloc> &A, const BT &B) {
+  Matrix<T, Alloc> Result(A.rows(), B.columns(), A.get_allocator());
+  gemmRows(A, B, Result, 0, A.rows());
+  return Result;
+}
+
+/* Equivalent to A * B^T */
+template <class T, class Alloc, class OtherAlloc>
+Matrix<T, Alloc> mulT(const Matrix<T, Alloc> &A,
+                      const Matrix<T, OtherAlloc> &B) {
+  Matrix<T, Alloc> Result(A.rows(), B.rows(), A.get_allocator());
   for (size_t I = 0; I < A.rows(); ++I)
-    for (size_t J = 0; J < B.columns(); ++J) {
+    for (size_t J = 0; J < B.rows(); ++J) {
       T Tmp = 0;
       for (size_t K = 0; K < A.columns(); ++K)
         Tmp += A(I, K) * B(J, K);
@@ -103,8 +295,22 @@ Matrix<T> mulT(const Matrix<T> &A, const Matrix<T> &B) {
   return Result;
 }
 
-template <class T>
-void print(const Matrix<T> &M, const char *Prefix,
+/* Cache-blocked multithreaded Dst = Src^T. Works for any matrix-like types
+ * (e.g. Matrix and MappedMatrix), Dst must be already
+ * [Src.columns() x Src.rows()]
+ */
+template <class SrcT, class DstT>
+void transposeBlocked(const SrcT &Src, DstT &Dst, size_t Block = 64,
+                      unsigned Threads = 0) {
+  assert(Dst.rows() == Src.columns() && Dst.columns() == Src.rows() &&
+         "incompatible matrices");
+  forEachBlocked(
+      Src.rows(), Src.columns(),
+      [&](size_t I, size_t J) { Dst(J, I) = Src(I, J); }, Block, Threads);
+}
+
+template <class T, class Alloc>
+void print(const Matrix<T, Alloc> &M, const char *Prefix,
            std::ostream &Os = std::cout) {
   Os << Prefix << " = {\n";
   for (int I = 0; I < M.rows(); ++I) {
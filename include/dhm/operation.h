@@ -1,8 +1,10 @@
 #pragma once
 
+#include "mapped_matrix.h"
 #include "matrix.h"
 #include "protocol.h"
 #include "splitter.h"
+#include <deque>
 
 namespace dhm {
 
@@ -10,26 +12,352 @@ namespace dhm {
 template <class DataT> class OperationBase {
 protected:
   CommunicationProtocol<DataT> &protocol;
+  /* see enableSpeculation(), 0 if disabled */
+  double speculation_threshold = 0;
+  /* see enableRebalancing(), 0 if disabled */
+  unsigned rebalance_chunks = 0;
 
   OperationBase(CommunicationProtocol<DataT> &p) : protocol(p) {}
 
-  void startAll(Operation op) {
-    auto worker_count = protocol.getWorkerCount();
-    for (size_t i = 0; i < worker_count; ++i)
-      protocol.start(i, op);
+public:
+  /* Tail-latency mode. Rows are split into several chunks per worker
+   * (chunks_per_worker of enableRebalancing() if set), handed out as
+   * workers finish. Once `threshold` fraction of chunks is done, chunks
+   * still being processed are duplicated onto idle workers, the first result
+   * is taken and the other request is cancelled. Chunks of failed workers
+   * are re-dispatched to the remaining ones instead of aborting
+   */
+  void enableSpeculation(double threshold = 0.75) {
+    assert(threshold > 0 && threshold <= 1 && "invalid threshold");
+    speculation_threshold = threshold;
   }
 
-  Matrix<DataT> waitAll(const WorkSplitterLinear &splitter, unsigned rows,
-                        unsigned columns) {
+  /* Elastic mode for changing membership. Rows are split into
+   * chunks_per_worker chunks per available worker, which are handed out as
+   * workers finish their previous ones. Workers which join mid-operation
+   * take a share of the remaining chunks, draining ones get no more, and
+   * chunks of failed workers are re-dispatched. Speculation takes
+   * precedence where both are enabled
+   */
+  void enableRebalancing(unsigned chunks_per_worker = 4) {
+    assert(chunks_per_worker > 0 && "invalid number of chunks");
+    rebalance_chunks = chunks_per_worker;
+  }
+
+protected:
+  /* Split rows of the result among workers in proportion to their
+   * weights, see CommunicationProtocol::getWorkerWeights().
+   * offload_fn(worker_id, range) sends operands for the given range of rows
+   * once operation is started. Results are taken as they arrive. Ranges
+   * rejected by overloaded workers are sent again after a backoff
+   */
+  template <class OffloadFn>
+  Matrix<DataT> runSplit(Operation op, unsigned rows, unsigned columns,
+                         OffloadFn offload_fn) {
+    if (speculation_threshold > 0)
+      return runSpeculative(op, rows, columns, offload_fn);
+
     Matrix<DataT> result(rows, columns);
+    runRanges(op, rows, offload_fn,
+              [&](unsigned worker_id, WorkRangeLinear work_range) {
+                protocol.waitResultInto(worker_id,
+                                        result.beginRow(work_range.FirstIdx),
+                                        work_range.size(), columns);
+              });
+    return result;
+  }
+
+  /* Split rows among workers like runSplit(), collect_fn(worker_id, range)
+   * takes result of every worker as it arrives. Speculation is not used
+   */
+  template <class OffloadFn, class CollectFn>
+  void runRanges(Operation op, unsigned rows, OffloadFn offload_fn,
+                 CollectFn collect_fn) {
+    if (rebalance_chunks)
+      return runElastic(op, rows, offload_fn, collect_fn);
+    protocol.updateMembership();
     auto worker_count = protocol.getWorkerCount();
-    for (size_t i = 0; i < worker_count; ++i) {
-      auto work_range = splitter.getRange(i);
-      auto chunk = protocol.waitResult(i);
-      assert(chunk.rows() == work_range.size());
-      assert(chunk.columns() == columns);
-      std::copy(chunk.begin(), chunk.end(),
-                result.beginRow(work_range.FirstIdx));
+    assert(worker_count > 0 && "no workers");
+    WorkSplitterLinear splitter(rows, protocol.getWorkerWeights(op));
+    auto send = [&](unsigned worker_id) {
+      protocol.start(worker_id, op);
+      offload_fn(worker_id, splitter.getRange(worker_id));
+      protocol.submit(worker_id);
+    };
+    std::vector<unsigned> busy;
+    for (unsigned i = 0; i < worker_count; ++i) {
+      /* workers without work (e.g. failed ones) are not bothered */
+      if (!splitter.getRange(i).size())
+        continue;
+      send(i);
+      busy.push_back(i);
+    }
+    std::vector<unsigned> rejections(worker_count, 0);
+    while (!busy.empty()) {
+      auto worker_id = protocol.waitAnyResult(busy);
+      try {
+        collect_fn(worker_id, splitter.getRange(worker_id));
+      } catch (WorkerBusy &) {
+        if (++rejections[worker_id] > MaxBusyRetries)
+          throw;
+        std::this_thread::sleep_for(backoffDelay(rejections[worker_id]));
+        send(worker_id);
+        continue;
+      }
+      busy.erase(std::find(busy.begin(), busy.end(), worker_id));
+    }
+  }
+
+private:
+  /* Requests pipelined to every worker in elastic mode, so that it does not
+   * idle while its next chunk is being sent
+   */
+  static constexpr size_t ElasticPipelineDepth = 2;
+  /* How long elastic mode waits for a worker to join when none is left */
+  static constexpr int MembershipWaitMs = 30000;
+  /* Chunks per worker in tail-latency mode by default, so that a duplicate
+   * re-runs only a small part of the job
+   */
+  static constexpr unsigned SpeculativeChunks = 4;
+
+  template <class OffloadFn, class CollectFn>
+  void runElastic(Operation op, unsigned rows, OffloadFn offload_fn,
+                  CollectFn collect_fn) {
+    protocol.updateMembership();
+    auto accepting = [this](unsigned i) {
+      return protocol.isAlive(i) && !protocol.isDraining(i);
+    };
+    unsigned available = 0;
+    for (unsigned i = 0; i < protocol.getWorkerCount(); ++i)
+      available += accepting(i);
+
+    auto chunk_count = std::max(available, 1u) * rebalance_chunks;
+    WorkSplitterLinear splitter(rows, chunk_count);
+    std::deque<WorkRangeLinear> pending;
+    for (unsigned i = 0; i < chunk_count; ++i)
+      if (splitter.getRange(i).size())
+        pending.push_back(splitter.getRange(i));
+
+    /* chunks submitted to every worker, the oldest one first */
+    std::vector<std::deque<WorkRangeLinear>> in_flight;
+    size_t rejections = 0;
+    auto last_progress = std::chrono::steady_clock::now();
+    while (true) {
+      protocol.updateMembership();
+      in_flight.resize(protocol.getWorkerCount());
+      size_t idle = 0;
+      for (unsigned i = 0; i < in_flight.size(); ++i)
+        idle += accepting(i) && in_flight[i].empty();
+      /* e.g. workers have joined, the largest chunks are halved for them */
+      while (!pending.empty() && pending.size() < idle) {
+        auto largest = std::max_element(
+            pending.begin(), pending.end(),
+            [](auto &a, auto &b) { return a.size() < b.size(); });
+        if (largest->size() < 2)
+          break;
+        auto half = WorkRangeLinear{largest->FirstIdx + largest->size() / 2,
+                                    largest->LastIdx};
+        largest->LastIdx = half.FirstIdx;
+        pending.insert(largest + 1, half);
+      }
+      /* every worker gets a chunk before any gets a pipelined one */
+      for (size_t depth = 1; depth <= ElasticPipelineDepth; ++depth) {
+        for (unsigned i = 0; i < in_flight.size() && !pending.empty(); ++i) {
+          if (!accepting(i) || in_flight[i].size() >= depth)
+            continue;
+          /* pipelined chunks are left for idle workers if they are short */
+          if (depth > 1 && pending.size() <= idle)
+            break;
+          try {
+            protocol.start(i, op);
+            offload_fn(i, pending.front());
+            protocol.submit(i);
+          } catch (std::exception &e) {
+            if (protocol.isAlive(i))
+              throw;
+            std::cerr << "warning: " << e.what() << std::endl;
+            continue;
+          }
+          if (in_flight[i].empty())
+            --idle;
+          in_flight[i].push_back(pending.front());
+          pending.pop_front();
+        }
+      }
+
+      std::vector<unsigned> busy;
+      for (unsigned i = 0; i < in_flight.size(); ++i)
+        if (!in_flight[i].empty())
+          busy.push_back(i);
+      if (busy.empty()) {
+        if (pending.empty())
+          return;
+        /* every worker has failed or is draining, wait for a new one */
+        if (std::chrono::steady_clock::now() - last_progress >
+            std::chrono::milliseconds(MembershipWaitMs))
+          throw std::runtime_error("no workers available");
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(MembershipPollMs));
+        continue;
+      }
+      last_progress = std::chrono::steady_clock::now();
+
+      auto worker_id = protocol.waitAnyResult(busy, MembershipPollMs);
+      if (worker_id < 0)
+        continue;
+      auto range = in_flight[worker_id].front();
+      in_flight[worker_id].pop_front();
+      try {
+        collect_fn(worker_id, range);
+      } catch (WorkerBusy &) {
+        if (++rejections > MaxBusyRetries * chunk_count)
+          throw;
+        pending.push_front(range);
+        std::this_thread::sleep_for(backoffDelay(rejections / chunk_count));
+      } catch (std::exception &e) {
+        /* worker is alive, so request itself is invalid */
+        if (protocol.isAlive(worker_id))
+          throw;
+        std::cerr << "warning: " << e.what() << ", rows [" << range.FirstIdx
+                  << "; " << range.LastIdx << ") are re-dispatched"
+                  << std::endl;
+        pending.push_front(range);
+        /* later requests to the failed worker are lost as well */
+        for (auto &&lost : in_flight[worker_id])
+          pending.push_back(lost);
+        in_flight[worker_id].clear();
+      }
+    }
+  }
+
+  struct Chunk {
+    WorkRangeLinear range;
+    /* workers processing the chunk, more than one if duplicated */
+    std::vector<unsigned> workers;
+    bool done = false;
+  };
+
+  template <class OffloadFn>
+  Matrix<DataT> runSpeculative(Operation op, unsigned rows, unsigned columns,
+                               OffloadFn offload_fn) {
+    protocol.updateMembership();
+    auto worker_count = protocol.getWorkerCount();
+    std::vector<unsigned> alive;
+    for (unsigned i = 0; i < worker_count; ++i)
+      if (protocol.isAlive(i) && !protocol.isDraining(i))
+        alive.push_back(i);
+    if (alive.empty())
+      throw std::runtime_error("no workers available");
+
+    auto chunks_per_worker =
+        rebalance_chunks ? rebalance_chunks : SpeculativeChunks;
+    auto chunk_count = alive.size() * chunks_per_worker;
+    WorkSplitterLinear splitter(rows, chunk_count);
+    std::vector<Chunk> chunks;
+    /* chunks not assigned to any worker yet, duplicates are only made once
+     * there are none
+     */
+    std::deque<size_t> orphaned;
+    for (size_t i = 0; i < chunk_count; ++i) {
+      if (!splitter.getRange(i).size())
+        continue;
+      orphaned.push_back(chunks.size());
+      chunks.push_back(Chunk{splitter.getRange(i), {}});
+    }
+    /* chunk being processed by each worker, -1 if idle */
+    std::vector<int> assignment(worker_count, -1);
+
+    auto dispatch = [&](unsigned worker_id, size_t chunk_id) {
+      try {
+        protocol.start(worker_id, op);
+        offload_fn(worker_id, chunks[chunk_id].range);
+        protocol.submit(worker_id);
+      } catch (std::exception &e) {
+        if (protocol.isAlive(worker_id))
+          throw;
+        std::cerr << "warning: " << e.what() << std::endl;
+        return false;
+      }
+      assignment[worker_id] = chunk_id;
+      chunks[chunk_id].workers.push_back(worker_id);
+      return true;
+    };
+
+    /* chunk still processed by a single worker, the oldest one first */
+    auto pick_straggler = [&]() -> int {
+      for (size_t i = 0; i < chunks.size(); ++i)
+        if (!chunks[i].done && chunks[i].workers.size() == 1)
+          return i;
+      return -1;
+    };
+
+    Matrix<DataT> result(rows, columns);
+    size_t done = 0, rejections = 0;
+    while (done < chunks.size()) {
+      /* workers which join take orphaned chunks and duplicates */
+      protocol.updateMembership();
+      worker_count = protocol.getWorkerCount();
+      assignment.resize(worker_count, -1);
+      for (unsigned i = 0; i < worker_count; ++i) {
+        if (assignment[i] != -1 || !protocol.isAlive(i) ||
+            protocol.isDraining(i))
+          continue;
+        if (!orphaned.empty()) {
+          if (dispatch(i, orphaned.front()))
+            orphaned.pop_front();
+        } else if (done >= speculation_threshold * chunks.size()) {
+          if (auto chunk_id = pick_straggler(); chunk_id != -1)
+            dispatch(i, chunk_id);
+        }
+      }
+
+      std::vector<unsigned> busy;
+      for (unsigned i = 0; i < worker_count; ++i)
+        if (assignment[i] != -1)
+          busy.push_back(i);
+      if (busy.empty())
+        throw std::runtime_error("all workers failed");
+
+      auto worker_id = protocol.waitAnyResult(busy, MembershipPollMs);
+      if (worker_id < 0)
+        continue;
+      auto &chunk = chunks[assignment[worker_id]];
+      assignment[worker_id] = -1;
+      chunk.workers.erase(
+          std::find(chunk.workers.begin(), chunk.workers.end(), worker_id));
+      try {
+        protocol.waitResultInto(worker_id,
+                                result.beginRow(chunk.range.FirstIdx),
+                                chunk.range.size(), columns);
+      } catch (WorkerBusy &) {
+        /* nothing was computed, the chunk waits for any idle worker */
+        if (++rejections > MaxBusyRetries * chunks.size())
+          throw;
+        if (chunk.workers.empty())
+          orphaned.push_back(&chunk - chunks.data());
+        std::this_thread::sleep_for(backoffDelay(rejections / chunks.size()));
+        continue;
+      } catch (std::exception &e) {
+        /* worker is alive, so request itself is invalid */
+        if (protocol.isAlive(worker_id))
+          throw;
+        std::cerr << "warning: " << e.what() << ", rows ["
+                  << chunk.range.FirstIdx << "; " << chunk.range.LastIdx
+                  << ") are re-dispatched" << std::endl;
+        if (chunk.workers.empty())
+          orphaned.push_back(&chunk - chunks.data());
+        continue;
+      }
+      chunk.done = true;
+      ++done;
+      for (auto other : chunk.workers) {
+        try {
+          protocol.cancel(other);
+        } catch (std::exception &) {
+        }
+        assignment[other] = -1;
+      }
+      chunk.workers.clear();
     }
     return result;
   }
@@ -41,17 +369,12 @@ public:
   Echo(CommunicationProtocol<DataT> &p) : OperationBase<DataT>(p) {}
 
   Matrix<DataT> echo(const Matrix<DataT> &A) {
-    auto worker_count = this->protocol.getWorkerCount();
-    assert(worker_count > 0 && "no workers");
-
-    this->startAll(OP_ECHO);
-    WorkSplitterLinear splitter(A.rows(), worker_count);
-    for (size_t i = 0; i < worker_count; ++i) {
-      auto work_range = splitter.getRange(i);
-      this->protocol.offload(i, A.beginRow(work_range.FirstIdx),
-                             work_range.size(), A.columns());
-    }
-    return this->waitAll(splitter, A.rows(), A.columns());
+    return this->runSplit(
+        OP_ECHO, A.rows(), A.columns(),
+        [&](unsigned i, WorkRangeLinear work_range) {
+          this->protocol.offload(i, A.beginRow(work_range.FirstIdx),
+                                 work_range.size(), A.columns());
+        });
   }
 };
 
@@ -63,19 +386,14 @@ public:
   Matrix<DataT> add(const Matrix<DataT> &A, const Matrix<DataT> &B) {
     assert(A.rows() == B.rows());
     assert(A.columns() == B.columns());
-    auto worker_count = this->protocol.getWorkerCount();
-    assert(worker_count > 0 && "no workers");
-
-    WorkSplitterLinear splitter(A.rows(), worker_count);
-    this->startAll(OP_ADD);
-    for (size_t i = 0; i < worker_count; ++i) {
-      auto work_range = splitter.getRange(i);
-      this->protocol.offload(i, A.beginRow(work_range.FirstIdx), work_range.size(),
-                       A.columns());
-      this->protocol.offload(i, B.beginRow(work_range.FirstIdx), work_range.size(),
-                       B.columns());
-    }
-    return this->waitAll(splitter, A.rows(), A.columns());
+    return this->runSplit(
+        OP_ADD, A.rows(), A.columns(),
+        [&](unsigned i, WorkRangeLinear work_range) {
+          this->protocol.offload(i, A.beginRow(work_range.FirstIdx),
+                                 work_range.size(), A.columns());
+          this->protocol.offload(i, B.beginRow(work_range.FirstIdx),
+                                 work_range.size(), B.columns());
+        });
   }
 };
 
@@ -86,19 +404,216 @@ public:
 
   Matrix<DataT> multiply(const Matrix<DataT> &A, const Matrix<DataT> &B) {
     assert(A.columns() == B.rows());
+    /* B is sent in its own storage order, worker handles both */
+    auto shared_B = this->protocol.newShareId();
+    return this->runSplit(
+        OP_MUL, A.rows(), B.columns(),
+        [&](unsigned i, WorkRangeLinear work_range) {
+          this->protocol.offload(i, A.beginRow(work_range.FirstIdx),
+                                 work_range.size(), A.columns());
+          this->protocol.offloadShared(i, B, shared_B);
+        });
+  }
+};
+
+/* Multiplication of many small matrices at once, e.g. inference traffic.
+ * Row i of As is row-major A_i of [shape.m x shape.k], row i of Bs is B_i
+ * of [shape.k x shape.n], and row i of the result is A_i * B_i. Items are
+ * split among workers, so one request carries thousands of products
+ */
+template <class DataT> class BatchedMultiplier : public OperationBase<DataT> {
+public:
+  BatchedMultiplier(CommunicationProtocol<DataT> &p)
+      : OperationBase<DataT>(p) {}
+
+  Matrix<DataT> multiply(const Matrix<DataT> &As, const Matrix<DataT> &Bs,
+                         BatchShape shape) {
+    assert(As.rows() == Bs.rows());
+    assert(As.columns() == shape.m * shape.k);
+    assert(Bs.columns() == shape.k * shape.n);
+    return this->runSplit(
+        OP_BATCHED_MUL, As.rows(), shape.m * shape.n,
+        [&](unsigned i, WorkRangeLinear work_range) {
+          this->protocol.sendRawData(i, &shape, sizeof(shape));
+          this->protocol.offload(i, As.beginRow(work_range.FirstIdx),
+                                 work_range.size(), As.columns());
+          this->protocol.offload(i, Bs.beginRow(work_range.FirstIdx),
+                                 work_range.size(), Bs.columns());
+        });
+  }
+};
+
+/* Element-wise chain over equally sized row-major matrices, optionally
+ * reduced, see elementwise.h. Row reductions come back as parts of
+ * [rows x 1] result. Other reductions are computed by every worker over
+ * its rows and combined here, so only O(rows + columns) values come back
+ */
+template <class DataT> class ElementwiseOperation : public OperationBase<DataT> {
+public:
+  ElementwiseOperation(CommunicationProtocol<DataT> &p)
+      : OperationBase<DataT>(p) {}
+
+  Matrix<DataT> run(const ElementwiseChain &chain,
+                    const std::vector<const Matrix<DataT> *> &operands) {
+    assert(operands.size() == chain.operandCount());
+    auto &A = *operands[0];
+    for (auto *M : operands)
+      assert(M->rows() == A.rows() && M->columns() == A.columns());
+    auto offload_fn = [&](unsigned i, WorkRangeLinear work_range) {
+      this->protocol.sendRawData(i, &chain, sizeof(chain));
+      for (auto *M : operands)
+        this->protocol.offload(i, M->beginRow(work_range.FirstIdx),
+                               work_range.size(), M->columns());
+    };
+    auto reduce = chain.Reduce;
+    auto shape = reducedShape(reduce, A.rows(), A.columns());
+    if (reduce == RED_NONE || isRowReduction(reduce))
+      return this->runSplit(OP_ELEMENTWISE, A.rows(), shape.second,
+                            offload_fn);
+
+    Matrix<DataT> result(shape.first, shape.second), partial = result;
+    bool first = true;
+    this->runRanges(OP_ELEMENTWISE, A.rows(), offload_fn,
+                    [&](unsigned worker_id, WorkRangeLinear) {
+                      this->protocol.waitResultInto(
+                          worker_id, first ? result.data() : partial.data(),
+                          partial.rows(), partial.columns());
+                      if (!first)
+                        combinePartial(reduce, result.data(), partial.data(),
+                                       partial.size());
+                      first = false;
+                    });
+    finishReduction(reduce, result.data(), result.size());
+    return result;
+  }
+};
+
+/* Multiplication of encrypted A by plaintext B, e.g. by public weights.
+ * B is neither encrypted nor transposed, workers multiply ciphertexts by
+ * encoded diagonals of B. Rows of A and of the result must fit into
+ * ciphertext slots
+ */
+class PlainWeightsMultiplier : public OperationBase<double> {
+  EncryptionProtocol &enc_protocol;
+
+public:
+  PlainWeightsMultiplier(EncryptionProtocol &p)
+      : OperationBase<double>(p), enc_protocol(p) {}
+
+  Matrix<double> multiply(const Matrix<double> &A, const Matrix<double> &B) {
+    assert(A.columns() == B.rows());
+    auto shared_B = this->protocol.newShareId();
+    return this->runSplit(
+        OP_PMUL, A.rows(), B.columns(),
+        [&](unsigned i, WorkRangeLinear work_range) {
+          enc_protocol.offload(i, A.beginRow(work_range.FirstIdx),
+                               work_range.size(), A.columns());
+          enc_protocol.offloadPlain(i, B, shared_B);
+        });
+  }
+};
+
+/* Out-of-core operations on memory-mapped matrices. Rows are processed in
+ * tiles of tile_rows, each tile is offloaded straight from the mapping and
+ * results are written into the output mapping as they arrive, so neither
+ * inputs nor result have to fit into memory here. B of a product is shared
+ * by all tiles: every worker gets it once and keeps it in its shared data
+ * cache, so it has to fit into worker memory. Next tile is submitted before
+ * waiting for the current one, so transfers overlap with computation
+ */
+template <class DataT> class StreamingOperation : public OperationBase<DataT> {
+  unsigned tile_rows;
+
+public:
+  StreamingOperation(CommunicationProtocol<DataT> &p, unsigned tile_rows)
+      : OperationBase<DataT>(p), tile_rows(tile_rows) {
+    assert(tile_rows > 0 && "invalid tile size");
+  }
+
+  void echo(const MappedMatrix<DataT> &A, MappedMatrix<DataT> &Res) {
+    assert(Res.rows() == A.rows() && Res.columns() == A.columns());
+    run(OP_ECHO, Res, {&A}, [&](unsigned i, size_t first, size_t rows) {
+      this->protocol.offload(i, A.beginRow(first), rows, A.columns());
+    });
+  }
+
+  void add(const MappedMatrix<DataT> &A, const MappedMatrix<DataT> &B,
+           MappedMatrix<DataT> &Res) {
+    assert(A.rows() == B.rows() && A.columns() == B.columns());
+    assert(Res.rows() == A.rows() && Res.columns() == A.columns());
+    run(OP_ADD, Res, {&A, &B}, [&](unsigned i, size_t first, size_t rows) {
+      this->protocol.offload(i, A.beginRow(first), rows, A.columns());
+      this->protocol.offload(i, B.beginRow(first), rows, B.columns());
+    });
+  }
+
+  void multiply(const MappedMatrix<DataT> &A, const MappedMatrix<DataT> &B,
+                MappedMatrix<DataT> &Res) {
+    assert(A.columns() == B.rows());
+    assert(Res.rows() == A.rows() && Res.columns() == B.columns());
+    /* every tile is multiplied by the whole B, workers keep it */
+    auto shared_B = this->protocol.newShareId();
+    this->protocol.reuseShared(shared_B);
+    run(OP_MUL, Res, {&A}, [&](unsigned i, size_t first, size_t rows) {
+      this->protocol.offload(i, A.beginRow(first), rows, A.columns());
+      this->protocol.offloadShared(i, B.data(), B.rows(), B.columns(),
+                                   ROW_MAJOR, shared_B);
+    });
+  }
+
+private:
+  /* offload_fn(worker_id, first_row, rows) sends worker's part of the tile.
+   * Once tile is done, its rows are released from memory in Res and in
+   * row-tiled inputs
+   */
+  template <class OffloadFn>
+  void run(Operation op, MappedMatrix<DataT> &Res,
+           std::initializer_list<const MappedMatrix<DataT> *> tiled_inputs,
+           OffloadFn offload_fn) {
     auto worker_count = this->protocol.getWorkerCount();
     assert(worker_count > 0 && "no workers");
 
-    auto BT = B.getTransposed();
-    WorkSplitterLinear splitter(A.rows(), worker_count);
-    this->startAll(OP_MUL);
-    for (size_t i = 0; i < worker_count; ++i) {
-      auto work_range = splitter.getRange(i);
-      this->protocol.offload(i, A.beginRow(work_range.FirstIdx), work_range.size(),
-                       A.columns());
-      this->protocol.offloadMatrix(i, BT);
+    /* the same split is used for every tile */
+    auto weights = this->protocol.getWorkerWeights(op);
+    auto tile_first = [this](size_t tile) { return tile * tile_rows; };
+    auto tile_size = [&](size_t tile) {
+      return std::min<size_t>(tile_rows, Res.rows() - tile_first(tile));
+    };
+    auto submit_tile = [&](size_t tile) {
+      WorkSplitterLinear splitter(tile_size(tile), weights);
+      for (size_t i = 0; i < worker_count; ++i) {
+        auto work_range = splitter.getRange(i);
+        if (!work_range.size())
+          continue;
+        this->protocol.start(i, op);
+        offload_fn(i, tile_first(tile) + work_range.FirstIdx,
+                   work_range.size());
+        this->protocol.submit(i);
+      }
+    };
+    auto finish_tile = [&](size_t tile) {
+      WorkSplitterLinear splitter(tile_size(tile), weights);
+      for (size_t i = 0; i < worker_count; ++i) {
+        auto work_range = splitter.getRange(i);
+        if (!work_range.size())
+          continue;
+        this->protocol.waitResultInto(
+            i, Res.beginRow(tile_first(tile) + work_range.FirstIdx),
+            work_range.size(), Res.columns());
+      }
+      for (auto *input : tiled_inputs)
+        input->release(tile_first(tile), tile_size(tile));
+      Res.release(tile_first(tile), tile_size(tile));
+    };
+
+    size_t tile_count = (Res.rows() + tile_rows - 1) / tile_rows;
+    for (size_t tile = 0; tile < tile_count; ++tile) {
+      submit_tile(tile);
+      if (tile > 0)
+        finish_tile(tile - 1);
     }
-    return this->waitAll(splitter, A.rows(), A.columns());
+    if (tile_count > 0)
+      finish_tile(tile_count - 1);
   }
 };
 
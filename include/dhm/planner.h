@@ -0,0 +1,450 @@
+#pragma once
+
+#include "common.h"
+#include "he_kernels.h"
+#include "keystore.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace dhm {
+
+/* What encryption parameters are needed for */
+struct PlanRequest {
+  EncScheme scheme = SCHEME_CKKS;
+  Operation op = OP_HMUL;
+  /* multiplicative depth of the computation, see opDepth() */
+  unsigned depth = 0;
+  /* matrix row width, i.e. number of slots used */
+  unsigned row_width = 0;
+  /* bits of precision of results, relative to their magnitude. CKKS only */
+  unsigned precision = 20;
+  /* log2 of the largest absolute value of results */
+  unsigned magnitude_bits = 0;
+  /* 128, 192 or 256 bits */
+  unsigned security = 128;
+  /* BGV only: plaintext modulus, 0 to choose automatically */
+  unsigned plaintext_modulus = 0;
+
+  PlanRequest() = default;
+  PlanRequest(Operation op, unsigned row_width, unsigned precision,
+              unsigned magnitude_bits, unsigned security)
+      : op(op), depth(opDepth(op)), row_width(row_width),
+        precision(precision), magnitude_bits(magnitude_bits),
+        security(security) {}
+
+  /* Exact integer computation with results in [-2^magnitude_bits;
+   * 2^magnitude_bits]
+   */
+  static PlanRequest bgv(Operation op, unsigned row_width,
+                         unsigned magnitude_bits, unsigned security,
+                         unsigned plaintext_modulus = 0) {
+    PlanRequest req(op, row_width, 0, magnitude_bits, security);
+    req.scheme = SCHEME_BGV;
+    req.plaintext_modulus = plaintext_modulus;
+    return req;
+  }
+
+  static unsigned opDepth(Operation op) {
+    return op == OP_HMUL || op == OP_PMUL ? 1 : 0;
+  }
+};
+
+/* Noise headroom of fresh ciphertexts and of every rescaling, in bits */
+constexpr unsigned FreshNoiseBits = 10;
+constexpr unsigned LevelNoiseBits = 10;
+/* BGV noise grows by about this many bits over log2(p) per level */
+constexpr unsigned BgvLevelNoiseBits = 30;
+constexpr unsigned MaxCyclotomicOrder = 1 << 18;
+
+/* Largest modulus in bits keeping given security for ring dimension phi.
+ * Linear fit of the HomomorphicEncryption.org standard tables for ternary
+ * secrets (e.g. 881 bits at phi = 32768 for 128-bit security)
+ */
+inline double maxModulusBits(size_t phi, unsigned security) {
+  double bits_per_dimension;
+  if (security == 128)
+    bits_per_dimension = 0.0269;
+  else if (security == 192)
+    bits_per_dimension = 0.0186;
+  else if (security == 256)
+    bits_per_dimension = 0.0145;
+  else
+    throw std::runtime_error("unsupported security level " +
+                             std::to_string(security));
+  return phi * bits_per_dimension;
+}
+
+inline unsigned log2Ceil(unsigned long value) {
+  unsigned res = 0;
+  while ((1ul << res) < value)
+    ++res;
+  return res;
+}
+
+/* Bits of ciphertext modulus consumed by the computation. For CKKS the
+ * modulus must hold result magnitude and precision, and every
+ * multiplication level consumes another precision bits on rescaling. For
+ * BGV fresh ciphertexts and every level hold noise a bit above p
+ */
+inline unsigned requiredBits(const PlanRequest &req, unsigned p = 0) {
+  if (req.scheme == SCHEME_BGV)
+    return FreshNoiseBits + (req.depth + 1) * (log2Ceil(p) + BgvLevelNoiseBits);
+  return FreshNoiseBits + req.magnitude_bits + req.precision +
+         req.depth * (req.precision + LevelNoiseBits);
+}
+
+/* Key-switching primes add about bits / c to the total modulus */
+inline double totalModulusBits(unsigned bits, unsigned c) {
+  return bits * (1.0 + 1.0 / c);
+}
+
+inline unsigned nextPowerOf2(unsigned value) {
+  unsigned res = 1;
+  while (res < value)
+    res *= 2;
+  return res;
+}
+
+inline bool isPrime(unsigned long value) {
+  if (value < 2)
+    return false;
+  for (unsigned long d = 2; d * d <= value; ++d)
+    if (value % d == 0)
+      return false;
+  return true;
+}
+
+/* Multiplicative order of p modulo m, 0 if they are not coprime */
+inline unsigned multiplicativeOrder(unsigned long p, unsigned m) {
+  if (std::gcd<unsigned long>(p, m) != 1)
+    return 0;
+  unsigned long value = p % m;
+  unsigned order = 1;
+  for (; value != 1 % m; ++order)
+    value = value * (p % m) % m;
+  return order;
+}
+
+/* Slot count of power-of-two m: m/4 for CKKS, phi(m) / ord_m(p) for BGV */
+inline unsigned slotCount(EncScheme scheme, unsigned m, unsigned p) {
+  if (scheme != SCHEME_BGV)
+    return m / 4;
+  auto order = multiplicativeOrder(p, m);
+  return order ? m / 2 / order : 0;
+}
+
+/* Plaintext modulus for BGV with the given m. Unless requested explicitly,
+ * it is the smallest prime p = 1 (mod m) holding results of both signs, so
+ * that all m/2 slots are used. 0 if there is none
+ */
+inline unsigned plaintextModulus(const PlanRequest &req, unsigned m) {
+  if (req.plaintext_modulus)
+    return req.plaintext_modulus;
+  constexpr unsigned long MaxModulus = 1ul << 32;
+  unsigned long min_p = (2ul << req.magnitude_bits) + 1;
+  for (unsigned long p = (min_p + m - 2) / m * m + 1; p < MaxModulus; p += m)
+    if (isPrime(p))
+      return p;
+  return 0;
+}
+
+/* Power-of-two m has at most m/2 slots */
+inline unsigned minimalM(const PlanRequest &req) {
+  unsigned slots_per_m = req.scheme == SCHEME_BGV ? 2 : 4;
+  return slots_per_m * nextPowerOf2(std::max(req.row_width, 1u));
+}
+
+inline EncContextOptions makeOptions(const PlanRequest &req, unsigned m,
+                                     unsigned bits, unsigned c) {
+  if (req.scheme == SCHEME_BGV)
+    return EncContextOptions::bgv(m, bits, c, plaintextModulus(req, m));
+  return EncContextOptions(m, bits, req.precision, c);
+}
+
+/* Whether m has plaintext modulus and enough slots for the request */
+inline bool fitsRequest(const PlanRequest &req, unsigned m) {
+  if (req.scheme != SCHEME_BGV)
+    return true;
+  auto p = plaintextModulus(req, m);
+  return p && slotCount(req.scheme, m, p) >= req.row_width;
+}
+
+/* Smallest secure power-of-two m with at least row_width slots for the
+ * given bits and c, 0 if there is none
+ */
+inline unsigned smallestM(const PlanRequest &req, unsigned bits, unsigned c) {
+  for (unsigned m = minimalM(req); m <= MaxCyclotomicOrder; m *= 2)
+    if (fitsRequest(req, m) &&
+        totalModulusBits(bits, c) <= maxModulusBits(m / 2, req.security))
+      return m;
+  return 0;
+}
+
+/* Smallest parameters satisfying the request: smallest m, and then the
+ * smallest c (fastest key switching) for it
+ */
+inline EncContextOptions planParameters(const PlanRequest &req) {
+  if (req.scheme == SCHEME_BGV && req.magnitude_bits >= 31)
+    throw std::runtime_error("no plaintext modulus for " +
+                             std::to_string(req.magnitude_bits) +
+                             "-bit results");
+  if (req.scheme == SCHEME_BGV && req.plaintext_modulus &&
+      req.plaintext_modulus <= (2ul << req.magnitude_bits))
+    throw std::runtime_error("plaintext modulus " +
+                             std::to_string(req.plaintext_modulus) +
+                             " is too small for " +
+                             std::to_string(req.magnitude_bits) +
+                             "-bit results");
+  unsigned bits = 0;
+  for (unsigned m = minimalM(req); m <= MaxCyclotomicOrder; m *= 2) {
+    if (!fitsRequest(req, m))
+      continue;
+    bits = requiredBits(req, plaintextModulus(req, m));
+    for (unsigned c = 2; c <= 4; ++c)
+      if (totalModulusBits(bits, c) <= maxModulusBits(m / 2, req.security))
+        return makeOptions(req, m, bits, c);
+  }
+  throw std::runtime_error("no secure parameters for " +
+                           std::to_string(bits) + " bits of modulus");
+}
+
+/* Result of probeParameters() */
+struct TuneResult {
+  EncContextOptions options;
+  /* time to encrypt, process and decrypt one row */
+  double seconds = 0;
+  /* max error relative to the largest result, must be 0 for BGV */
+  double error = 0;
+  bool accurate = false;
+  /* capacity consumed by the row, and columns it had */
+  NoiseBudget budget;
+  unsigned columns = 0;
+};
+
+/* Run the operation on one random row with given keys. Operands are scaled
+ * so that results have requested magnitude, and are integers for BGV
+ */
+inline TuneResult probeParameters(const PlanRequest &req, const KeySet &keys) {
+  /* hmul is measured on a few columns, its time is linear in their count */
+  constexpr unsigned MulColumns = 8;
+
+  TuneResult res;
+  res.options = keys.options;
+  const helib::PubKey &pk = *keys.sk;
+  unsigned n = std::max(req.row_width, 1u);
+  unsigned columns = req.op == OP_HADD ? n : std::min(n, MulColumns);
+  res.columns = columns;
+  bool exact = keys.options.scheme == SCHEME_BGV;
+  double scale = std::ldexp(1.0, req.magnitude_bits);
+  if (req.op != OP_HADD)
+    scale = std::sqrt(scale / n);
+  if (exact)
+    scale = std::max(std::floor(scale), 1.0);
+
+  std::default_random_engine gen;
+  std::uniform_real_distribution<double> distrib(-scale, scale);
+  auto random_vector = [&](size_t size) {
+    std::vector<double> v(size);
+    std::generate(v.begin(), v.end(), [&] {
+      return exact ? std::round(distrib(gen)) : distrib(gen);
+    });
+    return v;
+  };
+  auto a = random_vector(n);
+  /* [n x columns] for pmul, rows of B^T for hmul, second row for hadd */
+  auto b = random_vector(req.op == OP_HADD ? n : n * columns);
+
+  std::vector<double> expected(columns);
+  if (req.op == OP_HADD) {
+    for (unsigned j = 0; j < n; ++j)
+      expected[j] = a[j] + b[j];
+  } else {
+    for (unsigned j = 0; j < columns; ++j)
+      for (unsigned i = 0; i < n; ++i)
+        expected[j] += req.op == OP_PMUL ? a[i] * b[i * columns + j]
+                                         : a[i] * b[j * n + i];
+    /* hmul returns prefix sums */
+    if (req.op == OP_HMUL)
+      std::partial_sum(expected.begin(), expected.end(), expected.begin());
+  }
+
+  std::vector<EncodedDiagonal> diagonals;
+  std::vector<helib::Ctxt> rows;
+  if (req.op == OP_PMUL) {
+    diagonals = encodeDiagonals(*keys.context, b.data(), n, columns);
+  } else {
+    for (unsigned j = 0; j < (req.op == OP_HADD ? 1 : columns); ++j)
+      rows.push_back(encrypt(
+          std::vector<double>(b.begin() + j * n, b.begin() + (j + 1) * n),
+          pk));
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto v = encrypt(a, pk);
+  res.budget.recordInput(v);
+  if (req.op == OP_HADD)
+    tracked(&res.budget, STAGE_ADD, v, [&] { v += rows[0]; });
+  else if (req.op == OP_HMUL)
+    v = multiply(v, rows, &res.budget);
+  else
+    v = multiplyDiagonals(v, diagonals, &res.budget);
+  res.budget.recordResult(v);
+  auto result = decrypt(v, *keys.sk);
+  res.seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+
+  double max_value = 0, max_error = 0;
+  for (unsigned j = 0; j < columns && j < result.size(); ++j) {
+    max_value = std::max(max_value, std::fabs(expected[j]));
+    max_error = std::max(max_error, std::fabs(expected[j] - result[j]));
+  }
+  res.error = max_value ? max_error / max_value : max_error;
+  res.accurate = result.size() >= columns &&
+                 (exact ? res.error == 0
+                        : res.error <= std::ldexp(1.0, -int(req.precision)));
+  return res;
+}
+
+/* probeParameters() with fresh keys */
+inline TuneResult benchmarkParameters(const PlanRequest &req,
+                                      const EncContextOptions &opts) {
+  return probeParameters(req, *KeySet::generate(opts));
+}
+
+/* Capacity the full operation is expected to leave in results, given the
+ * probe of one row. hmul of a row adds up shifted products of all columns,
+ * and every doubling of their count costs up to a bit more than the probe
+ * paid. pmul probes are run on all diagonals already
+ */
+inline double projectedCapacity(const PlanRequest &req,
+                                const TuneResult &probe) {
+  double capacity = probe.budget.result_capacity;
+  if (req.op == OP_HMUL && req.row_width > probe.columns)
+    capacity -= std::log2(double(req.row_width) / probe.columns);
+  return capacity;
+}
+
+/* Throws if the operation would run out of capacity or precision with the
+ * probed parameters, before anything is sent to workers
+ */
+inline void checkBudget(const PlanRequest &req, const TuneResult &probe) {
+  auto capacity = projectedCapacity(req, probe);
+  std::ostringstream os;
+  os << std::setprecision(3);
+  if (capacity < MinResultCapacity)
+    os << "results would have " << capacity << " bits of capacity left, "
+       << MinResultCapacity << " are needed";
+  else if (!probe.accurate)
+    os << "relative error of a probe " << probe.error << " exceeds "
+       << (probe.options.scheme == SCHEME_BGV
+               ? 0
+               : std::ldexp(1.0, -int(req.precision)));
+  else
+    return;
+  throw std::runtime_error("noise budget exhausted: " + os.str() +
+                           ", more modulus bits are needed");
+}
+
+/* Parameters tuned on this machine, stored as text lines "<scheme> <op>
+ * <depth> <row_width> <precision> <magnitude> <security> <plaintext_modulus>
+ * m bits c p"
+ */
+class TunedParameters {
+  std::string path;
+
+  static std::string key(const PlanRequest &req) {
+    std::ostringstream os;
+    os << (req.scheme == SCHEME_BGV ? "bgv" : "ckks") << " "
+       << opToString(req.op) << " " << req.depth << " " << req.row_width
+       << " " << req.precision << " " << req.magnitude_bits << " "
+       << req.security << " " << req.plaintext_modulus;
+    return os.str();
+  }
+
+public:
+  explicit TunedParameters(std::string path) : path(std::move(path)) {}
+
+  bool find(const PlanRequest &req, EncContextOptions &opts) const {
+    std::ifstream is(path);
+    std::string line, req_key = key(req);
+    while (std::getline(is, line)) {
+      if (line.compare(0, req_key.size(), req_key) != 0 ||
+          line.size() <= req_key.size() || line[req_key.size()] != ' ')
+        continue;
+      std::istringstream fields(line.substr(req_key.size()));
+      EncContextOptions res(0, 0, req.precision, 0);
+      res.scheme = req.scheme;
+      if (fields >> res.m >> res.bits >> res.c >> res.p) {
+        opts = res;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void store(const PlanRequest &req, const EncContextOptions &opts) const {
+    std::ofstream os(path, std::ios::app);
+    os << key(req) << " " << opts.m << " " << opts.bits << " " << opts.c
+       << " " << opts.p << "\n";
+    if (!os)
+      throw std::runtime_error("cannot write '" + path + "'");
+  }
+};
+
+/* Benchmark the planned parameters and their neighbours (more modulus bits
+ * in case planned ones lack precision, larger c for cheaper modulus) and
+ * pick the fastest accurate set. Results are cached in cache_file
+ */
+inline EncContextOptions autotune(const PlanRequest &req,
+                                  const std::string &cache_file,
+                                  std::ostream *log = nullptr) {
+  TunedParameters cache(cache_file);
+  EncContextOptions best;
+  if (cache.find(req, best))
+    return best;
+
+  auto planned_bits = planParameters(req).bits;
+  std::vector<EncContextOptions> candidates;
+  for (unsigned extra_bits : {0u, LevelNoiseBits, 2 * LevelNoiseBits})
+    for (unsigned c = 2; c <= 3; ++c) {
+      auto bits = planned_bits + extra_bits;
+      if (auto m = smallestM(req, bits, c))
+        candidates.push_back(makeOptions(req, m, bits, c));
+    }
+
+  bool found = false;
+  double best_time = 0;
+  for (auto &&opts : candidates) {
+    auto res = benchmarkParameters(req, opts);
+    if (log) {
+      *log << "autotune: m " << opts.m << " bits " << opts.bits << " c "
+           << opts.c;
+      if (opts.scheme == SCHEME_BGV)
+        *log << " p " << opts.p;
+      *log << ": " << res.seconds << " s, error " << res.error
+           << (res.accurate ? "" : " (inaccurate)") << std::endl;
+    }
+    if (res.accurate && (!found || res.seconds < best_time)) {
+      found = true;
+      best = opts;
+      best_time = res.seconds;
+    }
+  }
+  if (!found)
+    throw std::runtime_error("autotune: no accurate parameters found");
+  cache.store(req, best);
+  return best;
+}
+
+} // namespace dhm
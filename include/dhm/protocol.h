@@ -1,11 +1,57 @@
 #pragma once
 
+#include "allocator.h"
+#include "batched_gemm.h"
 #include "common.h"
+#include "elementwise.h"
+#include "he_kernels.h"
+#include "keystore.h"
 #include "matrix.h"
+#include "relay.h"
+#include "splitter.h"
+#include "thread_pool.h"
 #include <boost/asio.hpp>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <map>
+#include <optional>
+#include <poll.h>
+#include <random>
+#include <set>
 
 namespace dhm {
 
+/* Request was rejected by an overloaded worker before processing, it may be
+ * sent again later
+ */
+struct WorkerBusy : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+/* Retries of rejected requests are paused for random time up to
+ * InitialBackoffMs * 2^attempt, so that clients do not retry in lockstep
+ */
+constexpr unsigned InitialBackoffMs = 20;
+constexpr unsigned MaxBusyRetries = 8;
+
+inline std::chrono::milliseconds backoffDelay(unsigned attempt) {
+  thread_local std::minstd_rand gen(std::random_device{}());
+  unsigned max_delay = InitialBackoffMs << std::min(attempt, 10u);
+  std::uniform_int_distribution<unsigned> distrib(max_delay / 2, max_delay);
+  return std::chrono::milliseconds(distrib(gen));
+}
+
+/* How often membership changes are looked for, e.g. by operations waiting
+ * for results, see CommunicationProtocol::updateMembership()
+ */
+constexpr int MembershipPollMs = 200;
+
 /* Generic matrix distribution protocol */
 template <class DataT> class CommunicationProtocol {
 public:
@@ -13,199 +59,1625 @@ public:
 
   virtual ~CommunicationProtocol(){};
 
-  /* Ask worker_id to perform an operation */
+  /* Ask worker_id to perform an operation. Everything sent after start()
+   * forms a single request, which is sent by submit() or by the next start()
+   */
   virtual void start(unsigned worker_id, Operation op) = 0;
+  /* Offloaded data may be referenced rather than copied, so it must stay
+   * valid until the request is submitted. [rows x columns] matrix is stored
+   * at data in the given order
+   */
   virtual void offload(unsigned worker_id, const DataT *data, unsigned rows,
-                       unsigned columns) = 0;
+                       unsigned columns, StorageOrder order = ROW_MAJOR) = 0;
   void offloadMatrix(unsigned worker_id, const Matrix<DataT> &matrix) {
-    offload(worker_id, matrix.data(), matrix.rows(), matrix.columns());
+    offload(worker_id, matrix.data(), matrix.rows(), matrix.columns(),
+            matrix.order());
+  }
+
+  /* Same as offload() for an operand sent to many workers or with many
+   * requests, e.g. B of a product. share_id identifies its contents, see
+   * newShareId()
+   */
+  virtual void offloadShared(unsigned worker_id, const DataT *data,
+                             unsigned rows, unsigned columns,
+                             StorageOrder order, uint64_t share_id) {
+    offload(worker_id, data, rows, columns, order);
+  }
+  void offloadShared(unsigned worker_id, const Matrix<DataT> &matrix,
+                     uint64_t share_id) {
+    offloadShared(worker_id, matrix.data(), matrix.rows(), matrix.columns(),
+                  matrix.order(), share_id);
   }
 
-  /* Get result of the last offload to worker_id */
+  /* Same as sendRawData() for data sent to many workers, e.g. a public key.
+   * Protocols with a broadcast relay transfer it to all workers once and
+   * only reference it in requests, so data must stay unchanged while
+   * share_id is in use and valid until the request is answered (it is
+   * sent again if the worker has evicted it)
+   */
+  virtual void sendShared(unsigned worker_id, const void *data, size_t size,
+                          uint64_t share_id) {
+    sendRawData(worker_id, data, size);
+  }
+
+  /* Hint that share_id is sent with several requests to the same worker,
+   * e.g. B of out-of-core products, so that it is worth keeping there
+   */
+  virtual void reuseShared(uint64_t share_id) {}
+
+  static uint64_t newShareId() {
+    thread_local std::mt19937_64 gen(std::random_device{}());
+    return gen();
+  }
+
+  /* Send request started by the last start() to worker_id. Several requests
+   * may be submitted before waiting for results, which allows to hide
+   * round-trip latency
+   */
+  virtual void submit(unsigned worker_id) {}
+
+  /* Get result of the oldest submitted request to worker_id. Pending
+   * request is submitted first
+   */
   virtual Matrix<DataT> waitResult(unsigned worker_id) = 0;
 
-  /* Get number of available workers */
+  /* Same as waitResult, but result is written to dst, which must have room
+   * for rows * columns elements. Result size must match the expected one
+   */
+  virtual void waitResultInto(unsigned worker_id, DataT *dst, unsigned rows,
+                              unsigned columns) {
+    auto chunk = waitResult(worker_id);
+    if (chunk.rows() != rows || chunk.columns() != columns)
+      throw std::runtime_error("unexpected result size");
+    chunk.setOrder(ROW_MAJOR);
+    std::copy(chunk.begin(), chunk.end(), dst);
+  }
+
+  /* Wait until the oldest result of one of worker_ids can be taken without
+   * blocking, or the worker has failed. Returns its id, or -1 if timeout_ms
+   * (negative means infinite) has expired
+   */
+  virtual int waitAnyResult(const std::vector<unsigned> &worker_ids,
+                            int timeout_ms = -1) {
+    return worker_ids.empty() ? -1 : worker_ids[0];
+  }
+
+  /* Drop the oldest submitted request to worker_id, its result will never
+   * be returned. Worker is asked to stop processing it if possible
+   */
+  virtual void cancel(unsigned worker_id) { waitResult(worker_id); }
+
+  /* Returns false once connection to worker_id has failed */
+  virtual bool isAlive(unsigned worker_id) const { return true; }
+
+  /* Returns true while worker_id is being drained: it finishes requests
+   * already submitted, but must not get new ones
+   */
+  virtual bool isDraining(unsigned worker_id) const { return false; }
+
+  /* Apply pending membership changes, e.g. from a watched workers file.
+   * Workers may join at any time and their ids are never reused. Returns
+   * true if membership has changed
+   */
+  virtual bool updateMembership() { return false; }
+
+  /* Relative speed of workers for op. Operations split work in proportion
+   * to it, failed and draining workers get nothing
+   */
+  virtual std::vector<double> getWorkerWeights(Operation op) {
+    std::vector<double> weights(getWorkerCount());
+    for (unsigned i = 0; i < weights.size(); ++i)
+      weights[i] = isAlive(i) && !isDraining(i) ? 1 : 0;
+    return weights;
+  }
+
+  /* Get number of workers, including failed ones */
   virtual size_t getWorkerCount() const = 0;
 
   /* Low-level operations */
   virtual void sendRawData(unsigned worker_id, const void *data,
-                           unsigned size) = 0;
+                           size_t size) = 0;
   virtual void receiveRawData(unsigned worker_id, void *data,
-                              unsigned size) = 0;
+                              size_t size) = 0;
 
-  void sendBuf(unsigned worker_id, const void *data, unsigned size) {
-    sendRawData(worker_id, &size, sizeof(size));
+  void sendBuf(unsigned worker_id, const void *data, size_t size) {
+    uint64_t len = size;
+    sendRawData(worker_id, &len, sizeof(len));
     sendRawData(worker_id, data, size);
   }
 
-  std::vector<char> receiveBuf(unsigned worker_id) {
-    unsigned size = 0;
+  Buffer receiveBuf(unsigned worker_id) {
+    uint64_t size = 0;
     receiveRawData(worker_id, &size, sizeof(size));
-    std::vector<char> res(size);
+    Buffer res(size);
     receiveRawData(worker_id, res.data(), size);
     return res;
   }
 };
 
-/* Raw tcp communication protocol */
+/* Transport settings of TcpCommunicationProtocol */
+struct TcpOptions {
+  /* TCP streams per worker, large frames are striped across all of them */
+  unsigned streams = 1;
+  /* SO_SNDBUF/SO_RCVBUF size, 0 for system default */
+  unsigned socket_buffer = 0;
+  /* frames smaller than this are sent over a single stream */
+  size_t stripe_threshold = DefaultStripeThreshold;
+  /* ask workers for their load before every operation, see
+   * getWorkerWeights()
+   */
+  bool query_load = true;
+  /* use at most this many least loaded workers per operation, 0 for all */
+  unsigned select_workers = 0;
+  /* how long to wait for a worker with free capacity before overloading
+   * the least loaded ones
+   */
+  unsigned max_backoff_ms = 5000;
+  /* tree shared data is broadcast along, see relay.h. With RELAY_NONE
+   * every worker gets its own copy. Workers dial each other at the address
+   * the client has connected to, so it must be reachable from all of them
+   * (no NAT or client-only host names)
+   */
+  RelayTree relay = RELAY_NONE;
+  /* shared data smaller than this is sent inline */
+  size_t relay_threshold = DefaultRelayThreshold;
+};
+
+/* Raw tcp communication protocol. Requests are sent as frames tagged with
+ * request id, so worker may complete them in any order
+ */
 template <class DataT>
 class TcpCommunicationProtocol : public CommunicationProtocol<DataT> {
+  struct Response {
+    FrameType type;
+    Buffer payload;
+  };
+
+  struct Connection {
+    /* the first stream carries all frame headers and unstriped payloads */
+    std::vector<tcp::socket> streams;
+    /* "host:port" as given by the user */
+    std::string address;
+    /* "ip:port" the client has connected to, other workers relay
+     * broadcasts to it, see broadcast()
+     */
+    std::string relay_address;
+    bool loopback = false;
+    uint64_t next_request_id = 0;
+    /* request being built since the last start() and broadcast data
+     * inserted into it by the worker
+     */
+    PayloadWriter request;
+    std::vector<SharedRef> shared_refs;
+    std::vector<boost::asio::const_buffer> shared_data;
+    bool building = false;
+    /* submitted requests referencing shared data, kept until answered in
+     * case the worker has evicted the data, see resendMissing()
+     */
+    struct SharedRequest {
+      PayloadWriter payload;
+      std::vector<SharedRef> refs;
+      std::vector<boost::asio::const_buffer> data;
+    };
+    std::map<uint64_t, SharedRequest> shared_requests;
+    /* submitted requests whose results were not taken yet, in order */
+    std::deque<uint64_t> in_flight;
+    /* responses which arrived before the ones submitted earlier */
+    std::map<uint64_t, Response> arrived;
+    /* response being consumed. Either it was buffered or its `unread`
+     * bytes are still in the first stream and are received directly into
+     * the destination buffer
+     */
+    bool has_response = false;
+    Buffer buffered;
+    PayloadReader reader;
+    uint64_t unread = 0;
+    /* cancelled requests, whose responses are dropped on arrival */
+    std::set<uint64_t> discarded;
+    bool failed = false;
+    /* no new requests, closed once results of submitted ones are taken */
+    bool draining = false;
+
+    Connection(boost::asio::io_context &ctx, unsigned stream_count) {
+      for (unsigned i = 0; i < stream_count; ++i)
+        streams.emplace_back(ctx);
+    }
+  };
+
   boost::asio::io_context &io_context;
   tcp::resolver resolver;
+  TcpOptions options;
 
-  std::vector<tcp::socket> sockets;
-  std::vector<std::vector<DataT>> results;
+  std::vector<std::unique_ptr<Connection>> connections;
+  /* How a worker gets shared data, see sendShared() */
+  enum ShareState : uint8_t { SHARE_UNSENT, SHARE_CACHED, SHARE_INLINE };
+  struct Share {
+    /* state on every worker */
+    std::vector<ShareState> states;
+    bool broadcast = false;
+    /* see reuseShared() */
+    bool reused = false;
+  };
+  /* recent shared data in order of first use, see getShare() */
+  std::map<uint64_t, Share> shares;
+  std::deque<uint64_t> share_order;
+  /* see watchWorkersFile() */
+  std::string workers_file;
+  std::filesystem::file_time_type workers_file_time;
+  std::chrono::steady_clock::time_point workers_file_checked;
 
   std::unique_ptr<helib::Context> enc_context;
 
 public:
-  TcpCommunicationProtocol(boost::asio::io_context &ctx)
-      : io_context(ctx), resolver(ctx) {}
+  /* Shared data remembered, older one is broadcast or cached again */
+  static constexpr size_t MaxRelayedShares = 16;
+
+  TcpCommunicationProtocol(boost::asio::io_context &ctx,
+                           const TcpOptions &opts = TcpOptions())
+      : io_context(ctx), resolver(ctx), options(opts) {
+    if (!options.streams || options.streams > StreamHello::MaxStreams)
+      throw std::runtime_error("invalid number of streams per worker");
+  }
+
+  /* Workers may be added at any time, even during an operation. Returns
+   * id of the new worker
+   */
+  unsigned addWorker(const std::string &addr);
+  /* Worker gets no new requests and leaves once results of the submitted
+   * ones are taken
+   */
+  void drainWorker(unsigned worker_id) {
+    connections[worker_id]->draining = true;
+  }
+  /* Close connection at once. Requests in flight fail, operations which
+   * support it re-dispatch them
+   */
+  void removeWorker(unsigned worker_id) { close(*connections[worker_id]); }
+  /* Keep workers in sync with the file of "host:port" lines, '#' starts a
+   * comment. Listed workers not connected yet are added, connected ones
+   * which are not listed are drained. Edits are picked up by
+   * updateMembership() at most every MembershipPollMs
+   */
+  void watchWorkersFile(const std::string &path);
 
-  void addWorker(const std::string &addr);
   void start(unsigned worker_id, Operation op) override;
   void offload(unsigned worker_id, const DataT *data, unsigned rows,
-               unsigned columns) override;
+               unsigned columns, StorageOrder order = ROW_MAJOR) override;
+  void submit(unsigned worker_id) override;
   Matrix<DataT> waitResult(unsigned worker_id) override;
+  void waitResultInto(unsigned worker_id, DataT *dst, unsigned rows,
+                      unsigned columns) override;
+  int waitAnyResult(const std::vector<unsigned> &worker_ids,
+                    int timeout_ms = -1) override;
+  void cancel(unsigned worker_id) override;
+
+  bool isAlive(unsigned worker_id) const override {
+    return !connections[worker_id]->failed;
+  }
+  bool isDraining(unsigned worker_id) const override {
+    return connections[worker_id]->draining;
+  }
+  /* Drained workers without pending results leave, the watched file is
+   * re-read if it has changed
+   */
+  bool updateMembership() override;
+  size_t getWorkerCount() const override { return connections.size(); }
 
-  size_t getWorkerCount() const override { return sockets.size(); }
+  /* Load of every worker, nullopt for failed ones and for workers whose
+   * response is being received
+   */
+  std::vector<std::optional<WorkerLoad>> queryLoad();
+  /* Least loaded workers with free capacity, up to select_workers of them.
+   * If all workers are full, waits with backoff up to max_backoff_ms
+   */
+  std::vector<double> getWorkerWeights(Operation op) override;
+
+  using CommunicationProtocol<DataT>::offloadShared;
+  void offloadShared(unsigned worker_id, const DataT *data, unsigned rows,
+                     unsigned columns, StorageOrder order,
+                     uint64_t share_id) override;
+  /* Data of at least relay_threshold bytes is broadcast to all workers
+   * along the relay tree the first time it is sent, if a tree is selected.
+   * Data reused by requests to the same worker is kept by the worker the
+   * first time it is sent inline. Further requests only reference it
+   */
+  void reuseShared(uint64_t share_id) override;
+  void sendShared(unsigned worker_id, const void *data, size_t size,
+                  uint64_t share_id) override;
 
   void sendRawData(unsigned worker_id, const void *data,
-                   unsigned size) override;
-  void receiveRawData(unsigned worker_id, void *data, unsigned size) override;
+                   size_t size) override;
+  void receiveRawData(unsigned worker_id, void *data, size_t size) override;
+
+private:
+  Share &getShare(uint64_t share_id);
+  std::vector<ShareState> broadcast(const void *data, size_t size,
+                                   uint64_t share_id);
+  bool sendBroadcast(unsigned root, const std::vector<RelayTarget> &layout,
+                     const void *data, size_t size, uint64_t share_id);
+  void nextResponse(unsigned worker_id);
+  void takeResponse(Connection &conn);
+  bool resendMissing(unsigned worker_id);
+  bool receiveFrame(Connection &conn, uint64_t expected_id);
+  bool isReady(const Connection &conn) const;
+
+  /* Run transport operation on worker_id. Any failure marks connection as
+   * failed, so that it is not used anymore
+   */
+  template <class Fn> void guarded(unsigned worker_id, Fn fn) {
+    auto &conn = *connections[worker_id];
+    if (conn.failed)
+      throw std::runtime_error("worker " + std::to_string(worker_id) +
+                               " is unavailable");
+    try {
+      fn(conn);
+    } catch (std::exception &e) {
+      close(conn);
+      throw std::runtime_error("worker " + std::to_string(worker_id) +
+                               " failed: " + e.what());
+    }
+  }
+
+  void close(Connection &conn) {
+    conn.failed = true;
+    for (auto &&stream : conn.streams) {
+      boost::system::error_code ignored;
+      stream.close(ignored);
+    }
+  }
 };
 
-/* Proxy class providing CKKS encryption on the top of another protocol */
+/* Proxy class providing CKKS or BGV encryption, depending on the scheme of
+ * the key set, on the top of another protocol
+ */
 class EncryptionProtocol : public CommunicationProtocol<double> {
   CommunicationProtocol *protocol;
-  EncContextOptions context_options;
-  helib::Context context;
-  helib::SecKey sk;
+  std::shared_ptr<KeySet> keys;
+  /* serialized public key, sent with every request */
+  std::string public_key;
+  uint64_t public_key_share = newShareId();
+  /* ciphertexts of the operand shared during the current operation */
+  std::string shared_ctxts;
+  uint64_t shared_ctxts_id = 0;
+  /* merged from results of all workers, see getNoiseBudget() */
+  NoiseBudget noise_budget;
 
 public:
+  /* Generate fresh keys */
   EncryptionProtocol(CommunicationProtocol<double> *p,
                      const EncContextOptions &opts)
-      : protocol(p), context_options(opts), context(opts.buildContext()),
-        sk(context) {
-    sk.GenSecKey();
-    helib::addSome1DMatrices(sk);
+      : EncryptionProtocol(p, KeySet::generate(opts)) {}
+  /* Use existing keys, e.g. loaded from KeyStore */
+  EncryptionProtocol(CommunicationProtocol<double> *p,
+                     std::shared_ptr<KeySet> keys)
+      : protocol(p), keys(std::move(keys)),
+        public_key(stringify(getPublicKey())) {
+    protocol->reuseShared(public_key_share);
   }
 
-  const helib::PubKey &getPublicKey() { return sk; }
-  const helib::SecKey &getSecretKey() { return sk; }
+  const helib::PubKey &getPublicKey() { return *keys->sk; }
+  const helib::SecKey &getSecretKey() { return *keys->sk; }
+
+  /* Capacity consumed by workers and left in results taken so far */
+  const NoiseBudget &getNoiseBudget() const { return noise_budget; }
+  void resetNoiseBudget() { noise_budget = NoiseBudget(); }
 
   void start(unsigned worker_id, Operation op) override {
     if (op == OP_ADD)
       op = OP_HADD;
     else if (op == OP_MUL)
       op = OP_HMUL;
-    else
+    else if (op != OP_PMUL)
       throw std::runtime_error("unsupported operation for this protocol");
     protocol->start(worker_id, op);
-    auto key = stringify(getPublicKey());
-    auto worker_count = protocol->getWorkerCount();
-    protocol->sendRawData(worker_id, &context_options, sizeof(context_options));
-    protocol->sendBuf(worker_id, key.data(), key.size());
+    protocol->sendRawData(worker_id, &keys->options, sizeof(keys->options));
+    protocol->sendRawData(worker_id, &keys->key_id, sizeof(keys->key_id));
+    uint64_t key_size = public_key.size();
+    protocol->sendRawData(worker_id, &key_size, sizeof(key_size));
+    protocol->sendShared(worker_id, public_key.data(), public_key.size(),
+                         public_key_share);
   }
 
+  /* Every contiguous row (or column, for column-major data) is encrypted
+   * into a separate ciphertext
+   */
   void offload(unsigned worker_id, const double *data, unsigned rows,
-               unsigned columns) override {
-    MatrixHeader hdr{rows, columns};
+               unsigned columns, StorageOrder order = ROW_MAJOR) override {
+    MatrixHeader hdr{rows, columns, order};
     protocol->sendRawData(worker_id, &hdr, sizeof(hdr));
-    for (unsigned i = 0; i < rows; ++i) {
-      const double *ptr = data + columns * i;
-      std::vector<double> m(ptr, ptr + columns);
-      auto enc = encrypt(m, getPublicKey());
+    for (unsigned i = 0; i < hdr.lines(); ++i) {
+      const double *ptr = data + size_t(hdr.lineSize()) * i;
+      std::vector<double> m(ptr, ptr + hdr.lineSize());
       auto c = stringify(encrypt(m, getPublicKey()));
       protocol->sendBuf(worker_id, c.data(), c.size());
     }
   }
 
+  /* Shared operand is encrypted once, all workers get the same
+   * ciphertexts
+   */
+  using CommunicationProtocol<double>::offloadShared;
+  void offloadShared(unsigned worker_id, const double *data, unsigned rows,
+                     unsigned columns, StorageOrder order,
+                     uint64_t share_id) override {
+    MatrixHeader hdr(rows, columns, order);
+    if (share_id != shared_ctxts_id) {
+      shared_ctxts.clear();
+      for (unsigned i = 0; i < hdr.lines(); ++i) {
+        const double *ptr = data + size_t(hdr.lineSize()) * i;
+        std::vector<double> m(ptr, ptr + hdr.lineSize());
+        auto c = stringify(encrypt(m, getPublicKey()));
+        uint64_t len = c.size();
+        shared_ctxts.append(reinterpret_cast<const char *>(&len), sizeof len);
+        shared_ctxts.append(c);
+      }
+      shared_ctxts_id = share_id;
+    }
+    protocol->sendRawData(worker_id, &hdr, sizeof(hdr));
+    protocol->sendShared(worker_id, shared_ctxts.data(), shared_ctxts.size(),
+                         share_id);
+  }
+
+  /* Send matrix without encryption, e.g. public weights for OP_PMUL */
+  void offloadPlain(unsigned worker_id, const Matrix<double> &matrix,
+                    uint64_t share_id) {
+    protocol->offloadShared(worker_id, matrix, share_id);
+  }
+
+  void submit(unsigned worker_id) override { protocol->submit(worker_id); }
+  int waitAnyResult(const std::vector<unsigned> &worker_ids,
+                    int timeout_ms = -1) override {
+    return protocol->waitAnyResult(worker_ids, timeout_ms);
+  }
+  void cancel(unsigned worker_id) override { protocol->cancel(worker_id); }
+  bool isAlive(unsigned worker_id) const override {
+    return protocol->isAlive(worker_id);
+  }
+  bool isDraining(unsigned worker_id) const override {
+    return protocol->isDraining(worker_id);
+  }
+  bool updateMembership() override { return protocol->updateMembership(); }
+  std::vector<double> getWorkerWeights(Operation op) override {
+    return protocol->getWorkerWeights(op);
+  }
+
   Matrix<double> waitResult(unsigned worker_id) override {
     MatrixHeader hdr;
     protocol->receiveRawData(worker_id, &hdr, sizeof(hdr));
-    std::vector<double> result;
+    Matrix<double> result(hdr.rows(), hdr.columns());
     for (unsigned i = 0; i < hdr.rows(); ++i) {
-      auto enc_row = readCtxt(getPublicKey(), protocol->receiveBuf(worker_id));
+      auto enc_row =
+          readCtxt(getPublicKey(), protocol->receiveBuf(worker_id).view());
       auto row = decrypt(enc_row, getSecretKey());
-      assert(row.size() == hdr.columns());
-      result.insert(result.end(), row.begin(), row.end());
+      /* result may occupy only a part of the slots */
+      assert(row.size() >= hdr.columns());
+      std::copy_n(row.begin(), hdr.columns(), result.beginRow(i));
     }
-    return Matrix<double>(std::move(result), hdr.columns());
+    NoiseBudget budget;
+    protocol->receiveRawData(worker_id, &budget, sizeof(budget));
+    noise_budget.merge(budget);
+    return result;
   }
 
   size_t getWorkerCount() const override { return protocol->getWorkerCount(); }
 
   void sendRawData(unsigned worker_id, const void *data,
-                   unsigned size) override {
+                   size_t size) override {
     protocol->sendRawData(worker_id, data, size);
   }
-  void receiveRawData(unsigned worker_id, void *data, unsigned size) override {
-    protocol->sendRawData(worker_id, data, size);
+  void sendShared(unsigned worker_id, const void *data, size_t size,
+                  uint64_t share_id) override {
+    protocol->sendShared(worker_id, data, size, share_id);
+  }
+  void reuseShared(uint64_t share_id) override {
+    protocol->reuseShared(share_id);
+  }
+  void receiveRawData(unsigned worker_id, void *data, size_t size) override {
+    protocol->receiveRawData(worker_id, data, size);
   }
 };
 
-/* Parse "host:port" string */
-inline std::pair<std::string, std::string> parseWorkerAddr(std::string Addr) {
-  auto idx = Addr.find_last_of(':');
-  if (idx == std::string::npos)
-    throw std::runtime_error("Port not specified in URL '" + Addr + "'");
-  std::string Host(Addr, 0, idx);
-  std::string Port(Addr, idx + 1);
-  if (Port.empty())
-    throw std::runtime_error("Invalid port in URL '" + Addr + "'");
-  if (Host.empty())
-    Host = "localhost";
-  return std::make_pair(Host, Port);
-}
+/* Runs requests in this process on a thread pool with the same kernels as
+ * workers. Has the only worker 0, and serves as the local slot of
+ * HybridProtocol. Operands are copied on offload
+ */
+template <class DataT>
+class LocalProtocol : public CommunicationProtocol<DataT> {
+  struct Job {
+    Operation op;
+    /* data passed to sendRawData() */
+    std::string raw;
+    std::vector<Matrix<DataT>> operands;
+    Matrix<DataT> result;
+    std::vector<std::future<void>> tasks;
+    std::exception_ptr error;
+  };
+
+  ThreadPool pool;
+  /* request being built since the last start() */
+  std::shared_ptr<Job> building;
+  /* submitted requests whose results were not taken yet, in order */
+  std::deque<std::shared_ptr<Job>> in_flight;
+
+public:
+  /* 0 threads means hardware concurrency */
+  explicit LocalProtocol(unsigned threads = 0) : pool(threads) {}
+
+  void start(unsigned worker_id, Operation op) override {
+    assert(worker_id == 0 && "invalid worker");
+    submit(worker_id);
+    building = std::make_shared<Job>();
+    building->op = op;
+  }
+
+  void offload(unsigned worker_id, const DataT *data, unsigned rows,
+               unsigned columns, StorageOrder order = ROW_MAJOR) override {
+    if (!building)
+      throw std::runtime_error("no request started");
+    auto &matrix = building->operands.emplace_back(rows, columns, order);
+    std::copy_n(data, matrix.size(), matrix.data());
+  }
+
+  void submit(unsigned worker_id) override {
+    if (!building)
+      return;
+    try {
+      schedule(building);
+    } catch (std::exception &) {
+      building->error = std::current_exception();
+    }
+    in_flight.push_back(std::move(building));
+  }
+
+  Matrix<DataT> waitResult(unsigned worker_id) override {
+    submit(worker_id);
+    if (in_flight.empty())
+      throw std::runtime_error("no request in flight");
+    auto job = std::move(in_flight.front());
+    in_flight.pop_front();
+    for (auto &&task : job->tasks)
+      task.get();
+    if (job->error)
+      std::rethrow_exception(job->error);
+    return std::move(job->result);
+  }
+
+  int waitAnyResult(const std::vector<unsigned> &worker_ids,
+                    int timeout_ms = -1) override {
+    if (worker_ids.empty())
+      return -1;
+    submit(0);
+    if (in_flight.empty())
+      return 0;
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(timeout_ms);
+    for (auto &&task : in_flight.front()->tasks) {
+      if (timeout_ms < 0)
+        task.wait();
+      else if (task.wait_until(deadline) != std::future_status::ready)
+        return -1;
+    }
+    return 0;
+  }
+
+  /* Tasks of the cancelled request still run, but keep their data alive */
+  void cancel(unsigned worker_id) override {
+    building.reset();
+    if (!in_flight.empty())
+      in_flight.pop_front();
+  }
+
+  size_t getWorkerCount() const override { return 1; }
+
+  void sendRawData(unsigned worker_id, const void *data,
+                   size_t size) override {
+    if (!building)
+      throw std::runtime_error("no request started");
+    building->raw.append(static_cast<const char *>(data), size);
+  }
+  void receiveRawData(unsigned worker_id, void *data, size_t size) override {
+    throw std::runtime_error("raw results are not supported locally");
+  }
+
+private:
+  /* Split rows [0; rows) among pool threads */
+  template <class Fn>
+  void parallelRows(Job &job, size_t rows, Fn fn) {
+    WorkSplitterLinear splitter(rows, std::min<size_t>(pool.size(),
+                                                       std::max<size_t>(rows, 1)));
+    for (size_t i = 0; i < std::min<size_t>(pool.size(), rows); ++i) {
+      auto range = splitter.getRange(i);
+      job.tasks.push_back(
+          pool.submit([fn, range] { fn(range.FirstIdx, range.LastIdx); }));
+    }
+  }
+
+  /* Same checks and kernels as in worker handlers */
+  void schedule(const std::shared_ptr<Job> &job) {
+    auto &operands = job->operands;
+    if (job->op == OP_ECHO) {
+      if (operands.size() != 1)
+        throw std::runtime_error("invalid request");
+      job->result = std::move(operands[0]);
+    } else if (job->op == OP_ADD) {
+      if (operands.size() != 2)
+        throw std::runtime_error("invalid request");
+      auto &A = operands[0], &B = operands[1];
+      if (A.rows() != B.rows() || A.columns() != B.columns())
+        throw std::runtime_error("mismatching matrix sizes");
+      job->tasks.push_back(pool.submit([job] {
+        auto &A = job->operands[0];
+        A.setOrder(ROW_MAJOR);
+        A += job->operands[1];
+        job->result = std::move(A);
+      }));
+    } else if (job->op == OP_MUL) {
+      if (operands.size() != 2)
+        throw std::runtime_error("invalid request");
+      auto &A = operands[0], &B = operands[1];
+      if (A.columns() != B.rows())
+        throw std::runtime_error("mismatching matrix sizes");
+      A.setOrder(ROW_MAJOR);
+      job->result = Matrix<DataT>(A.rows(), B.columns());
+      parallelRows(*job, A.rows(), [job](size_t first, size_t last) {
+        gemmRows(job->operands[0], job->operands[1], job->result, first,
+                 last);
+      });
+    } else if (job->op == OP_BATCHED_MUL) {
+      BatchShape shape;
+      if (operands.size() != 2 || job->raw.size() != sizeof(shape))
+        throw std::runtime_error("invalid request");
+      std::memcpy(&shape, job->raw.data(), sizeof(shape));
+      auto &As = operands[0], &Bs = operands[1];
+      if (As.rows() != Bs.rows() ||
+          As.columns() != size_t(shape.m) * shape.k ||
+          Bs.columns() != size_t(shape.k) * shape.n)
+        throw std::runtime_error("mismatching batch sizes");
+      As.setOrder(ROW_MAJOR);
+      Bs.setOrder(ROW_MAJOR);
+      job->result = Matrix<DataT>(As.rows(), size_t(shape.m) * shape.n);
+      parallelRows(*job, As.rows(), [job, shape](size_t first, size_t last) {
+        batchedGemm(job->operands[0].beginRow(first),
+                    job->operands[1].beginRow(first),
+                    job->result.beginRow(first), last - first, shape.m,
+                    shape.k, shape.n, 1);
+      });
+    } else if (job->op == OP_ELEMENTWISE) {
+      ElementwiseChain chain;
+      if (job->raw.size() != sizeof(chain))
+        throw std::runtime_error("invalid request");
+      std::memcpy(&chain, job->raw.data(), sizeof(chain));
+      chain.validate();
+      if (operands.size() != chain.operandCount())
+        throw std::runtime_error("invalid request");
+      for (auto &&M : operands) {
+        if (M.rows() != operands[0].rows() ||
+            M.columns() != operands[0].columns())
+          throw std::runtime_error("mismatching matrix sizes");
+        M.setOrder(ROW_MAJOR);
+      }
+      size_t rows = operands[0].rows(), columns = operands[0].columns();
+      auto shape = reducedShape(chain.Reduce, rows, columns);
+      job->result = Matrix<DataT>(shape.first, shape.second);
+      /* partial reductions are not split to avoid combining them */
+      bool row_wise = chain.Reduce == RED_NONE || isRowReduction(chain.Reduce);
+      auto run = [job, chain, columns, row_wise](size_t first, size_t last) {
+        std::vector<const DataT *> data;
+        for (auto &&M : job->operands)
+          data.push_back(M.data() + first * columns);
+        DataT *dst = job->result.data() +
+                     (row_wise ? first * job->result.columns() : 0);
+        runElementwise(chain, data.data(), last - first, columns, dst, 1);
+      };
+      if (row_wise)
+        parallelRows(*job, rows, run);
+      else
+        job->tasks.push_back(pool.submit([run, rows] { run(0, rows); }));
+    } else {
+      throw std::runtime_error("unsupported operation");
+    }
+  }
+};
+
+/* Remote workers plus this process as worker 0, the local slot. Remote
+ * worker i of the underlying protocol is worker i + 1. Throughput of every
+ * worker is measured per operation, from start() to the result, so that
+ * local share grows while transfers to remote workers dominate
+ */
+template <class DataT>
+class HybridProtocol : public CommunicationProtocol<DataT> {
+  using Clock = std::chrono::steady_clock;
+
+  struct Pending {
+    Operation op;
+    Clock::time_point start;
+    /* rows of the first operand, the result may be smaller (reductions) */
+    size_t rows = 0;
+  };
+
+  CommunicationProtocol<DataT> &remote;
+  LocalProtocol<DataT> local;
+  /* fixed fraction of work done locally, measured if 0 */
+  double local_share = 0;
+  /* requests of every worker whose results were not taken, in order */
+  std::vector<std::deque<Pending>> pending;
+  /* moving average of rows per second of every worker, 0 if unknown */
+  std::map<Operation, std::vector<double>> rates;
+  std::vector<size_t> rows_done;
+
+public:
+  /* Weight of the latest measurement in the moving average */
+  static constexpr double RateSmoothing = 0.5;
+
+  HybridProtocol(CommunicationProtocol<DataT> &remote,
+                 unsigned local_threads = 0)
+      : remote(remote), local(local_threads) {}
+
+  /* Give fraction of every operation to the local slot instead of measured
+   * share. 0 restores measuring
+   */
+  void setLocalShare(double share) {
+    assert(share >= 0 && share <= 1 && "invalid share");
+    local_share = share;
+  }
+
+  /* Rows computed by every worker so far */
+  std::vector<size_t> getRowsDone() const {
+    auto res = rows_done;
+    res.resize(getWorkerCount());
+    return res;
+  }
+
+  void start(unsigned worker_id, Operation op) override {
+    slot(pending, worker_id).push_back(Pending{op, Clock::now(), 0});
+    if (worker_id == 0)
+      local.start(0, op);
+    else
+      remote.start(worker_id - 1, op);
+  }
+  void offload(unsigned worker_id, const DataT *data, unsigned rows,
+               unsigned columns, StorageOrder order = ROW_MAJOR) override {
+    auto &requests = slot(pending, worker_id);
+    if (!requests.empty() && !requests.back().rows)
+      requests.back().rows = rows;
+    if (worker_id == 0)
+      local.offload(0, data, rows, columns, order);
+    else
+      remote.offload(worker_id - 1, data, rows, columns, order);
+  }
+  using CommunicationProtocol<DataT>::offloadShared;
+  void offloadShared(unsigned worker_id, const DataT *data, unsigned rows,
+                     unsigned columns, StorageOrder order,
+                     uint64_t share_id) override {
+    if (worker_id == 0)
+      local.offload(0, data, rows, columns, order);
+    else
+      remote.offloadShared(worker_id - 1, data, rows, columns, order,
+                           share_id);
+  }
+  void submit(unsigned worker_id) override {
+    if (worker_id == 0)
+      local.submit(0);
+    else
+      remote.submit(worker_id - 1);
+  }
+
+  Matrix<DataT> waitResult(unsigned worker_id) override {
+    auto request = takePending(worker_id);
+    auto res = worker_id == 0 ? local.waitResult(0)
+                              : remote.waitResult(worker_id - 1);
+    measure(worker_id, request, res.rows());
+    return res;
+  }
+
+  void waitResultInto(unsigned worker_id, DataT *dst, unsigned rows,
+                      unsigned columns) override {
+    auto request = takePending(worker_id);
+    if (worker_id == 0)
+      local.waitResultInto(0, dst, rows, columns);
+    else
+      remote.waitResultInto(worker_id - 1, dst, rows, columns);
+    measure(worker_id, request, rows);
+  }
+
+  /* Local slot is polled while waiting for remote workers */
+  int waitAnyResult(const std::vector<unsigned> &worker_ids,
+                    int timeout_ms = -1) override {
+    constexpr int LocalPollMs = 1;
+    bool has_local = false;
+    std::vector<unsigned> remote_ids;
+    for (auto id : worker_ids) {
+      if (id == 0)
+        has_local = true;
+      else
+        remote_ids.push_back(id - 1);
+    }
+    if (!has_local) {
+      auto res = remote.waitAnyResult(remote_ids, timeout_ms);
+      return res < 0 ? res : res + 1;
+    }
+    if (remote_ids.empty())
+      return local.waitAnyResult({0}, timeout_ms);
 
+    auto deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (true) {
+      if (local.waitAnyResult({0}, 0) == 0)
+        return 0;
+      int wait_ms = LocalPollMs;
+      if (timeout_ms >= 0)
+        wait_ms = std::min<int>(
+            wait_ms, std::chrono::duration_cast<std::chrono::milliseconds>(
+                         deadline - Clock::now())
+                         .count());
+      auto res = remote.waitAnyResult(remote_ids, std::max(wait_ms, 0));
+      if (res >= 0)
+        return res + 1;
+      if (timeout_ms >= 0 && Clock::now() >= deadline)
+        return -1;
+    }
+  }
+
+  void cancel(unsigned worker_id) override {
+    auto &requests = slot(pending, worker_id);
+    if (!requests.empty())
+      requests.pop_front();
+    if (worker_id == 0)
+      local.cancel(0);
+    else
+      remote.cancel(worker_id - 1);
+  }
+
+  bool isAlive(unsigned worker_id) const override {
+    return worker_id == 0 || remote.isAlive(worker_id - 1);
+  }
+  bool isDraining(unsigned worker_id) const override {
+    return worker_id > 0 && remote.isDraining(worker_id - 1);
+  }
+  bool updateMembership() override { return remote.updateMembership(); }
+  size_t getWorkerCount() const override {
+    return remote.getWorkerCount() + 1;
+  }
+
+  /* Measured rates. Workers not measured yet are assumed to be as fast as
+   * the average measured one. Remote workers not chosen by the underlying
+   * protocol, e.g. overloaded ones, get nothing
+   */
+  std::vector<double> getWorkerWeights(Operation op) override {
+    auto remote_weights = remote.getWorkerWeights(op);
+    std::vector<double> weights(getWorkerCount(), 0);
+    auto it = rates.find(op);
+    double sum = 0;
+    unsigned measured = 0;
+    if (it != rates.end())
+      for (auto rate : it->second)
+        if (rate > 0) {
+          sum += rate;
+          ++measured;
+        }
+    double prior = measured ? sum / measured : 1;
+    for (unsigned i = 0; i < weights.size(); ++i) {
+      if (!isAlive(i) || (i > 0 && remote_weights[i - 1] == 0))
+        continue;
+      bool known = it != rates.end() && i < it->second.size() &&
+                   it->second[i] > 0;
+      weights[i] = known ? it->second[i] : prior;
+    }
+    if (local_share > 0) {
+      double remote_sum = 0;
+      for (unsigned i = 1; i < weights.size(); ++i)
+        remote_sum += weights[i];
+      if (local_share >= 1 || remote_sum == 0) {
+        std::fill(weights.begin(), weights.end(), 0);
+        weights[0] = 1;
+      } else {
+        weights[0] = remote_sum * local_share / (1 - local_share);
+      }
+    }
+    return weights;
+  }
+
+  void sendRawData(unsigned worker_id, const void *data,
+                   size_t size) override {
+    if (worker_id == 0)
+      local.sendRawData(0, data, size);
+    else
+      remote.sendRawData(worker_id - 1, data, size);
+  }
+  void sendShared(unsigned worker_id, const void *data, size_t size,
+                  uint64_t share_id) override {
+    if (worker_id == 0)
+      local.sendRawData(0, data, size);
+    else
+      remote.sendShared(worker_id - 1, data, size, share_id);
+  }
+  void reuseShared(uint64_t share_id) override {
+    remote.reuseShared(share_id);
+  }
+  void receiveRawData(unsigned worker_id, void *data, size_t size) override {
+    if (worker_id == 0)
+      local.receiveRawData(0, data, size);
+    else
+      remote.receiveRawData(worker_id - 1, data, size);
+  }
+
+private:
+  /* Per-worker element, remote workers may be added at any time */
+  template <class T> T &slot(std::vector<T> &values, unsigned worker_id) {
+    if (values.size() <= worker_id)
+      values.resize(worker_id + 1);
+    return values[worker_id];
+  }
+
+  std::optional<Pending> takePending(unsigned worker_id) {
+    auto &requests = slot(pending, worker_id);
+    if (requests.empty())
+      return std::nullopt;
+    auto request = requests.front();
+    requests.pop_front();
+    return request;
+  }
+
+  void measure(unsigned worker_id, std::optional<Pending> request,
+               size_t rows) {
+    if (request && request->rows)
+      rows = request->rows;
+    slot(rows_done, worker_id) += rows;
+    if (!request || !rows)
+      return;
+    double seconds =
+        std::chrono::duration<double>(Clock::now() - request->start).count();
+    double rate = rows / std::max(seconds, 1e-9);
+    auto &old_rate = slot(rates[request->op], worker_id);
+    old_rate = old_rate > 0
+                   ? RateSmoothing * rate + (1 - RateSmoothing) * old_rate
+                   : rate;
+  }
+};
+
+/* Worker which is not reachable is not fatal: it is added as failed one,
+ * so that operations may decide whether they can proceed without it
+ */
 template <class DataT>
-void TcpCommunicationProtocol<DataT>::addWorker(const std::string &addr) {
+unsigned TcpCommunicationProtocol<DataT>::addWorker(const std::string &addr) {
   auto [host, port] = parseWorkerAddr(addr);
+  auto &conn = connections.emplace_back(
+      std::make_unique<Connection>(io_context, options.streams));
+  conn->address = addr;
   try {
-    auto &socket = sockets.emplace_back(io_context);
-    results.emplace_back();
-    boost::asio::connect(socket, resolver.resolve(host, port));
+    auto endpoints = resolver.resolve(host, port);
+    StreamHello hello{std::random_device()(), 0, options.streams,
+                      options.socket_buffer, 0};
+    hello.session_id = hello.session_id << 32 | std::random_device()();
+    for (auto &&stream : conn->streams) {
+      boost::asio::connect(stream, endpoints);
+      tuneSocket(stream, options.socket_buffer);
+      PayloadWriter payload;
+      payload.write(hello);
+      FrameHeader hdr(FRAME_HELLO, 0, payload.size());
+      boost::asio::write(stream, stripeFrame(hdr, payload, 1)[0]);
+      ++hello.stream_index;
+    }
+    auto endpoint = conn->streams[0].remote_endpoint();
+    conn->relay_address =
+        endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+    conn->loopback = endpoint.address().is_loopback();
   } catch (std::exception &e) {
-    std::cout << "Error: '" << addr << "': " << e.what() << '\n';
-    exit(1);
+    std::cerr << "Error: '" << addr << "': " << e.what() << '\n';
+    conn->failed = true;
   }
+  return connections.size() - 1;
+}
+
+template <class DataT>
+void TcpCommunicationProtocol<DataT>::watchWorkersFile(
+    const std::string &path) {
+  workers_file = path;
+  workers_file_time = {};
+  workers_file_checked = {};
+  updateMembership();
+}
+
+template <class DataT>
+bool TcpCommunicationProtocol<DataT>::updateMembership() {
+  bool changed = false;
+  for (auto &&conn : connections)
+    if (conn->draining && !conn->failed && !conn->building &&
+        !conn->has_response && conn->in_flight.empty()) {
+      close(*conn);
+      std::cerr << "Worker '" << conn->address << "' drained\n";
+      changed = true;
+    }
+
+  auto now = std::chrono::steady_clock::now();
+  if (workers_file.empty() ||
+      now - workers_file_checked < std::chrono::milliseconds(MembershipPollMs))
+    return changed;
+  workers_file_checked = now;
+  std::error_code error;
+  auto time = std::filesystem::last_write_time(workers_file, error);
+  if (error || time == workers_file_time)
+    return changed;
+  workers_file_time = time;
+
+  std::ifstream in(workers_file);
+  std::set<std::string> listed;
+  for (std::string line; std::getline(in, line);) {
+    line = line.substr(0, line.find('#'));
+    auto first = line.find_first_not_of(" \t\r");
+    if (first != std::string::npos)
+      listed.insert(
+          line.substr(first, line.find_last_not_of(" \t\r") - first + 1));
+  }
+  std::set<std::string> connected;
+  for (auto &&conn : connections) {
+    if (conn->failed)
+      continue;
+    bool keep = listed.count(conn->address);
+    if (keep)
+      connected.insert(conn->address);
+    if (conn->draining == keep) {
+      conn->draining = !keep;
+      changed = true;
+    }
+  }
+  for (auto &&addr : listed)
+    if (!connected.count(addr)) {
+      addWorker(addr);
+      changed = true;
+    }
+  return changed;
 }
 
 template <class DataT>
 void TcpCommunicationProtocol<DataT>::start(unsigned worker_id, Operation op) {
-  send(op, sockets[worker_id]);
+  auto &conn = *connections[worker_id];
+  if (conn.building)
+    submit(worker_id);
+  conn.request.write(op);
+  conn.building = true;
 }
 
 template <class DataT>
 void TcpCommunicationProtocol<DataT>::offload(unsigned worker_id,
                                               const DataT *data, unsigned rows,
-                                              unsigned columns) {
-  MatrixHeader hdr(rows, columns);
-  hdr.send(sockets[worker_id]);
-  send_buf(data, rows * columns * sizeof(DataT), sockets[worker_id]);
+                                              unsigned columns,
+                                              StorageOrder order) {
+  MatrixHeader hdr(rows, columns, order);
+  sendRawData(worker_id, &hdr, sizeof(hdr));
+  connections[worker_id]->request.writeRef(data, hdr.size() * sizeof(DataT));
+}
+
+template <class DataT>
+void TcpCommunicationProtocol<DataT>::submit(unsigned worker_id) {
+  auto &conn = *connections[worker_id];
+  if (!conn.building)
+    return;
+  conn.building = false;
+  guarded(worker_id, [this](Connection &conn) {
+    auto id = conn.next_request_id++;
+    conn.in_flight.push_back(id);
+    if (!conn.shared_refs.empty()) {
+      PayloadWriter refs;
+      refs.writeRef(conn.shared_refs.data(),
+                    conn.shared_refs.size() * sizeof(SharedRef));
+      sendFrame(FrameHeader(FRAME_SHARED_REFS, id), refs, conn.streams,
+                std::numeric_limits<size_t>::max());
+    }
+    sendFrame(FrameHeader(FRAME_REQUEST, id), conn.request, conn.streams,
+              options.stripe_threshold);
+    if (!conn.shared_refs.empty())
+      conn.shared_requests[id] = {std::move(conn.request),
+                                  std::move(conn.shared_refs),
+                                  std::move(conn.shared_data)};
+  });
+  conn.request.clear();
+  conn.shared_refs.clear();
+  conn.shared_data.clear();
 }
 
 template <class DataT>
 Matrix<DataT> TcpCommunicationProtocol<DataT>::waitResult(unsigned worker_id) {
-  auto hdr = MatrixHeader::receive(sockets[worker_id]);
-  auto data =
-      receive_buf<DataT>(hdr.rows() * hdr.columns(), sockets[worker_id]);
-  return Matrix<DataT>(std::move(data), hdr.columns());
+  MatrixHeader hdr;
+  receiveRawData(worker_id, &hdr, sizeof(hdr));
+  Matrix<DataT> result(hdr.rows(), hdr.columns(), hdr.order);
+  receiveRawData(worker_id, result.data(), hdr.size() * sizeof(DataT));
+  return result;
+}
+
+template <class DataT>
+void TcpCommunicationProtocol<DataT>::waitResultInto(unsigned worker_id,
+                                                     DataT *dst, unsigned rows,
+                                                     unsigned columns) {
+  MatrixHeader hdr;
+  receiveRawData(worker_id, &hdr, sizeof(hdr));
+  if (hdr.rows() != rows || hdr.columns() != columns ||
+      hdr.order != ROW_MAJOR)
+    throw std::runtime_error("unexpected result size");
+  receiveRawData(worker_id, dst, hdr.size() * sizeof(DataT));
+}
+
+template <class DataT>
+int TcpCommunicationProtocol<DataT>::waitAnyResult(
+    const std::vector<unsigned> &worker_ids, int timeout_ms) {
+  /* frames which complete no response must not restart the timeout */
+  using Clock = std::chrono::steady_clock;
+  auto deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+  while (true) {
+    std::vector<pollfd> fds;
+    for (auto id : worker_ids) {
+      auto &conn = *connections[id];
+      if (!conn.failed && conn.building)
+        submit(id);
+      if (!conn.failed)
+        resendMissing(id);
+      if (isReady(conn))
+        return id;
+      fds.push_back(pollfd{conn.streams[0].native_handle(), POLLIN, 0});
+    }
+    int wait_ms = timeout_ms;
+    if (timeout_ms >= 0)
+      wait_ms = std::max<int>(
+          0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                 deadline - Clock::now())
+                 .count());
+    int res = ::poll(fds.data(), fds.size(), wait_ms);
+    if (res == 0)
+      return -1;
+    if (res < 0 && errno != EINTR)
+      throw std::runtime_error(std::string("poll: ") + strerror(errno));
+    for (size_t i = 0; i < fds.size(); ++i) {
+      if (!fds[i].revents)
+        continue;
+      /* failure is reported when result is taken */
+      bool taken = false;
+      try {
+        guarded(worker_ids[i], [this, &taken](Connection &conn) {
+          if (!conn.in_flight.empty() &&
+              receiveFrame(conn, conn.in_flight.front())) {
+            takeResponse(conn);
+            taken = true;
+          }
+        });
+      } catch (std::exception &) {
+      }
+      /* an empty response is not left as current one, see takeResponse() */
+      if (taken)
+        return worker_ids[i];
+    }
+  }
+}
+
+template <class DataT>
+void TcpCommunicationProtocol<DataT>::cancel(unsigned worker_id) {
+  auto &conn = *connections[worker_id];
+  conn.building = false;
+  /* data the worker was to keep has never been sent */
+  for (auto &&ref : conn.shared_refs) {
+    auto share = shares.find(ref.share_id);
+    if (ref.size && share != shares.end())
+      share->second.states[worker_id] = SHARE_UNSENT;
+  }
+  conn.request.clear();
+  conn.shared_refs.clear();
+  conn.shared_data.clear();
+  if (conn.in_flight.empty())
+    return;
+  auto id = conn.in_flight.front();
+  conn.in_flight.pop_front();
+  conn.shared_requests.erase(id);
+  if (!conn.arrived.erase(id))
+    conn.discarded.insert(id);
+  if (conn.failed)
+    return;
+  guarded(worker_id, [id](Connection &conn) {
+    FrameHeader hdr(FRAME_CANCEL, id);
+    boost::asio::write(conn.streams[0], boost::asio::buffer(&hdr, sizeof hdr));
+  });
+}
+
+template <class DataT>
+std::vector<std::optional<WorkerLoad>>
+TcpCommunicationProtocol<DataT>::queryLoad() {
+  std::vector<std::optional<WorkerLoad>> loads(connections.size());
+  /* all queries are sent first, so that round trips overlap */
+  std::vector<std::pair<unsigned, uint64_t>> queries;
+  for (unsigned i = 0; i < connections.size(); ++i) {
+    auto &conn = *connections[i];
+    if (conn.failed || conn.unread)
+      continue;
+    try {
+      guarded(i, [&](Connection &conn) {
+        FrameHeader hdr(FRAME_LOAD_QUERY, conn.next_request_id++);
+        boost::asio::write(conn.streams[0],
+                           boost::asio::buffer(&hdr, sizeof hdr));
+        queries.emplace_back(i, hdr.request_id);
+      });
+    } catch (std::exception &) {
+    }
+  }
+  for (auto [worker_id, id] : queries) {
+    try {
+      guarded(worker_id, [&, id = id](Connection &conn) {
+        while (!conn.arrived.count(id))
+          receiveFrame(conn, id);
+        auto response = std::move(conn.arrived[id]);
+        conn.arrived.erase(id);
+        if (response.type != FRAME_LOAD ||
+            response.payload.size() != sizeof(WorkerLoad))
+          throw std::runtime_error("invalid load report");
+        WorkerLoad load;
+        std::memcpy(&load, response.payload.data(), sizeof load);
+        loads[worker_id] = load;
+      });
+    } catch (std::exception &) {
+    }
+  }
+  return loads;
+}
+
+template <class DataT>
+std::vector<double>
+TcpCommunicationProtocol<DataT>::getWorkerWeights(Operation op) {
+  auto weights = CommunicationProtocol<DataT>::getWorkerWeights(op);
+  if (!options.query_load)
+    return weights;
+
+  std::vector<std::optional<WorkerLoad>> loads;
+  std::vector<unsigned> candidates;
+  for (unsigned attempt = 0, waited = 0;; ++attempt) {
+    loads = queryLoad();
+    candidates.clear();
+    for (unsigned i = 0; i < connections.size(); ++i)
+      /* workers of unknown load are busy sending us results anyway */
+      if (isAlive(i) && !isDraining(i) &&
+          (!loads[i] || loads[i]->freeSlots() > 0))
+        candidates.push_back(i);
+    if (!candidates.empty() || waited >= options.max_backoff_ms)
+      break;
+    auto delay = backoffDelay(attempt);
+    std::this_thread::sleep_for(delay);
+    waited += delay.count();
+  }
+  /* everyone is full, worker queues will sort it out */
+  if (candidates.empty())
+    for (unsigned i = 0; i < connections.size(); ++i)
+      if (isAlive(i) && !isDraining(i))
+        candidates.push_back(i);
+
+  auto utilization = [&](unsigned i) {
+    return loads[i] ? loads[i]->utilization() : 0.0;
+  };
+  auto free_memory = [&](unsigned i) {
+    return loads[i] ? loads[i]->freeMemory() : 0;
+  };
+  std::stable_sort(candidates.begin(), candidates.end(),
+                   [&](unsigned a, unsigned b) {
+                     if (utilization(a) != utilization(b))
+                       return utilization(a) < utilization(b);
+                     return free_memory(a) > free_memory(b);
+                   });
+  if (options.select_workers && candidates.size() > options.select_workers)
+    candidates.resize(options.select_workers);
+
+  std::fill(weights.begin(), weights.end(), 0);
+  for (auto i : candidates)
+    weights[i] = 1;
+  return weights;
+}
+
+template <class DataT>
+void TcpCommunicationProtocol<DataT>::offloadShared(
+    unsigned worker_id, const DataT *data, unsigned rows, unsigned columns,
+    StorageOrder order, uint64_t share_id) {
+  MatrixHeader hdr(rows, columns, order);
+  sendRawData(worker_id, &hdr, sizeof(hdr));
+  sendShared(worker_id, data, hdr.size() * sizeof(DataT), share_id);
+}
+
+template <class DataT>
+void TcpCommunicationProtocol<DataT>::sendShared(unsigned worker_id,
+                                                 const void *data,
+                                                 size_t size,
+                                                 uint64_t share_id) {
+  auto &conn = *connections[worker_id];
+  if (!conn.building)
+    throw std::runtime_error("no request started");
+  if (size < options.relay_threshold) {
+    conn.request.writeRef(data, size);
+    return;
+  }
+  auto &share = getShare(share_id);
+  if (options.relay != RELAY_NONE && !share.broadcast) {
+    share.states = broadcast(data, size, share_id);
+    share.broadcast = true;
+  }
+  share.states.resize(connections.size(), SHARE_UNSENT);
+  auto &state = share.states[worker_id];
+  /* e.g. workers added after the broadcast, or any worker without relay.
+   * Data is sent inline, the worker keeps it if it is reused
+   */
+  if (state == SHARE_UNSENT && share.reused) {
+    conn.shared_refs.push_back(SharedRef{conn.request.size(), share_id, size});
+    conn.shared_data.emplace_back(data, size);
+    conn.request.writeRef(data, size);
+    state = SHARE_CACHED;
+    return;
+  }
+  if (state != SHARE_CACHED) {
+    conn.request.writeRef(data, size);
+    return;
+  }
+  conn.shared_refs.push_back(SharedRef{conn.request.size(), share_id, 0});
+  conn.shared_data.emplace_back(data, size);
+}
+
+template <class DataT>
+void TcpCommunicationProtocol<DataT>::reuseShared(uint64_t share_id) {
+  getShare(share_id).reused = true;
+}
+
+/* State of shared data, the oldest one is forgotten to make room */
+template <class DataT>
+typename TcpCommunicationProtocol<DataT>::Share &
+TcpCommunicationProtocol<DataT>::getShare(uint64_t share_id) {
+  auto it = shares.find(share_id);
+  if (it != shares.end())
+    return it->second;
+  share_order.push_back(share_id);
+  if (share_order.size() > MaxRelayedShares) {
+    shares.erase(share_order.front());
+    share_order.pop_front();
+  }
+  return shares[share_id];
+}
+
+/* Send data to a root worker, which relays it to all other alive workers.
+ * Returns state of the data on every worker
+ */
+template <class DataT>
+std::vector<typename TcpCommunicationProtocol<DataT>::ShareState>
+TcpCommunicationProtocol<DataT>::broadcast(const void *data, size_t size,
+                                           uint64_t share_id) {
+  std::vector<ShareState> states(connections.size(), SHARE_UNSENT);
+  std::vector<unsigned> targets;
+  for (unsigned i = 0; i < connections.size(); ++i)
+    if (isAlive(i) && !isDraining(i))
+      targets.push_back(i);
+  /* the root must be able to receive the answer right away */
+  auto root = std::find_if(targets.begin(), targets.end(), [this](unsigned i) {
+    return !connections[i]->unread;
+  });
+  if (targets.size() < 2 || root == targets.end())
+    return states;
+  std::iter_swap(targets.begin(), root);
+  /* loopback address of a worker on the client machine means nothing to
+   * remote workers, such layouts are only valid if all workers are local
+   */
+  auto local = std::count_if(
+      targets.begin(), targets.end(),
+      [this](unsigned i) { return connections[i]->loopback; });
+  if (local && size_t(local) != targets.size()) {
+    std::cerr << "warning: workers on loopback addresses can't relay to "
+                 "remote ones, shared data is sent to each worker"
+              << std::endl;
+    return states;
+  }
+
+  std::vector<RelayTarget> layout;
+  for (auto node : buildRelayLayout(options.relay, targets.size()))
+    layout.push_back(RelayTarget{
+        connections[targets[node.index]]->relay_address, node.subtree});
+  auto state = sendBroadcast(targets[0], layout, data, size, share_id)
+                   ? SHARE_CACHED
+                   : SHARE_INLINE;
+  for (auto i : targets)
+    states[i] = state;
+  return states;
+}
+
+/* Send data to worker root, which relays it to workers of the layout.
+ * Returns false if any of them has failed to get it
+ */
+template <class DataT>
+bool TcpCommunicationProtocol<DataT>::sendBroadcast(
+    unsigned root, const std::vector<RelayTarget> &layout, const void *data,
+    size_t size, uint64_t share_id) {
+  PayloadWriter tree, payload;
+  writeRelayLayout(tree, layout);
+  payload.write(BroadcastHeader{share_id, size, tree.size()});
+  for (auto &&buf : tree.buffers())
+    payload.writeRef(buf.data(), buf.size());
+  payload.writeRef(data, size);
+
+  Response response;
+  try {
+    guarded(root, [&](Connection &conn) {
+      auto id = conn.next_request_id++;
+      /* never striped, so that every worker forwards data in order */
+      sendFrame(FrameHeader(FRAME_BROADCAST, id), payload, conn.streams,
+                std::numeric_limits<size_t>::max());
+      while (!conn.arrived.count(id))
+        receiveFrame(conn, id);
+      response = std::move(conn.arrived[id]);
+      conn.arrived.erase(id);
+    });
+  } catch (std::exception &e) {
+    std::cerr << "warning: " << e.what() << std::endl;
+    return false;
+  }
+  if (response.type != FRAME_BROADCAST_DONE) {
+    std::cerr << "warning: relay failed: " << response.payload.view()
+              << ", shared data is sent with requests" << std::endl;
+    return false;
+  }
+  return true;
 }
 
 template <class DataT>
 void TcpCommunicationProtocol<DataT>::sendRawData(unsigned worker_id,
                                                   const void *data,
-                                                  unsigned size) {
-  send_buf(data, size, sockets[worker_id]);
+                                                  size_t size) {
+  auto &conn = *connections[worker_id];
+  if (!conn.building)
+    throw std::runtime_error("no request started");
+  conn.request.writeRaw(data, size);
 }
 
 template <class DataT>
 void TcpCommunicationProtocol<DataT>::receiveRawData(unsigned worker_id,
-                                                     void *data,
-                                                     unsigned size) {
-  receive_buf(data, size, sockets[worker_id]);
+                                                     void *data, size_t size) {
+  if (!size)
+    return;
+  auto &conn = *connections[worker_id];
+  if (!conn.has_response)
+    nextResponse(worker_id);
+  if (conn.unread) {
+    if (size > conn.unread)
+      throw std::runtime_error("truncated payload");
+    guarded(worker_id, [data, size](Connection &conn) {
+      receive_buf(data, size, conn.streams[0]);
+    });
+    conn.unread -= size;
+  } else {
+    conn.reader.readRaw(data, size);
+  }
+  if (!conn.unread && conn.reader.empty())
+    conn.has_response = false;
+}
+
+/* Oldest result can be taken without blocking */
+template <class DataT>
+bool TcpCommunicationProtocol<DataT>::isReady(const Connection &conn) const {
+  return conn.failed || conn.has_response ||
+         (!conn.in_flight.empty() && conn.arrived.count(conn.in_flight.front()));
+}
+
+/* Receive next frame. Returns true if it is a response to expected_id, which
+ * is left in the stream to be received directly into destination. Other
+ * frames are buffered or dropped, if they belong to cancelled requests
+ */
+template <class DataT>
+bool TcpCommunicationProtocol<DataT>::receiveFrame(Connection &conn,
+                                                   uint64_t expected_id) {
+  auto hdr = receiveFrameHeader(conn.streams[0]);
+  if (hdr.request_id == expected_id && hdr.type == FRAME_RESPONSE &&
+      !(hdr.flags & FRAME_STRIPED)) {
+    conn.unread = hdr.length;
+    return true;
+  }
+  Buffer payload(hdr.length);
+  receivePayload(hdr, payload.data(), conn.streams);
+  if (!conn.discarded.erase(hdr.request_id))
+    conn.arrived.emplace(hdr.request_id,
+                         Response{FrameType(hdr.type), std::move(payload)});
+  return false;
+}
+
+/* Make response to the oldest in-flight request current */
+template <class DataT>
+void TcpCommunicationProtocol<DataT>::nextResponse(unsigned worker_id) {
+  auto &conn = *connections[worker_id];
+  submit(worker_id);
+  if (conn.in_flight.empty())
+    throw std::runtime_error("no request in flight");
+  do {
+    auto id = conn.in_flight.front();
+    guarded(worker_id, [this, id](Connection &conn) {
+      while (!conn.arrived.count(id) && !receiveFrame(conn, id))
+        ;
+    });
+  } while (resendMissing(worker_id));
+  takeResponse(conn);
+}
+
+/* If the worker has answered the oldest in-flight request with
+ * FRAME_SHARED_MISSING, i.e. it has evicted shared data the request
+ * references, the request is sent again with the data inline. It gets a
+ * new id, but keeps its place in the queue. Further requests carry this
+ * data inline as well. Returns true if the request was sent again
+ */
+template <class DataT>
+bool TcpCommunicationProtocol<DataT>::resendMissing(unsigned worker_id) {
+  auto &conn = *connections[worker_id];
+  if (conn.in_flight.empty())
+    return false;
+  auto id = conn.in_flight.front();
+  auto response = conn.arrived.find(id);
+  if (response == conn.arrived.end() ||
+      response->second.type != FRAME_SHARED_MISSING)
+    return false;
+  conn.arrived.erase(response);
+  auto it = conn.shared_requests.find(id);
+  if (it == conn.shared_requests.end())
+    throw std::runtime_error("unexpected shared data miss");
+  auto request = std::move(it->second);
+  conn.shared_requests.erase(it);
+  for (auto &&ref : request.refs) {
+    auto &states = getShare(ref.share_id).states;
+    states.resize(connections.size(), SHARE_UNSENT);
+    states[worker_id] = SHARE_INLINE;
+  }
+
+  /* data sent inline is in the payload already */
+  PayloadWriter payload;
+  size_t pos = 0, next = 0;
+  auto insert_shared = [&] {
+    for (; next < request.refs.size() && request.refs[next].offset == pos;
+         ++next)
+      if (!request.refs[next].size)
+        payload.writeRef(request.data[next].data(),
+                         request.data[next].size());
+  };
+  for (auto buf : request.payload.buffers()) {
+    while (buf.size()) {
+      insert_shared();
+      size_t chunk = buf.size();
+      if (next < request.refs.size())
+        chunk = std::min<size_t>(chunk, request.refs[next].offset - pos);
+      payload.writeRef(buf.data(), chunk);
+      buf += chunk;
+      pos += chunk;
+    }
+  }
+  insert_shared();
+
+  guarded(worker_id, [&](Connection &conn) {
+    auto new_id = conn.next_request_id++;
+    conn.in_flight.front() = new_id;
+    sendFrame(FrameHeader(FRAME_REQUEST, new_id), payload, conn.streams,
+              options.stripe_threshold);
+  });
+  return true;
+}
+
+/* Make response to the oldest in-flight request current. It is either
+ * buffered or its payload follows in the first stream
+ */
+template <class DataT>
+void TcpCommunicationProtocol<DataT>::takeResponse(Connection &conn) {
+  auto id = conn.in_flight.front();
+  conn.in_flight.pop_front();
+  conn.shared_requests.erase(id);
+  conn.has_response = true;
+  conn.reader = PayloadReader();
+  auto it = conn.arrived.find(id);
+  if (it != conn.arrived.end()) {
+    auto response = std::move(it->second);
+    conn.arrived.erase(it);
+    conn.unread = 0;
+    if (response.type == FRAME_ERROR || response.type == FRAME_REJECTED) {
+      conn.has_response = false;
+      std::string message(response.payload.view());
+      if (response.type == FRAME_REJECTED)
+        throw WorkerBusy("worker busy: " + message);
+      throw std::runtime_error("worker error: " + message);
+    }
+    conn.buffered = std::move(response.payload);
+    conn.reader = PayloadReader(conn.buffered.data(), conn.buffered.size());
+  }
+  /* empty response is consumed at once, next one is taken on the next read */
+  if (!conn.unread && conn.reader.empty())
+    conn.has_response = false;
 }
 
 } // namespace dhm
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "frame.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace dhm {
+
+/* Parse "host:port" string */
+inline std::pair<std::string, std::string> parseWorkerAddr(std::string Addr) {
+  auto idx = Addr.find_last_of(':');
+  if (idx == std::string::npos)
+    throw std::runtime_error("Port not specified in URL '" + Addr + "'");
+  std::string Host(Addr, 0, idx);
+  std::string Port(Addr, idx + 1);
+  if (Port.empty())
+    throw std::runtime_error("Invalid port in URL '" + Addr + "'");
+  if (Host.empty())
+    Host = "localhost";
+  return std::make_pair(Host, Port);
+}
+
+/* Shape of the tree broadcast data is relayed along. The sender transfers
+ * data to the root worker only, every worker forwards it to its children
+ * in chunks as it arrives. In BINOMIAL tree of n workers every node has up
+ * to log2(n) children and depth is log2(n), CHAIN is a pipeline through
+ * all workers where every uplink carries a single copy
+ */
+enum RelayTree : unsigned { RELAY_NONE, RELAY_BINOMIAL, RELAY_CHAIN };
+
+inline RelayTree parseRelayTree(const std::string &name) {
+  if (name == "none")
+    return RELAY_NONE;
+  if (name == "binomial")
+    return RELAY_BINOMIAL;
+  if (name == "chain")
+    return RELAY_CHAIN;
+  throw std::runtime_error("invalid relay tree '" + name + "'");
+}
+
+/* Data is forwarded to children as soon as this much has arrived */
+constexpr size_t RelayChunk = 256 << 10;
+/* Shared data smaller than this is sent inline with every request */
+constexpr size_t DefaultRelayThreshold = 64 << 10;
+
+/* Node of a relay tree with nodes in its subtree, including itself */
+struct RelayNode {
+  unsigned index;
+  unsigned subtree;
+};
+
+/* Descendants of node `first` in binomial tree over [first; first + count),
+ * the largest subtrees first
+ */
+inline void appendBinomial(unsigned first, unsigned count,
+                           std::vector<RelayNode> &layout) {
+  if (count < 2)
+    return;
+  unsigned step = 1;
+  while (step * 2 < count)
+    step *= 2;
+  for (; step; step /= 2) {
+    unsigned size = std::min(step, count - step);
+    layout.push_back(RelayNode{first + step, size});
+    appendBinomial(first + step, size, layout);
+  }
+}
+
+/* Descendants of root node 0 of the tree over nodes [0; count) in preorder:
+ * every node is followed by its own descendants
+ */
+inline std::vector<RelayNode> buildRelayLayout(RelayTree tree,
+                                               unsigned count) {
+  std::vector<RelayNode> layout;
+  if (tree == RELAY_BINOMIAL)
+    appendBinomial(0, count, layout);
+  else if (tree == RELAY_CHAIN)
+    for (unsigned i = 1; i < count; ++i)
+      layout.push_back(RelayNode{i, count - i});
+  return layout;
+}
+
+/* Worker the data is relayed to, and number of nodes in its subtree */
+struct RelayTarget {
+  std::string address;
+  uint32_t subtree;
+};
+
+/* Layout of FRAME_BROADCAST: descendants of the receiver in preorder, each
+ * as uint32_t subtree size followed by length-prefixed "host:port"
+ */
+inline void writeRelayLayout(PayloadWriter &out,
+                             const std::vector<RelayTarget> &layout) {
+  for (auto &&target : layout) {
+    out.write(target.subtree);
+    out.writeString(target.address);
+  }
+}
+
+inline std::vector<RelayTarget> readRelayLayout(PayloadReader &in) {
+  std::vector<RelayTarget> layout;
+  while (!in.empty()) {
+    auto subtree = in.read<uint32_t>();
+    layout.push_back(RelayTarget{in.readString(), subtree});
+  }
+  return layout;
+}
+
+/* Children of the receiver with their own layouts */
+inline std::vector<std::pair<RelayTarget, std::vector<RelayTarget>>>
+relayChildren(const std::vector<RelayTarget> &layout) {
+  std::vector<std::pair<RelayTarget, std::vector<RelayTarget>>> children;
+  for (size_t i = 0; i < layout.size(); i += layout[i].subtree) {
+    if (!layout[i].subtree || layout[i].subtree > layout.size() - i)
+      throw std::runtime_error("invalid relay layout");
+    children.emplace_back(
+        layout[i], std::vector<RelayTarget>(layout.begin() + i + 1,
+                                            layout.begin() + i +
+                                                layout[i].subtree));
+  }
+  return children;
+}
+
+} // namespace dhm
@@ -2,6 +2,7 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <vector>
 
 namespace dhm {
@@ -28,6 +29,9 @@ struct WorkRangeLinear {
  * Suppose we are splitting 11 work items to 4 workers
  * Then workers will have work ranges [0, 3), [3, 6), [6, 9), [9, 11),
  * i.e. work sizes are 3, 3, 3, 2
+ *
+ * With weights work sizes are proportional to them instead, e.g. weights
+ * 2, 1, 1, 1 give work sizes 4, 3, 2, 2
  */
 class WorkSplitterLinear {
 public:
@@ -37,10 +41,33 @@ public:
     assert(NumWorkers >= 1 && "invalid NumWorkers");
   }
 
+  /* Weights are e.g. measured throughput of workers */
+  WorkSplitterLinear(int WorkSz, const std::vector<double> &Weights)
+      : WorkSplitterLinear(WorkSz, Weights.size()) {
+    double Total = 0;
+    for (double W : Weights) {
+      assert(W >= 0 && "invalid weight");
+      Total += W;
+    }
+    if (Total <= 0)
+      return;
+    /* rounding cumulative sums keeps ranges adjacent */
+    Bounds.push_back(0);
+    double Sum = 0;
+    for (double W : Weights) {
+      Sum += W;
+      Bounds.push_back(std::min<int>(WorkSz, std::lround(WorkSz * Sum / Total)));
+    }
+    Bounds.back() = WorkSz;
+  }
+
   WorkRangeLinear getRange(int WorkerId) const {
     assert(WorkerId >= 0 && "invalid WorkerId");
     assert(WorkerId < NumWorkers && "invalid WorkerId");
 
+    if (!Bounds.empty())
+      return WorkRangeLinear{Bounds[WorkerId], Bounds[WorkerId + 1]};
+
     int DefaultGroupSz = WorkSz / NumWorkers;
 
     if (WorkerId < WorkSz % NumWorkers) {
@@ -58,6 +85,11 @@ public:
 
   template <class T = int> std::vector<T> getSizes() const {
     std::vector<T> Sizes(NumWorkers); // {} must not be used here!
+    if (!Bounds.empty()) {
+      for (int WorkerId = 0; WorkerId < NumWorkers; ++WorkerId)
+        Sizes[WorkerId] = getRange(WorkerId).size();
+      return Sizes;
+    }
     int DefaultGroupSz = WorkSz / NumWorkers;
     int NonDefaultWorkers = WorkSz % NumWorkers;
     std::fill_n(Sizes.begin(), NonDefaultWorkers, DefaultGroupSz + 1);
@@ -68,6 +100,10 @@ public:
 
   template <class T = int> std::vector<T> getDisplacements() const {
     std::vector<T> Displacements(NumWorkers); // {} must not be used here!
+    if (!Bounds.empty()) {
+      std::copy_n(Bounds.begin(), NumWorkers, Displacements.begin());
+      return Displacements;
+    }
     int DefaultGroupSz = WorkSz / NumWorkers;
     int NonDefaultWorkers = WorkSz % NumWorkers;
     int Offset = 0;
@@ -84,18 +120,32 @@ public:
   }
 
   /* checks if every worker will have exactly the same amount of work */
-  bool isEvenlyDivided() const { return WorkSz % NumWorkers == 0; }
+  bool isEvenlyDivided() const {
+    return getMinWorkSize() == getMaxWorkSize();
+  }
 
-  size_t getMinWorkSize() const { return WorkSz / NumWorkers; }
+  size_t getMinWorkSize() const {
+    if (!Bounds.empty()) {
+      auto Sizes = getSizes();
+      return *std::min_element(Sizes.begin(), Sizes.end());
+    }
+    return WorkSz / NumWorkers;
+  }
 
   size_t getMaxWorkSize() const {
+    if (!Bounds.empty()) {
+      auto Sizes = getSizes();
+      return *std::max_element(Sizes.begin(), Sizes.end());
+    }
     auto MinSz = getMinWorkSize();
-    return isEvenlyDivided() ? MinSz : (MinSz + 1);
+    return WorkSz % NumWorkers == 0 ? MinSz : (MinSz + 1);
   }
 
 private:
   int WorkSz;
   int NumWorkers;
+  /* worker ranges for weighted split, empty for even one */
+  std::vector<int> Bounds;
 };
 
 } // namespace dhm
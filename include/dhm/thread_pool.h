@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dhm {
+
+/* Fixed set of threads running submitted tasks in FIFO order */
+class ThreadPool {
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::function<void()>> tasks;
+  bool stopping = false;
+
+public:
+  /* 0 means hardware concurrency */
+  explicit ThreadPool(unsigned thread_count = 0) {
+    if (!thread_count)
+      thread_count = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < thread_count; ++i)
+      threads.emplace_back(&ThreadPool::run, this);
+  }
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /* Queued tasks are finished before threads exit */
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    cv.notify_all();
+    for (auto &&thread : threads)
+      thread.join();
+  }
+
+  size_t size() const { return threads.size(); }
+
+  /* Exceptions thrown by fn are passed to the returned future */
+  template <class Fn> std::future<void> submit(Fn fn) {
+    auto task = std::make_shared<std::packaged_task<void()>>(std::move(fn));
+    auto res = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.emplace_back([task] { (*task)(); });
+    }
+    cv.notify_one();
+    return res;
+  }
+
+private:
+  void run() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+        if (tasks.empty())
+          return;
+        task = std::move(tasks.front());
+        tasks.pop_front();
+      }
+      task();
+    }
+  }
+};
+
+} // namespace dhm
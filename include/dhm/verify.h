@@ -0,0 +1,163 @@
+#pragma once
+
+#include "matrix.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace dhm {
+
+/* Checks of distributed results against their inputs. FULL recomputes the
+ * result, FAST uses probabilistic checks of O(n^2) cost for products and
+ * the same linear comparison as FULL for element-wise operations
+ */
+enum VerifyMode { VERIFY_NONE, VERIFY_FAST, VERIFY_FULL };
+
+inline VerifyMode parseVerifyMode(const std::string &Mode) {
+  if (Mode == "none")
+    return VERIFY_NONE;
+  if (Mode == "fast")
+    return VERIFY_FAST;
+  if (Mode == "full")
+    return VERIFY_FULL;
+  throw std::runtime_error("invalid verification mode '" + Mode + "'");
+}
+
+/* Sum of |expected - actual| and of |expected|, their ratio is the relative
+ * error reported as eps
+ */
+struct ErrorSum {
+  double Distance = 0;
+  double Magnitude = 0;
+
+  ErrorSum &operator+=(const ErrorSum &Other) {
+    Distance += Other.Distance;
+    Magnitude += Other.Magnitude;
+    return *this;
+  }
+  double relative() const {
+    return Magnitude > 0 ? Distance / Magnitude : Distance;
+  }
+};
+
+/* Sums are kept in independent lanes, so that the loops are vectorized
+ * without reassociating floating point additions
+ */
+constexpr unsigned CompareLanes = 8;
+
+/* Elements of Expected(I) against Actual[I], I < Size */
+template <class T, class ExpectedFn>
+ErrorSum compareLanes(ExpectedFn Expected, const T *__restrict Actual,
+                      size_t Size) {
+  double Distance[CompareLanes] = {}, Magnitude[CompareLanes] = {};
+  size_t I = 0;
+  for (; I + CompareLanes <= Size; I += CompareLanes)
+    for (unsigned L = 0; L < CompareLanes; ++L) {
+      double E = Expected(I + L);
+      Distance[L] += std::fabs(E - double(Actual[I + L]));
+      Magnitude[L] += std::fabs(E);
+    }
+  for (; I < Size; ++I) {
+    double E = Expected(I);
+    Distance[0] += std::fabs(E - double(Actual[I]));
+    Magnitude[0] += std::fabs(E);
+  }
+  ErrorSum Res;
+  for (unsigned L = 0; L < CompareLanes; ++L)
+    Res += ErrorSum{Distance[L], Magnitude[L]};
+  return Res;
+}
+
+template <class T>
+ErrorSum compareArrays(const T *__restrict Expected,
+                       const T *__restrict Actual, size_t Size) {
+  return compareLanes([Expected](size_t I) { return double(Expected[I]); },
+                      Actual, Size);
+}
+
+/* Actual against A + B without materializing the expected sum */
+template <class T>
+ErrorSum compareSum(const T *__restrict A, const T *__restrict B,
+                    const T *__restrict Actual, size_t Size) {
+  return compareLanes([A, B](size_t I) { return double(A[I] + B[I]); },
+                      Actual, Size);
+}
+
+/* Bitwise equality, e.g. of echoed data */
+template <class T>
+bool identical(const T *Expected, const T *Actual, size_t Size) {
+  return !Size || !std::memcmp(Expected, Actual, Size * sizeof(T));
+}
+
+/* Matrices other than Matrix (e.g. MappedMatrix) are row-major */
+template <class MatrixT> bool isColumnMajor(const MatrixT &) { return false; }
+template <class T, class Alloc>
+bool isColumnMajor(const Matrix<T, Alloc> &M) {
+  return M.order() == COLUMN_MAJOR;
+}
+
+/* Res = M * R for [Rows x Cols] M and row-major [Cols x Width] R. M is
+ * walked in its storage order, Width products of a row are contiguous
+ */
+template <class MatrixT>
+void mulNarrow(const MatrixT &M, const double *R, size_t Width,
+               std::vector<double> &Res) {
+  Res.assign(M.rows() * Width, 0);
+  auto Accumulate = [&](size_t I, size_t J) {
+    double Value = M(I, J);
+    const double *RRow = R + J * Width;
+    double *ResRow = Res.data() + I * Width;
+    for (size_t L = 0; L < Width; ++L)
+      ResRow[L] += Value * RRow[L];
+  };
+  if (isColumnMajor(M)) {
+    for (size_t J = 0; J < M.columns(); ++J)
+      for (size_t I = 0; I < M.rows(); ++I)
+        Accumulate(I, J);
+  } else {
+    for (size_t I = 0; I < M.rows(); ++I)
+      for (size_t J = 0; J < M.columns(); ++J)
+        Accumulate(I, J);
+  }
+}
+
+/* Rounds of Freivalds' check by default. A wrong product passes a round
+ * with probability at most 1/2
+ */
+constexpr unsigned DefaultFreivaldsRounds = 8;
+
+/* Freivalds' check of C = A * B in O(Rounds * n^2): A * (B * R) is compared
+ * with C * R for random [B.columns() x Rounds] matrix R of +-1. All rounds
+ * share one pass over every matrix. For exact (e.g. integer) data any
+ * mismatch is a wrong product; for approximate data (e.g. CKKS) relative
+ * error is compared with a tolerance, like in the full check. Works for
+ * any matrix-like types
+ */
+template <class AT, class BT, class CT>
+ErrorSum freivalds(const AT &A, const BT &B, const CT &C,
+                   unsigned Rounds = DefaultFreivaldsRounds) {
+  assert(A.columns() == B.rows() && "incompatible matrices");
+  assert(C.rows() == A.rows() && C.columns() == B.columns() &&
+         "incompatible result");
+  thread_local std::mt19937_64 Gen(std::random_device{}());
+  std::vector<double> R(B.columns() * Rounds);
+  for (size_t I = 0; I < R.size(); I += 64) {
+    auto Bits = Gen();
+    for (size_t J = I; J < std::min(I + 64, R.size()); ++J, Bits >>= 1)
+      R[J] = Bits & 1 ? 1.0 : -1.0;
+  }
+
+  std::vector<double> BR, Expected, Actual;
+  mulNarrow(B, R.data(), Rounds, BR);
+  mulNarrow(A, BR.data(), Rounds, Expected);
+  mulNarrow(C, R.data(), Rounds, Actual);
+  return compareArrays(Expected.data(), Actual.data(), Expected.size());
+}
+
+} // namespace dhm
@@ -0,0 +1,389 @@
+#include <dhm/common.h>
+#include <dhm/histogram.h>
+#include <dhm/keystore.h>
+#include <dhm/matrix.h>
+#include <dhm/operation.h>
+#include <dhm/planner.h>
+#include <dhm/protocol.h>
+
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <thread>
+
+/* Open-loop load generator. Requests arrive at the target rate regardless
+ * of how fast they are served, and are taken by the first idle session.
+ * Latency is measured from the scheduled arrival, so time spent waiting for
+ * a session is included and overload is not hidden (no coordinated
+ * omission). Service time is measured from the start of processing
+ */
+
+using namespace dhm;
+namespace po = boost::program_options;
+using Clock = std::chrono::steady_clock;
+
+po::options_description options("Options");
+
+void showHelp() {
+  std::cerr << "Usage: dhm_loadgen [[--worker <url>]...] [options]\n\n"
+            << options << '\n';
+  exit(1);
+}
+
+/* One kind of request of the mix, "op:size=weight" */
+struct MixEntry {
+  std::string name;
+  Operation op;
+  unsigned size;
+  double weight;
+  /* encryption keys for hadd and hmul */
+  std::shared_ptr<KeySet> keys;
+};
+
+/* Comma-separated entries, e.g. "echo:512=4,mul:256=1,hmul:16=0.5". Size
+ * defaults to 256, weight to 1
+ */
+std::vector<MixEntry> parseMix(const std::string &str) {
+  std::vector<MixEntry> mix;
+  size_t pos = 0;
+  while (pos < str.size()) {
+    size_t end = std::min(str.find(',', pos), str.size());
+    std::string item = str.substr(pos, end - pos);
+    pos = end + 1;
+    size_t eq = item.find('=');
+    double weight = eq == std::string::npos ? 1 : std::stod(item.substr(eq + 1));
+    std::string name = item.substr(0, eq);
+    size_t colon = name.find(':');
+    unsigned size =
+        colon == std::string::npos ? 256 : std::stoul(name.substr(colon + 1));
+    auto op = parseOperation(name.substr(0, colon));
+    if (op != OP_ECHO && op != OP_ADD && op != OP_MUL && op != OP_HADD &&
+        op != OP_HMUL)
+      throw std::runtime_error("error: " + name +
+                               " is not supported by load generator");
+    if (!size || weight <= 0)
+      throw std::runtime_error("error: invalid mix entry '" + item + "'");
+    mix.push_back(MixEntry{std::string(opToString(op)) + ":" +
+                               std::to_string(size),
+                           op, size, weight, nullptr});
+  }
+  if (mix.empty())
+    throw std::runtime_error("error: empty request mix");
+  return mix;
+}
+
+struct Arrival {
+  size_t entry;
+  Clock::time_point scheduled;
+  /* arrivals during warmup are served but not recorded */
+  bool record;
+};
+
+/* Arrivals not taken by sessions yet */
+class ArrivalQueue {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<Arrival> arrivals;
+  bool closed = false;
+  size_t max_backlog = 0;
+
+public:
+  void push(const Arrival &arrival) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      arrivals.push_back(arrival);
+      max_backlog = std::max(max_backlog, arrivals.size());
+    }
+    cv.notify_one();
+  }
+
+  /* No more arrivals, sessions exit once the queue is empty */
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+    }
+    cv.notify_all();
+  }
+
+  std::optional<Arrival> pop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return closed || !arrivals.empty(); });
+    if (arrivals.empty())
+      return std::nullopt;
+    auto arrival = arrivals.front();
+    arrivals.pop_front();
+    return arrival;
+  }
+
+  size_t maxBacklog() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return max_backlog;
+  }
+};
+
+struct OpStats {
+  Histogram latency;
+  Histogram service;
+  size_t errors = 0;
+
+  void merge(const OpStats &other) {
+    latency.merge(other.latency);
+    service.merge(other.service);
+    errors += other.errors;
+  }
+};
+
+/* Connection to every worker with inputs prepared for every mix entry, so
+ * that requests measure distribution only
+ */
+class Session {
+  boost::asio::io_context io_context;
+  TcpCommunicationProtocol<double> tcp_protocol;
+  const std::vector<MixEntry> &mix;
+  std::vector<std::unique_ptr<EncryptionProtocol>> enc_protocols;
+  std::vector<Matrix<double>> as, bs;
+
+public:
+  std::vector<OpStats> stats;
+
+  Session(const std::vector<std::string> &workers, const TcpOptions &opts,
+          const std::vector<MixEntry> &mix)
+      : tcp_protocol(io_context, opts), mix(mix), stats(mix.size()) {
+    for (auto &&addr : workers)
+      tcp_protocol.addWorker(addr);
+    for (auto &&entry : mix) {
+      as.push_back(Matrix<double>::random(entry.size, entry.size));
+      bs.push_back(Matrix<double>::random(entry.size, entry.size));
+      /* hmul encrypts B column by column */
+      if (entry.op == OP_HMUL)
+        bs.back().setOrder(COLUMN_MAJOR);
+      enc_protocols.push_back(
+          entry.keys
+              ? std::make_unique<EncryptionProtocol>(&tcp_protocol, entry.keys)
+              : nullptr);
+    }
+  }
+
+  void serve(ArrivalQueue &queue) {
+    while (auto arrival = queue.pop()) {
+      auto start = Clock::now();
+      bool failed = false;
+      try {
+        run(arrival->entry);
+      } catch (std::exception &e) {
+        std::cerr << mix[arrival->entry].name << ": " << e.what()
+                  << std::endl;
+        failed = true;
+      }
+      auto end = Clock::now();
+      if (!arrival->record)
+        continue;
+      auto &op_stats = stats[arrival->entry];
+      if (failed) {
+        ++op_stats.errors;
+        continue;
+      }
+      op_stats.latency.record(
+          std::chrono::nanoseconds(end - arrival->scheduled).count());
+      op_stats.service.record(std::chrono::nanoseconds(end - start).count());
+    }
+  }
+
+private:
+  void run(size_t entry) {
+    CommunicationProtocol<double> &protocol =
+        enc_protocols[entry] ? *enc_protocols[entry]
+                             : static_cast<CommunicationProtocol<double> &>(
+                                   tcp_protocol);
+    auto &A = as[entry], &B = bs[entry];
+    switch (mix[entry].op) {
+    case OP_ECHO:
+      Echo<double>(protocol).echo(A);
+      break;
+    case OP_ADD:
+    case OP_HADD:
+      Adder<double>(protocol).add(A, B);
+      break;
+    default:
+      Multiplier<double>(protocol).multiply(A, B);
+      break;
+    }
+  }
+};
+
+/* Plan encryption parameters and get keys for every encrypted entry */
+void prepareKeys(std::vector<MixEntry> &mix, unsigned precision,
+                 unsigned security, const std::string &keystore_dir) {
+  for (auto &&entry : mix) {
+    if (entry.op != OP_HADD && entry.op != OP_HMUL)
+      continue;
+    /* inputs are in [-100; 100], see client */
+    unsigned magnitude_bits =
+        entry.op == OP_HADD ? 8 : 14 + 2 * std::ceil(std::log2(entry.size));
+    auto opts = planParameters(
+        PlanRequest(entry.op, entry.size, precision, magnitude_bits, security));
+    std::cout << entry.name << ": CKKS m " << opts.m << " bits " << opts.bits
+              << " precision " << opts.precision << " c " << opts.c
+              << std::endl;
+    entry.keys = keystore_dir.empty() ? KeySet::generate(opts)
+                                      : KeyStore(keystore_dir).get(opts);
+  }
+}
+
+void report(const std::vector<MixEntry> &mix, const std::vector<OpStats> &stats,
+            double seconds, bool show_distribution) {
+  constexpr double Ms = 1e6;
+  std::cout << std::fixed << std::setprecision(3);
+  std::cout << std::left << std::setw(12) << "op" << std::right
+            << std::setw(9) << "count" << std::setw(8) << "errors"
+            << std::setw(10) << "req/s" << std::setw(10) << "mean"
+            << std::setw(10) << "p50" << std::setw(10) << "p90"
+            << std::setw(10) << "p99" << std::setw(10) << "p99.9"
+            << std::setw(10) << "max" << std::setw(12) << "service p99"
+            << "  (ms)" << std::endl;
+  for (size_t i = 0; i < mix.size(); ++i) {
+    auto &latency = stats[i].latency;
+    std::cout << std::left << std::setw(12) << mix[i].name << std::right
+              << std::setw(9) << latency.count() << std::setw(8)
+              << stats[i].errors << std::setw(10)
+              << latency.count() / seconds << std::setw(10)
+              << latency.mean() / Ms << std::setw(10)
+              << latency.percentile(50) / Ms << std::setw(10)
+              << latency.percentile(90) / Ms << std::setw(10)
+              << latency.percentile(99) / Ms << std::setw(10)
+              << latency.percentile(99.9) / Ms << std::setw(10)
+              << latency.max() / Ms << std::setw(12)
+              << stats[i].service.percentile(99) / Ms << std::endl;
+  }
+  if (show_distribution)
+    for (size_t i = 0; i < mix.size(); ++i) {
+      std::cout << "\n" << mix[i].name << " latency, ms\n";
+      stats[i].latency.printDistribution(std::cout, Ms);
+    }
+}
+
+int main(int argc, char *argv[]) try {
+  std::vector<std::string> worker_addrs;
+  std::string mix_str = "echo:512=4,add:512=2,mul:256=1";
+  unsigned sessions = 16;
+  double rate = 50;
+  double duration = 10, warmup = 1;
+  std::string arrivals_str = "poisson";
+  std::string hdr_prefix;
+  TcpOptions tcp_options;
+  std::string keystore_dir;
+  unsigned precision = 20, security = 128;
+
+  // clang-format off
+  options.add_options()
+    ("help,h", "Show help")
+    ("worker,w", po::value(&worker_addrs), "Worker address ([host]:port). At least one worker must be specified")
+    ("mix", po::value(&mix_str), "Request mix: comma-separated op:size=weight entries, ops are 'echo', 'add', 'mul', 'hadd' and 'hmul'")
+    ("sessions", po::value(&sessions), "Concurrent client sessions, each with its own connections to all workers")
+    ("rate", po::value(&rate), "Target request rate per second, independent of responses (open loop)")
+    ("duration", po::value(&duration), "Seconds to generate requests for, after warmup")
+    ("warmup", po::value(&warmup), "Seconds of requests not included in results")
+    ("arrivals", po::value(&arrivals_str), "Arrival process: 'poisson' or 'uniform'")
+    ("distribution", "Print full latency percentile distribution of every op")
+    ("hdr-out", po::value(&hdr_prefix), "Write latency distributions in HdrHistogram .hgrm format to <prefix><op>-<size>.hgrm")
+    ("streams", po::value(&tcp_options.streams), "TCP streams per worker in every session")
+    ("select", po::value(&tcp_options.select_workers), "Use at most this many least loaded workers per request, 0 for all")
+    ("no-load-query", "Do not ask workers for their load before requests")
+    ("keystore", po::value(&keystore_dir), "Directory with encryption keys for hadd/hmul")
+    ("precision", po::value(&precision), "Bits of precision of encrypted results")
+    ("security", po::value(&security), "Security level of encryption parameters: 128, 192 or 256");
+  // clang-format on
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, options), vm);
+  po::notify(vm);
+  if (vm.count("help"))
+    showHelp();
+  if (!vm.count("worker")) {
+    std::cerr << "Error: worker not specified\n\n";
+    showHelp();
+  }
+  if (!sessions || rate <= 0 || duration <= 0 || warmup < 0)
+    throw std::runtime_error("error: invalid load parameters");
+  if (arrivals_str != "poisson" && arrivals_str != "uniform")
+    throw std::runtime_error("error: unknown arrival process '" +
+                             arrivals_str + "'");
+  tcp_options.query_load = !vm.count("no-load-query");
+
+  auto mix = parseMix(mix_str);
+  prepareKeys(mix, precision, security, keystore_dir);
+
+  std::cout << "loadgen: " << sessions << " sessions, " << rate
+            << " req/s for " << duration << " s after " << warmup
+            << " s of warmup" << std::endl;
+  std::vector<std::unique_ptr<Session>> session_list;
+  for (unsigned i = 0; i < sessions; ++i)
+    session_list.push_back(
+        std::make_unique<Session>(worker_addrs, tcp_options, mix));
+
+  ArrivalQueue queue;
+  std::vector<std::thread> threads;
+  for (auto &&session : session_list)
+    threads.emplace_back([&queue, &session] { session->serve(queue); });
+
+  std::vector<double> weights;
+  for (auto &&entry : mix)
+    weights.push_back(entry.weight);
+  std::mt19937_64 gen(std::random_device{}());
+  std::discrete_distribution<size_t> pick_entry(weights.begin(),
+                                                weights.end());
+  std::exponential_distribution<double> interval(rate);
+  auto start = Clock::now();
+  auto to_duration = [](double seconds) {
+    return std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(seconds));
+  };
+  auto measured_from = start + to_duration(warmup);
+  auto end = measured_from + to_duration(duration);
+  double offset = 0;
+  for (;;) {
+    offset += arrivals_str == "poisson" ? interval(gen) : 1 / rate;
+    auto scheduled = start + to_duration(offset);
+    if (scheduled >= end)
+      break;
+    std::this_thread::sleep_until(scheduled);
+    queue.push(Arrival{pick_entry(gen), scheduled, scheduled >= measured_from});
+  }
+  queue.close();
+  for (auto &&thread : threads)
+    thread.join();
+  std::chrono::duration<double> elapsed = Clock::now() - measured_from;
+
+  std::vector<OpStats> stats(mix.size());
+  for (auto &&session : session_list)
+    for (size_t i = 0; i < mix.size(); ++i)
+      stats[i].merge(session->stats[i]);
+  size_t done = 0;
+  for (auto &&op_stats : stats)
+    done += op_stats.latency.count();
+  std::cout << std::fixed << std::setprecision(1) << "loadgen: " << done
+            << " requests in " << elapsed.count() << " s, "
+            << done / elapsed.count() << " req/s of " << rate
+            << " targeted, up to " << queue.maxBacklog()
+            << " requests waited for a session" << std::endl;
+  report(mix, stats, elapsed.count(), vm.count("distribution"));
+
+  if (!hdr_prefix.empty())
+    for (size_t i = 0; i < mix.size(); ++i) {
+      auto name = mix[i].name;
+      std::replace(name.begin(), name.end(), ':', '-');
+      std::ofstream file(hdr_prefix + name + ".hgrm");
+      stats[i].latency.printDistribution(file, 1e6);
+    }
+  return 0;
+} catch (std::exception &e) {
+  std::cerr << e.what() << std::endl;
+  return 1;
+}
@@ -1,44 +1,456 @@
+#include <dhm/allocator.h>
+#include <dhm/batched_gemm.h>
 #include <dhm/common.h>
+#include <dhm/elementwise.h>
+#include <dhm/he_kernels.h>
 #include <dhm/matrix.h>
+#include <dhm/relay.h>
 
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/program_options.hpp>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
 #include <ctime>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <string>
 #include <thread>
+#include <unistd.h>
+#include <utility>
 
 using namespace dhm;
 
 #define DBG 0
 
+/* Thrown by long-running handlers once client has cancelled the request */
+struct RequestCancelled : std::runtime_error {
+  RequestCancelled() : std::runtime_error("request cancelled") {}
+};
+
+/* Received request. Its payload and all temporary data of the handler are
+ * allocated from the arena, which returns memory to the pool at once when
+ * request is destroyed
+ */
+struct Request {
+  Arena arena;
+  char *payload = nullptr;
+  size_t size = 0;
+  /* shared data the payload refers to, see FRAME_SHARED_REFS */
+  std::vector<std::shared_ptr<const Buffer>> shared;
+  /* the whole payload in order if it has shared data, see receiveShared() */
+  std::vector<boost::asio::const_buffer> segments;
+
+  explicit Request(size_t size)
+      : payload(static_cast<char *>(arena.allocate(size))), size(size) {}
+};
+
+/* Contexts and public keys of recent clients, keyed by key id. Building
+ * context and parsing key-switching matrices is expensive, while clients
+ * with persistent keys send the same key with every request
+ */
+class PublicKeyCache {
+public:
+  /* Plaintext matrix encoded for multiplication, see encodeDiagonals() */
+  struct EncodedMatrix {
+    MatrixHeader hdr;
+    std::vector<double> data;
+    std::vector<EncodedDiagonal> diagonals;
+  };
+
+  struct Entry {
+    EncContextOptions options;
+    std::unique_ptr<helib::Context> context;
+    std::unique_ptr<helib::PubKey> pk;
+    /* recently used plaintext matrices, encodings depend on context only */
+    std::mutex encoded_mutex;
+    std::deque<std::shared_ptr<const EncodedMatrix>> encoded;
+  };
+
+  static constexpr size_t MaxEntries = 16;
+  static constexpr size_t MaxEncodedMatrices = 4;
+
+  std::shared_ptr<Entry> get(const EncContextOptions &opts,
+                                   uint64_t key_id, std::string_view key) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = entries.find(key_id);
+      if (it != entries.end() &&
+          !std::memcmp(&it->second->options, &opts, sizeof opts))
+        return it->second;
+    }
+    auto entry = std::make_shared<Entry>();
+    entry->options = opts;
+    entry->context = opts.buildContextPtr();
+    entry->pk = std::make_unique<helib::PubKey>(readKey(*entry->context, key));
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!entries.count(key_id)) {
+      order.push_back(key_id);
+      if (order.size() > MaxEntries) {
+        entries.erase(order.front());
+        order.pop_front();
+      }
+    }
+    entries[key_id] = entry;
+    return entry;
+  }
+
+private:
+  std::mutex mutex;
+  std::map<uint64_t, std::shared_ptr<Entry>> entries;
+  /* insertion order for eviction */
+  std::deque<uint64_t> order;
+};
+
+static PublicKeyCache public_keys;
+
+/* Results of encrypted operations are mod-switched down before sending */
+static bool compact_results = true;
+
+/* Worker-wide limits on requests. Every admitted request reserves memory
+ * estimated from its payload size until it is finished. Admitted requests
+ * run at once if concurrency allows, otherwise they wait in FIFO order
+ */
+class AdmissionControl {
+public:
+  /* payload, its aligned copies and the result */
+  static constexpr size_t MemoryFactor = 3;
+
+  struct Limits {
+    unsigned max_concurrent = 0;
+    unsigned max_queue = 0;
+    size_t memory_budget = 0;
+  };
+
+  void configure(const Limits &new_limits) {
+    std::lock_guard<std::mutex> lock(mutex);
+    limits = new_limits;
+  }
+
+  static size_t estimateMemory(size_t payload_size) {
+    return payload_size * MemoryFactor;
+  }
+
+  /* Memory and a request slot taken by reserve(). Given back on
+   * destruction unless handed over to run(), e.g. if payload of the request
+   * is never received
+   */
+  class Reservation {
+    friend class AdmissionControl;
+    AdmissionControl *owner;
+    size_t memory;
+
+    Reservation(AdmissionControl *owner, size_t memory)
+        : owner(owner), memory(memory) {}
+
+  public:
+    Reservation(Reservation &&other) noexcept
+        : owner(std::exchange(other.owner, nullptr)), memory(other.memory) {}
+    Reservation &operator=(Reservation &&other) noexcept {
+      std::swap(owner, other.owner);
+      std::swap(memory, other.memory);
+      return *this;
+    }
+    ~Reservation() {
+      if (owner)
+        owner->release(memory);
+    }
+  };
+
+  /* Returns nothing if the request does not fit now. Requests which would
+   * never fit are reported by exception
+   */
+  std::optional<Reservation> reserve(size_t memory) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (memory > limits.memory_budget)
+      throw std::runtime_error("request exceeds memory budget of " +
+                               std::to_string(limits.memory_budget) +
+                               " bytes");
+    if (reserved + memory > limits.memory_budget ||
+        admitted >= limits.max_concurrent + limits.max_queue)
+      return std::nullopt;
+    reserved += memory;
+    ++admitted;
+    return Reservation(this, memory);
+  }
+
+  /* Run fn in a separate thread once concurrency allows, the reservation
+   * is released when it returns
+   */
+  void run(std::function<void()> fn, Reservation reservation) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Task task{std::move(fn), reservation.memory};
+    if (running < limits.max_concurrent) {
+      ++running;
+      spawn(std::move(task));
+    } else {
+      queue.push_back(std::move(task));
+    }
+    reservation.owner = nullptr;
+  }
+
+  WorkerLoad load() {
+    std::lock_guard<std::mutex> lock(mutex);
+    WorkerLoad res;
+    res.running = running;
+    res.queued = queue.size();
+    res.max_concurrent = limits.max_concurrent;
+    res.max_queue = limits.max_queue;
+    res.memory_reserved = reserved;
+    res.memory_budget = limits.memory_budget;
+    return res;
+  }
+
+private:
+  struct Task {
+    std::function<void()> fn;
+    size_t memory;
+  };
+
+  void spawn(Task task) {
+    std::thread([this, task = std::move(task)] {
+      task.fn();
+      finish(task.memory);
+    }).detach();
+  }
+
+  void release(size_t memory) {
+    std::lock_guard<std::mutex> lock(mutex);
+    reserved -= memory;
+    --admitted;
+  }
+
+  void finish(size_t memory) {
+    std::lock_guard<std::mutex> lock(mutex);
+    reserved -= memory;
+    --admitted;
+    if (queue.empty()) {
+      --running;
+      return;
+    }
+    spawn(std::move(queue.front()));
+    queue.pop_front();
+  }
+
+  std::mutex mutex;
+  Limits limits;
+  unsigned running = 0;
+  unsigned admitted = 0;
+  size_t reserved = 0;
+  std::deque<Task> queue;
+};
+
+static AdmissionControl admission;
+
+/* Broadcast data of all sessions by share id, see FRAME_BROADCAST. Least
+ * recently used data is evicted once the budget is exceeded
+ */
+class SharedCache {
+public:
+  void configure(size_t new_budget) {
+    std::lock_guard<std::mutex> lock(mutex);
+    budget = new_budget;
+  }
+
+  size_t getBudget() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return budget;
+  }
+
+  void put(uint64_t id, std::shared_ptr<const Buffer> data) {
+    std::lock_guard<std::mutex> lock(mutex);
+    erase(id);
+    used += data->size();
+    lru.push_front(id);
+    entries[id] = Entry{std::move(data), lru.begin()};
+    while (used > budget && lru.size() > 1)
+      erase(lru.back());
+  }
+
+  /* nullptr if data was never received or has been evicted */
+  std::shared_ptr<const Buffer> get(uint64_t id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(id);
+    if (it == entries.end())
+      return nullptr;
+    lru.splice(lru.begin(), lru, it->second.position);
+    return it->second.data;
+  }
+
+private:
+  struct Entry {
+    std::shared_ptr<const Buffer> data;
+    std::list<uint64_t>::iterator position;
+  };
+
+  void erase(uint64_t id) {
+    auto it = entries.find(id);
+    if (it == entries.end())
+      return;
+    used -= it->second.data->size();
+    lru.erase(it->second.position);
+    entries.erase(it);
+  }
+
+  std::mutex mutex;
+  std::map<uint64_t, Entry> entries;
+  /* the most recently used first */
+  std::list<uint64_t> lru;
+  size_t used = 0;
+  size_t budget = 0;
+};
+
+static SharedCache shared_cache;
+
+/* Broadcast data being received, shared with threads relaying it further */
+struct RelayProgress {
+  std::shared_ptr<Buffer> data;
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t received = 0;
+  /* all data is received and stored in shared_cache */
+  bool complete = false;
+  bool failed = false;
+
+  void update(size_t new_received, bool new_complete, bool new_failed) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      received = new_received;
+      complete = new_complete;
+      failed = new_failed;
+    }
+    cv.notify_all();
+  }
+
+  /* Wait until more than pos bytes or all data is received, returns the
+   * number of received bytes
+   */
+  size_t waitFor(size_t pos) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return received > pos || complete || failed; });
+    if (failed)
+      throw std::runtime_error("broadcast from upstream failed");
+    return received;
+  }
+};
+
+/* Send broadcast data to target as it arrives, along with the layout of its
+ * subtree, and wait until the subtree has received it
+ */
+static void forwardBroadcast(RelayProgress &progress, BroadcastHeader bhdr,
+                             const RelayTarget &target,
+                             const std::vector<RelayTarget> &layout) try {
+  boost::asio::io_context ctx;
+  tcp::resolver resolver(ctx);
+  tcp::socket socket(ctx);
+  auto [host, port] = parseWorkerAddr(target.address);
+  boost::asio::connect(socket, resolver.resolve(host, port));
+  tuneSocket(socket, 0);
+  StreamHello hello{std::random_device()(), 0, 1, 0, 0};
+  hello.session_id = hello.session_id << 32 | std::random_device()();
+  PayloadWriter hello_payload;
+  hello_payload.write(hello);
+  FrameHeader hello_hdr(FRAME_HELLO, 0, hello_payload.size());
+  boost::asio::write(socket, stripeFrame(hello_hdr, hello_payload, 1)[0]);
+
+  PayloadWriter tree, head;
+  writeRelayLayout(tree, layout);
+  bhdr.layout_size = tree.size();
+  head.write(bhdr);
+  for (auto &&buf : tree.buffers())
+    head.writeRef(buf.data(), buf.size());
+  FrameHeader hdr(FRAME_BROADCAST, 0, head.size() + bhdr.size);
+  boost::asio::write(socket, stripeFrame(hdr, head, 1)[0]);
+  for (size_t pos = 0; pos < bhdr.size;) {
+    size_t received = progress.waitFor(pos);
+    boost::asio::write(socket, boost::asio::buffer(
+                                   progress.data->data() + pos, received - pos));
+    pos = received;
+  }
+
+  auto answer = receiveFrameHeader(socket);
+  std::string message(answer.length, '\0');
+  receive_buf(message.data(), message.size(), socket);
+  if (answer.type == FRAME_ERROR)
+    throw std::runtime_error(message);
+  if (answer.type != FRAME_BROADCAST_DONE)
+    throw std::runtime_error("unexpected answer");
+} catch (std::exception &e) {
+  throw std::runtime_error("relay to " + target.address + " failed: " +
+                           e.what());
+}
+
 class TcpConnection : public boost::enable_shared_from_this<TcpConnection> {
-  tcp::socket socket;
+  /* Response frame. Payload may reference request data, so request is kept
+   * alive until response is written
+   */
+  struct Response {
+    FrameHeader hdr;
+    PayloadWriter payload;
+    std::shared_ptr<Request> request;
+
+    explicit Response(FrameHeader hdr,
+                      std::shared_ptr<Request> request = nullptr)
+        : hdr(hdr), request(std::move(request)) {}
+    /* number of streams still being written */
+    size_t pending_writes = 0;
+    boost::system::error_code error;
+  };
+
+  /* the first stream carries all frame headers and unstriped payloads.
+   * Responses are written to streams by the io_context thread, requests
+   * are read from read_streams (duplicates of the same sockets) by the
+   * reader thread of the connection, so that a slow upload does not stall
+   * other sessions
+   */
+  std::vector<tcp::socket> streams;
+  boost::asio::io_context read_context;
+  std::vector<tcp::socket> read_streams;
   std::string endpoint;
+  /* responses waiting to be written, the front one is being written */
+  std::deque<Response> write_queue;
+  /* requests being processed and the ones of them cancelled by client */
+  std::mutex requests_mutex;
+  std::set<uint64_t> active_requests;
+  std::set<uint64_t> cancelled_requests;
+  /* shared data to insert into the next request, see FRAME_SHARED_REFS.
+   * Used by the reader thread only
+   */
+  std::vector<SharedRef> shared_refs;
+  uint64_t shared_refs_id = 0;
 
 public:
   using pointer = boost::shared_ptr<TcpConnection>;
 
-  static pointer create(boost::asio::io_context &io_context) {
-    return pointer(new TcpConnection(io_context));
+  static pointer create(std::vector<tcp::socket> streams) {
+    return pointer(new TcpConnection(std::move(streams)));
   }
 
-  tcp::socket &getSocket() { return socket; }
-
   void start() {
     std::ostringstream os;
-    os << socket.remote_endpoint();
+    os << streams[0].remote_endpoint();
     endpoint = os.str();
-    std::cerr << "> " << endpoint << ": session started" << std::endl;
-    waitRequest();
-  }
-
-  void waitRequest() {
-    socket.async_wait(
-        tcp::socket::wait_read,
-        boost::bind(&TcpConnection::handleRequest, shared_from_this()));
+    std::cerr << "> " << endpoint << ": session started (" << streams.size()
+              << " streams)" << std::endl;
+    for (auto &&stream : streams) {
+      int fd = ::dup(stream.native_handle());
+      if (fd < 0)
+        throw std::runtime_error(std::string("dup: ") + strerror(errno));
+      read_streams.emplace_back(read_context,
+                                stream.local_endpoint().protocol(), fd);
+    }
+    std::thread([self = shared_from_this()] { self->readRequests(); })
+        .detach();
   }
 
   ~TcpConnection() {
@@ -46,44 +458,342 @@ public:
   }
 
 private:
-  TcpConnection(boost::asio::io_context &io_context) : socket(io_context) {}
+  TcpConnection(std::vector<tcp::socket> streams)
+      : streams(std::move(streams)) {}
+
+  void readRequests() try {
+    while (handleRequest())
+      ;
+  } catch (std::exception &e) {
+    std::cerr << "> " << endpoint << ": " << e.what() << std::endl;
+  }
+
+  /* Read and dispatch the next frame, returns false once client has
+   * closed the connection
+   */
+  bool handleRequest() {
+    FrameHeader hdr;
+    if (!tryReceiveFrameHeader(hdr, read_streams[0]))
+      return false;
+    if (hdr.type == FRAME_LOAD_QUERY) {
+      discardPayload(hdr, read_streams);
+      Response response(FrameHeader(FRAME_LOAD, hdr.request_id));
+      response.payload.write(admission.load());
+      postResponse(std::move(response));
+      return true;
+    }
+    if (hdr.type == FRAME_BROADCAST) {
+      receiveBroadcast(hdr);
+      return true;
+    }
+    if (hdr.type == FRAME_SHARED_REFS) {
+      if (hdr.length % sizeof(SharedRef))
+        throw std::runtime_error("invalid shared references");
+      shared_refs.resize(hdr.length / sizeof(SharedRef));
+      receivePayload(hdr, shared_refs.data(), read_streams);
+      shared_refs_id = hdr.request_id;
+      return true;
+    }
+    if (hdr.type == FRAME_CANCEL) {
+      discardPayload(hdr, read_streams);
+      cancelRequest(hdr.request_id);
+      return true;
+    }
+    if (hdr.type != FRAME_REQUEST)
+      throw std::runtime_error("unexpected frame");
+
+    std::vector<SharedRef> refs;
+    if (shared_refs_id == hdr.request_id)
+      refs = std::move(shared_refs);
+    shared_refs.clear();
+    std::vector<std::shared_ptr<const Buffer>> shared(refs.size());
+    size_t size = hdr.length, inline_size = 0, pos = 0;
+    for (size_t i = 0; i < refs.size(); ++i) {
+      if (refs[i].offset < pos || refs[i].offset > hdr.length ||
+          refs[i].size > hdr.length - refs[i].offset) {
+        rejectRequest(hdr, FRAME_ERROR, "invalid shared references");
+        return true;
+      }
+      pos = refs[i].offset + refs[i].size;
+      inline_size += refs[i].size;
+      if (refs[i].size)
+        continue;
+      /* client sends the request again with the data inline */
+      auto data = shared_cache.get(refs[i].share_id);
+      if (!data) {
+        rejectRequest(hdr, FRAME_SHARED_MISSING,
+                      "shared data was evicted from relay cache");
+        return true;
+      }
+      size += data->size();
+      shared[i] = std::move(data);
+    }
+    auto reservation = admitRequest(hdr, size);
+    if (!reservation)
+      return true;
+    auto request = std::make_shared<Request>(hdr.length - inline_size);
+    if (refs.empty())
+      receivePayload(hdr, request->payload, read_streams);
+    else
+      receiveShared(hdr, *request, refs, std::move(shared));
+    {
+      std::lock_guard<std::mutex> lock(requests_mutex);
+      active_requests.insert(hdr.request_id);
+    }
+    /* requests are processed concurrently and answered as soon as ready */
+    admission.run(
+        [self = shared_from_this(), id = hdr.request_id,
+         request = std::move(request)] { self->processRequest(id, request); },
+        std::move(*reservation));
+    return true;
+  }
+
+  /* Reserve resources for the request before its payload is received.
+   * Otherwise payload is dropped and the request is answered with
+   * FRAME_REJECTED, or with FRAME_ERROR if it would never fit
+   */
+  std::optional<AdmissionControl::Reservation>
+  admitRequest(const FrameHeader &hdr, size_t size) {
+    try {
+      if (auto reservation =
+              admission.reserve(AdmissionControl::estimateMemory(size)))
+        return reservation;
+    } catch (std::exception &e) {
+      rejectRequest(hdr, FRAME_ERROR, e.what());
+      return std::nullopt;
+    }
+    rejectRequest(hdr, FRAME_REJECTED, "worker is overloaded");
+    return std::nullopt;
+  }
+
+  /* Drop payload of the request and answer it with FRAME_REJECTED or
+   * FRAME_ERROR
+   */
+  void rejectRequest(const FrameHeader &hdr, FrameType type,
+                     const std::string &reason) {
+    discardPayload(hdr, read_streams);
+    std::cerr << "> " << endpoint << ": request #" << hdr.request_id
+              << " rejected: " << reason << std::endl;
+    Response response(FrameHeader(type, hdr.request_id));
+    response.payload.writeRaw(reason.data(), reason.size());
+    postResponse(std::move(response));
+  }
+
+  /* Receive request payload with shared data at refs. Cached data is
+   * referenced rather than copied into the payload, data sent inline is
+   * received into a buffer of its own and cached for further requests
+   */
+  void receiveShared(const FrameHeader &hdr, Request &request,
+                     const std::vector<SharedRef> &refs,
+                     std::vector<std::shared_ptr<const Buffer>> shared) {
+    std::vector<boost::asio::mutable_buffer> received;
+    char *dst = request.payload;
+    auto receiveOwn = [&](size_t size) {
+      received.emplace_back(dst, size);
+      request.segments.emplace_back(dst, size);
+      dst += size;
+    };
+    size_t pos = 0;
+    for (size_t i = 0; i < refs.size(); ++i) {
+      receiveOwn(refs[i].offset - pos);
+      pos = refs[i].offset + refs[i].size;
+      if (refs[i].size) {
+        auto data = std::make_shared<Buffer>(refs[i].size);
+        received.emplace_back(data->data(), data->size());
+        shared[i] = std::move(data);
+      }
+      request.segments.emplace_back(shared[i]->data(), shared[i]->size());
+    }
+    receiveOwn(hdr.length - pos);
+    receivePayload(hdr, received, read_streams);
+    for (size_t i = 0; i < refs.size(); ++i)
+      if (refs[i].size && refs[i].size <= shared_cache.getBudget())
+        shared_cache.put(refs[i].share_id, shared[i]);
+    request.shared = std::move(shared);
+  }
 
-  void handleRequest() try {
-    Operation op;
-    if (!try_receive(op, socket))
+  /* Receive broadcast data into shared_cache. Meanwhile separate threads
+   * forward it to children given by the relay layout as it arrives. The
+   * sender is answered once the whole subtree has the data
+   */
+  void receiveBroadcast(const FrameHeader &hdr) {
+    if (hdr.flags & FRAME_STRIPED)
+      throw std::runtime_error("striped broadcast");
+    auto bhdr = receive<BroadcastHeader>(read_streams[0]);
+    if (hdr.length != sizeof(bhdr) + bhdr.layout_size + bhdr.size)
+      throw std::runtime_error("invalid broadcast");
+    std::vector<char> layout_data(bhdr.layout_size);
+    receive_buf(layout_data.data(), layout_data.size(), read_streams[0]);
+    PayloadReader layout_reader(layout_data);
+    auto layout = readRelayLayout(layout_reader);
+    auto children = relayChildren(layout);
+    if (bhdr.size > shared_cache.getBudget()) {
+      FrameHeader data_hdr(FRAME_BROADCAST, hdr.request_id, bhdr.size);
+      rejectRequest(data_hdr, FRAME_ERROR,
+                    "shared data exceeds relay cache of " +
+                        std::to_string(shared_cache.getBudget()) + " bytes");
       return;
+    }
+
+    auto progress = std::make_shared<RelayProgress>();
+    progress->data = std::make_shared<Buffer>(bhdr.size);
+    std::thread([self = shared_from_this(), progress, bhdr,
+                 children = std::move(children), id = hdr.request_id] {
+      Response response(FrameHeader(FRAME_BROADCAST_DONE, id));
+      try {
+        if (!children.empty())
+          runParallel(children.size(), [&](size_t i) {
+            forwardBroadcast(*progress, bhdr, children[i].first,
+                             children[i].second);
+          });
+        progress->waitFor(bhdr.size);
+      } catch (std::exception &e) {
+        response.hdr.type = FRAME_ERROR;
+        response.payload.writeRaw(e.what(), strlen(e.what()));
+      }
+      self->postResponse(std::move(response));
+    }).detach();
 
-    std::cerr << "> " << endpoint << ": request: " << opToString(op)
+    size_t pos = 0;
+    try {
+      while (pos < bhdr.size) {
+        size_t chunk = std::min(RelayChunk, bhdr.size - pos);
+        receive_buf(progress->data->data() + pos, chunk, read_streams[0]);
+        pos += chunk;
+        progress->update(pos, false, false);
+      }
+    } catch (std::exception &) {
+      progress->update(pos, false, true);
+      throw;
+    }
+    shared_cache.put(bhdr.share_id, progress->data);
+    progress->update(pos, true, false);
+    std::cerr << "> " << endpoint << ": received shared data " << std::hex
+              << bhdr.share_id << std::dec << " (" << bhdr.size
+              << " bytes), relaying to " << layout.size() << " workers"
               << std::endl;
-    if (op == OP_ECHO)
-      handleEcho<double>();
-    else if (op == OP_ADD || op == OP_MUL)
-      handleBinOp<double>(op);
-    else if (op == OP_HADD || op == OP_HMUL)
-      handleEncOp(op);
-    else
-      throw std::runtime_error("unsupported operation");
-    std::cerr << "> " << endpoint << ": sent result" << std::endl;
-    waitRequest();
-  } catch (std::exception &e) {
-    std::cerr << "> " << endpoint << ": " << e.what() << std::endl;
   }
 
-  template <class T> void handleEcho();
-  template <class T> void handleBinOp(Operation op);
-  void handleEncOp(Operation op);
+  void processRequest(uint64_t request_id,
+                      std::shared_ptr<Request> request) {
+    auto in = request->segments.empty()
+                  ? PayloadReader(request->payload, request->size)
+                  : PayloadReader(request->segments);
+    auto &arena = request->arena;
+    Response response(FrameHeader(FRAME_RESPONSE, request_id), request);
+    auto &out = response.payload;
+    try {
+      auto op = in.read<Operation>();
+      std::cerr << "> " << endpoint << ": request #" << request_id << ": "
+                << opToString(op) << std::endl;
+      if (isCancelled(request_id))
+        throw RequestCancelled();
+      if (op == OP_ECHO)
+        handleEcho<double>(in, out);
+      else if (op == OP_ADD || op == OP_MUL)
+        handleBinOp<double>(op, arena, in, out);
+      else if (op == OP_BATCHED_MUL)
+        handleBatchedMul<double>(arena, in, out);
+      else if (op == OP_ELEMENTWISE)
+        handleElementwise<double>(arena, in, out);
+      else if (op == OP_HADD || op == OP_HMUL || op == OP_PMUL)
+        handleEncOp(op, request_id, arena, in, out);
+      else
+        throw std::runtime_error("unsupported operation");
+    } catch (RequestCancelled &) {
+    } catch (std::exception &e) {
+      std::cerr << "> " << endpoint << ": request #" << request_id << ": "
+                << e.what() << std::endl;
+      response.hdr.type = FRAME_ERROR;
+      out.clear();
+      out.writeRaw(e.what(), strlen(e.what()));
+    }
+    if (finishRequest(request_id)) {
+      std::cerr << "> " << endpoint << ": request #" << request_id
+                << ": cancelled" << std::endl;
+      return;
+    }
+    postResponse(std::move(response));
+  }
 
-  std::string receiveString() {
-    auto size = receive<unsigned>(socket);
-    std::string res(size, '0');
-    receive_buf(res.data(), res.size(), socket);
-    return res;
+  /* Cancellation only has effect on requests being processed, client drops
+   * responses to cancelled requests anyway
+   */
+  void cancelRequest(uint64_t request_id) {
+    std::lock_guard<std::mutex> lock(requests_mutex);
+    if (active_requests.count(request_id))
+      cancelled_requests.insert(request_id);
+  }
+
+  bool isCancelled(uint64_t request_id) {
+    std::lock_guard<std::mutex> lock(requests_mutex);
+    return cancelled_requests.count(request_id);
+  }
+
+  /* Returns true if request was cancelled */
+  bool finishRequest(uint64_t request_id) {
+    std::lock_guard<std::mutex> lock(requests_mutex);
+    active_requests.erase(request_id);
+    return cancelled_requests.erase(request_id);
+  }
+
+  /* Queue response from any thread */
+  void postResponse(Response response) {
+    boost::asio::post(streams[0].get_executor(),
+                      [self = shared_from_this(),
+                       response = std::move(response)]() mutable {
+                        self->queueResponse(std::move(response));
+                      });
   }
 
-  void sendString(const std::string &s) {
-    send<unsigned>(s.size(), socket);
-    send_buf(s.data(), s.size(), socket);
+  void queueResponse(Response response) {
+    write_queue.push_back(std::move(response));
+    if (write_queue.size() == 1)
+      writeNextResponse();
   }
+
+  void writeNextResponse() {
+    auto &response = write_queue.front();
+    response.hdr.length = response.payload.size();
+    if (streams.size() > 1 && response.hdr.length >= DefaultStripeThreshold)
+      response.hdr.flags |= FRAME_STRIPED;
+    auto stripes = stripeFrame(response.hdr, response.payload, streams.size());
+    response.pending_writes = stripes.size();
+    for (size_t i = 0; i < stripes.size(); ++i)
+      boost::asio::async_write(
+          streams[i], stripes[i],
+          boost::bind(&TcpConnection::handleWrite, shared_from_this(),
+                      boost::asio::placeholders::error));
+  }
+
+  void handleWrite(const boost::system::error_code &error) {
+    auto &response = write_queue.front();
+    if (error)
+      response.error = error;
+    if (--response.pending_writes)
+      return;
+    if (response.error) {
+      std::cerr << "> " << endpoint << ": " << response.error.message()
+                << std::endl;
+      return;
+    }
+    std::cerr << "> " << endpoint << ": sent result #"
+              << write_queue.front().hdr.request_id << std::endl;
+    write_queue.pop_front();
+    if (!write_queue.empty())
+      writeNextResponse();
+  }
+
+  template <class T> void handleEcho(PayloadReader &in, PayloadWriter &out);
+  template <class T>
+  void handleBinOp(Operation op, Arena &arena, PayloadReader &in,
+                   PayloadWriter &out);
+  template <class T>
+  void handleBatchedMul(Arena &arena, PayloadReader &in, PayloadWriter &out);
+  template <class DataT>
+  void handleElementwise(Arena &arena, PayloadReader &in, PayloadWriter &out);
+  void handleEncOp(Operation op, uint64_t request_id, Arena &arena,
+                   PayloadReader &in, PayloadWriter &out);
 };
 
 class TcpServer {
@@ -96,148 +806,391 @@ public:
   }
 
 private:
+  using socket_ptr = std::shared_ptr<tcp::socket>;
+
+  /* Session whose streams are not connected yet */
+  struct PendingSession {
+    std::vector<socket_ptr> streams;
+    unsigned connected = 0;
+  };
+
   void startAccept() {
-    auto connection = TcpConnection::create(context);
-    acceptor.async_accept(connection->getSocket(),
-                          boost::bind(&TcpServer::handleAccept, this,
-                                      connection,
+    auto socket = std::make_shared<tcp::socket>(context);
+    acceptor.async_accept(*socket,
+                          boost::bind(&TcpServer::handleAccept, this, socket,
                                       boost::asio::placeholders::error));
   }
 
-  void handleAccept(TcpConnection::pointer connection,
-                    const boost::system::error_code &error) {
+  void handleAccept(socket_ptr socket, const boost::system::error_code &error) {
     if (!error) {
-      connection->start();
+      socket->async_wait(tcp::socket::wait_read,
+                         boost::bind(&TcpServer::handleHello, this, socket));
     }
     startAccept();
   }
 
+  /* Every stream starts with FRAME_HELLO. Session is started once all of its
+   * streams are connected
+   */
+  void handleHello(socket_ptr socket) try {
+    auto hdr = receiveFrameHeader(*socket);
+    if (hdr.type != FRAME_HELLO || hdr.length != sizeof(StreamHello))
+      throw std::runtime_error("handshake expected");
+    auto hello = receive<StreamHello>(*socket);
+    if (!hello.stream_count || hello.stream_count > StreamHello::MaxStreams ||
+        hello.stream_index >= hello.stream_count)
+      throw std::runtime_error("invalid handshake");
+    tuneSocket(*socket, hello.socket_buffer);
+
+    auto &session = pending_sessions[hello.session_id];
+    if (session.streams.empty())
+      session.streams.resize(hello.stream_count);
+    if (session.streams.size() != hello.stream_count ||
+        session.streams[hello.stream_index])
+      throw std::runtime_error("invalid handshake");
+    session.streams[hello.stream_index] = socket;
+    if (++session.connected < hello.stream_count)
+      return;
+
+    std::vector<tcp::socket> streams;
+    for (auto &&stream : session.streams)
+      streams.push_back(std::move(*stream));
+    pending_sessions.erase(hello.session_id);
+    TcpConnection::create(std::move(streams))->start();
+  } catch (std::exception &e) {
+    std::cerr << "> handshake failed: " << e.what() << std::endl;
+  }
+
   boost::asio::io_context &context;
   tcp::acceptor acceptor;
+  std::map<uint64_t, PendingSession> pending_sessions;
 };
 
-template <class DataT> void TcpConnection::handleEcho() {
-  auto hdr = MatrixHeader::receive(socket);
-  auto data = receive_buf<DataT>(hdr.rows() * hdr.columns(), socket);
+template <class DataT>
+void TcpConnection::handleEcho(PayloadReader &in, PayloadWriter &out) {
+  auto hdr = MatrixHeader::read(in);
+  auto bytes = hdr.size() * sizeof(DataT);
+  const char *data = in.take(bytes);
   std::cout << "> " << endpoint << ": received matrix ["
             << hdr.rows() << " x " << hdr.columns() << "]" << std::endl;
-  hdr.send(socket);
-  send_buf(data, socket);
+  hdr.write(out);
+  /* request is kept alive until response is sent, no need to copy */
+  out.writeRef(data, bytes);
 }
 
-template <class DataT> void TcpConnection::handleBinOp(Operation op) {
-  auto hdr1 = MatrixHeader::receive(socket);
-  auto data1 = receive_buf<DataT>(hdr1.rows() * hdr1.columns(), socket);
+template <class DataT>
+void TcpConnection::handleBinOp(Operation op, Arena &arena, PayloadReader &in,
+                                PayloadWriter &out) {
+  using ArenaMatrix = Matrix<DataT, ArenaAllocator<DataT>>;
+  /* operands are copied out of the payload to get aligned storage */
+  auto hdr1 = MatrixHeader::read(in);
+  ArenaMatrix A(hdr1.rows(), hdr1.columns(), hdr1.order, arena);
+  in.readRaw(A.data(), hdr1.size() * sizeof(DataT));
   std::cout << "> " << endpoint << ": received matrix ["
             << hdr1.rows() << " x " << hdr1.columns() << "]" << std::endl;
-  auto hdr2 = MatrixHeader::receive(socket);
-  auto data2 = receive_buf<DataT>(hdr2.rows() * hdr2.columns(), socket);
-  std::cout << "> " << endpoint << ": received matrix ["
-            << hdr2.rows() << " x " << hdr2.columns() << "]" << std::endl;
-  Matrix<DataT> A(data1, hdr1.columns());
-  Matrix<DataT> B(data2, hdr2.columns());
 #if DBG
   print(A, "A");
-  print(B, "B");
 #endif
+  auto hdr2 = MatrixHeader::read(in);
+  std::cout << "> " << endpoint << ": received matrix ["
+            << hdr2.rows() << " x " << hdr2.columns() << "]" << std::endl;
+  /* result is always row-major, B is used in any order */
+  A.setOrder(ROW_MAJOR);
   if (op == OP_ADD) {
+    ArenaMatrix B(hdr2.rows(), hdr2.columns(), hdr2.order, arena);
+    in.readRaw(B.data(), hdr2.size() * sizeof(DataT));
     if (hdr1.rows() != hdr2.rows() || hdr1.columns() != hdr2.columns())
       throw std::runtime_error("mismatching matrix sizes");
     A += B;
   } else if (op == OP_MUL) {
     if (hdr1.columns() != hdr2.rows())
       throw std::runtime_error("mismatching matrix sizes");
-    A = mulT(A, B);
+    /* B is only read, so it is used in place (e.g. shared data cached by
+     * the worker) unless it is misaligned in the payload
+     */
+    auto bytes = hdr2.size() * sizeof(DataT);
+    const char *data = in.take(bytes);
+    if (reinterpret_cast<uintptr_t>(data) % alignof(DataT)) {
+      ArenaMatrix B(hdr2.rows(), hdr2.columns(), hdr2.order, arena);
+      std::memcpy(B.data(), data, bytes);
+      A = gemm(A, B);
+    } else {
+      MatrixView<DataT> B(reinterpret_cast<const DataT *>(data),
+                          hdr2.rows(), hdr2.columns(), hdr2.order);
+      A = gemm(A, B);
+    }
   } else {
     throw std::runtime_error("unsupported operation");
   }
-  hdr1.send(socket);
-  send_buf(A.data(), A.size() * sizeof(DataT), socket);
+  MatrixHeader res_hdr(A.rows(), A.columns());
+  res_hdr.write(out);
+  /* arena memory outlives A and is released after response is sent */
+  out.writeRef(A.data(), A.size() * sizeof(DataT));
 }
 
-helib::Ctxt multiply(const helib::Ctxt &v,
-                     const std::vector<helib::Ctxt> matrix) {
-  assert(!matrix.empty());
-
-  helib::Ctxt res = v;
+template <class DataT>
+void TcpConnection::handleBatchedMul(Arena &arena, PayloadReader &in,
+                                     PayloadWriter &out) {
+  using ArenaMatrix = Matrix<DataT, ArenaAllocator<DataT>>;
+  auto shape = in.read<BatchShape>();
+  auto hdr1 = MatrixHeader::read(in);
+  ArenaMatrix As(hdr1.rows(), hdr1.columns(), hdr1.order, arena);
+  in.readRaw(As.data(), hdr1.size() * sizeof(DataT));
+  auto hdr2 = MatrixHeader::read(in);
+  ArenaMatrix Bs(hdr2.rows(), hdr2.columns(), hdr2.order, arena);
+  in.readRaw(Bs.data(), hdr2.size() * sizeof(DataT));
+  if (hdr1.rows() != hdr2.rows() ||
+      hdr1.columns() != size_t(shape.m) * shape.k ||
+      hdr2.columns() != size_t(shape.k) * shape.n)
+    throw std::runtime_error("mismatching batch sizes");
+  std::cout << "> " << endpoint << ": received " << hdr1.rows()
+            << " products of [" << shape.m << " x " << shape.k << "] by ["
+            << shape.k << " x " << shape.n << "]" << std::endl;
+  /* every item must be a contiguous row */
+  As.setOrder(ROW_MAJOR);
+  Bs.setOrder(ROW_MAJOR);
+  ArenaMatrix Res(hdr1.rows(), size_t(shape.m) * shape.n, arena);
+  batchedGemm(As.data(), Bs.data(), Res.data(), Res.rows(), shape.m, shape.k,
+              shape.n);
+  MatrixHeader res_hdr(Res.rows(), Res.columns());
+  res_hdr.write(out);
+  out.writeRef(Res.data(), Res.size() * sizeof(DataT));
+}
 
-  res *= matrix[0];
-  helib::totalSums(res);
+template <class DataT>
+void TcpConnection::handleElementwise(Arena &arena, PayloadReader &in,
+                                      PayloadWriter &out) {
+  using ArenaMatrix = Matrix<DataT, ArenaAllocator<DataT>>;
+  auto chain = in.read<ElementwiseChain>();
+  chain.validate();
+  std::vector<ArenaMatrix> operands;
+  for (unsigned i = 0; i < chain.operandCount(); ++i) {
+    auto hdr = MatrixHeader::read(in);
+    auto &M = operands.emplace_back(hdr.rows(), hdr.columns(), hdr.order,
+                                    arena);
+    in.readRaw(M.data(), hdr.size() * sizeof(DataT));
+    if (M.rows() != operands[0].rows() || M.columns() != operands[0].columns())
+      throw std::runtime_error("mismatching matrix sizes");
+    /* kernels go over contiguous rows */
+    M.setOrder(ROW_MAJOR);
+  }
+  auto &A = operands[0];
+  std::cout << "> " << endpoint << ": received " << operands.size()
+            << " matrices [" << A.rows() << " x " << A.columns()
+            << "], chain of " << chain.Length << ", reduction "
+            << toString(chain.Reduce) << std::endl;
+  std::vector<const DataT *> data;
+  for (auto &&M : operands)
+    data.push_back(M.data());
+  auto [rows, columns] = reducedShape(chain.Reduce, A.rows(), A.columns());
+  ArenaMatrix Res(rows, columns, arena);
+  runElementwise(chain, data.data(), A.rows(), A.columns(), Res.data());
+  MatrixHeader res_hdr(Res.rows(), Res.columns());
+  res_hdr.write(out);
+  out.writeRef(Res.data(), Res.size() * sizeof(DataT));
+}
 
-  for (unsigned i = 1; i < matrix.size(); ++i) {
-    auto tmp = v;
-    tmp *= matrix[i];
-    helib::totalSums(tmp);
-    helib::shift(tmp, i);
-    res += tmp;
+/* Find B among recently encoded matrices or encode it */
+std::shared_ptr<const PublicKeyCache::EncodedMatrix>
+getEncodedMatrix(PublicKeyCache::Entry &keys, const double *B,
+                 MatrixHeader hdr) {
+  {
+    std::lock_guard<std::mutex> lock(keys.encoded_mutex);
+    for (auto &&matrix : keys.encoded)
+      if (matrix->hdr.data == hdr.data &&
+          std::equal(matrix->data.begin(), matrix->data.end(), B))
+        return matrix;
   }
-  return res;
+  auto matrix = std::make_shared<PublicKeyCache::EncodedMatrix>();
+  matrix->hdr = hdr;
+  matrix->data.assign(B, B + hdr.size());
+  matrix->diagonals =
+      encodeDiagonals(*keys.context, B, hdr.rows(), hdr.columns());
+
+  std::lock_guard<std::mutex> lock(keys.encoded_mutex);
+  keys.encoded.push_back(matrix);
+  if (keys.encoded.size() > PublicKeyCache::MaxEncodedMatrices)
+    keys.encoded.pop_front();
+  return matrix;
 }
 
-void TcpConnection::handleEncOp(Operation op) {
-  EncContextOptions opts;
-  receive_buf(&opts, sizeof(opts), socket);
+void TcpConnection::handleEncOp(Operation op, uint64_t request_id,
+                                Arena &arena, PayloadReader &in,
+                                PayloadWriter &out) {
+  using TextVector =
+      std::vector<std::string_view, ArenaAllocator<std::string_view>>;
+  auto opts = in.read<EncContextOptions>();
   std::cerr << "> " << endpoint << ": encryption options "
-            << opts.m << " " << opts.bits << " " << opts.precision << " "
-            << opts.c << std::endl;
-  auto key = receiveString();
-  std::cerr << "> " << endpoint << ": received public key"
-            << std::endl;
-  auto hdr1 = MatrixHeader::receive(socket);
-  std::vector<std::string> Atxt;
-  for (unsigned i = 0; i < hdr1.rows(); ++i)
-    Atxt.emplace_back(receiveString());
+            << (opts.scheme == SCHEME_BGV ? "bgv " : "ckks ") << opts.m << " "
+            << opts.bits << " " << opts.precision << " " << opts.c << " "
+            << opts.p << std::endl;
+  auto key_id = in.read<uint64_t>();
+  auto key = in.readStringView();
+  std::cerr << "> " << endpoint << ": received public key " << std::hex
+            << key_id << std::dec << std::endl;
+  /* Every ciphertext holds a row of A, or a row or a column of B depending
+   * on its storage order. Ciphertexts are deserialized right from payload
+   */
+  auto hdr1 = MatrixHeader::read(in);
+  if (hdr1.order != ROW_MAJOR)
+    throw std::runtime_error("encrypted A must be row-major");
+  TextVector Atxt(arena);
+  Atxt.reserve(hdr1.lines());
+  for (unsigned i = 0; i < hdr1.lines(); ++i)
+    Atxt.push_back(in.readStringView());
   std::cout << "> " << endpoint
             << ": received encrypted matrix [" << hdr1.rows() << " x "
             << hdr1.columns() << "]" << std::endl;
 
-  auto hdr2 = MatrixHeader::receive(socket);
-  std::vector<std::string> Btxt;
-  for (unsigned i = 0; i < hdr2.rows(); ++i)
-    Btxt.emplace_back(receiveString());
-  std::cout << "> " << endpoint
-            << ": received encrypted matrix [" << hdr2.rows() << " x "
-            << hdr2.columns() << "]" << std::endl;
+  auto hdr2 = MatrixHeader::read(in);
+  TextVector Btxt(arena);
+  Matrix<double, ArenaAllocator<double>> Bplain(0, 0, arena);
+  if (op == OP_PMUL) {
+    Bplain = Matrix<double, ArenaAllocator<double>>(
+        hdr2.rows(), hdr2.columns(), hdr2.order, arena);
+    in.readRaw(Bplain.data(), hdr2.size() * sizeof(double));
+    /* diagonals are taken from row-major B */
+    Bplain.setOrder(ROW_MAJOR);
+    hdr2.order = ROW_MAJOR;
+  } else {
+    Btxt.reserve(hdr2.lines());
+    for (unsigned i = 0; i < hdr2.lines(); ++i)
+      Btxt.push_back(in.readStringView());
+  }
+  std::cout << "> " << endpoint << ": received "
+            << (op == OP_PMUL ? "plaintext" : "encrypted") << " matrix ["
+            << hdr2.rows() << " x " << hdr2.columns() << "]" << std::endl;
 
-  auto enc_context = opts.buildContext();
-  auto pk = readKey(enc_context, key);
+  auto keys = public_keys.get(opts, key_id, key);
+  auto &pk = *keys->pk;
 
+  MatrixHeader res_hdr = hdr1;
   std::vector<std::string> results;
+  long dropped = 0;
+  /* returned with results, so that clients see what parameters afford */
+  NoiseBudget budget;
+  auto read = [&](std::string_view text) {
+    auto c = readCtxt(pk, text);
+    budget.recordInput(c);
+    return c;
+  };
+  auto finish = [&](helib::Ctxt &&res) {
+    if (compact_results)
+      tracked(&budget, STAGE_COMPACT, res,
+              [&] { dropped += compactResult(res, opts.precision); });
+    budget.recordResult(res);
+    results.push_back(stringify(res));
+  };
   if (op == OP_HADD) {
-    if (hdr1.rows() != hdr2.rows() || hdr1.columns() != hdr2.columns())
+    if (hdr1.rows() != hdr2.rows() || hdr1.columns() != hdr2.columns() ||
+        hdr1.order != hdr2.order)
       throw std::runtime_error("mismatching matrix sizes");
     for (unsigned i = 0; i < hdr1.rows(); ++i) {
-      auto v1 = readCtxt(pk, Atxt[i]);
-      auto v2 = readCtxt(pk, Btxt[i]);
-      v1 += v2;
-      results.push_back(stringify(v1));
+      auto v1 = read(Atxt[i]);
+      auto v2 = read(Btxt[i]);
+      tracked(&budget, STAGE_ADD, v1, [&] { v1 += v2; });
+      finish(std::move(v1));
     }
   } else if (op == OP_HMUL) {
-    if (hdr1.columns() != hdr2.rows())
+    /* columns of B are multiplied by rows of A */
+    if (hdr1.columns() != hdr2.rows() || hdr2.order != COLUMN_MAJOR)
       throw std::runtime_error("mismatching matrix sizes");
     std::vector<helib::Ctxt> B;
-    std::transform(Btxt.begin(), Btxt.end(), std::back_inserter(B),
-                   [&pk](auto &&text) { return readCtxt(pk, text); });
+    std::transform(Btxt.begin(), Btxt.end(), std::back_inserter(B), read);
     for (unsigned i = 0; i < hdr1.rows(); ++i) {
-      auto v = readCtxt(pk, Atxt[i]);
-      results.push_back(stringify(multiply(v, B)));
+      if (isCancelled(request_id))
+        throw RequestCancelled();
+      auto v = read(Atxt[i]);
+      finish(multiply(v, B, &budget));
     }
+    res_hdr = MatrixHeader(hdr1.rows(), hdr2.columns());
 
+  } else if (op == OP_PMUL) {
+    long slots = keys->context->getNSlots();
+    if (hdr1.columns() != hdr2.rows() || long(hdr1.columns()) > slots ||
+        long(hdr2.columns()) > slots)
+      throw std::runtime_error("mismatching matrix sizes");
+    auto B = getEncodedMatrix(*keys, Bplain.data(), hdr2);
+    for (unsigned i = 0; i < hdr1.rows(); ++i) {
+      if (isCancelled(request_id))
+        throw RequestCancelled();
+      auto v = read(Atxt[i]);
+      finish(multiplyDiagonals(v, B->diagonals, &budget));
+    }
+    res_hdr = MatrixHeader(hdr1.rows(), hdr2.columns());
   } else {
     throw std::runtime_error("unsupported operation");
   }
-  hdr1.send(socket);
+  if (compact_results && !results.empty()) {
+    size_t bytes = 0;
+    for (auto &&res : results)
+      bytes += res.size();
+    std::cerr << "> " << endpoint << ": dropped "
+              << double(dropped) / results.size()
+              << " primes per result, sending " << bytes << " bytes"
+              << std::endl;
+  }
+  res_hdr.write(out);
   std::for_each(results.begin(), results.end(),
-                [this](auto &&res) { sendString(res); });
+                [&out](auto &&res) { out.writeString(res); });
+  out.write(budget);
 }
 
 int main(int argc, char *argv[]) try {
-  if (argc != 2) {
-    std::cerr << "Usage: ./worker <port>" << std::endl;
+  namespace po = boost::program_options;
+  unsigned port = 0;
+  AdmissionControl::Limits limits;
+  limits.max_concurrent = std::max(1u, std::thread::hardware_concurrency());
+  limits.max_queue = 64;
+  /* half of physical memory */
+  size_t memory_budget_mb =
+      size_t(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGE_SIZE) / 2 >> 20;
+  size_t shared_cache_mb = 0;
+  size_t pool_cache_mb = 0;
+
+  po::options_description options("Options");
+  // clang-format off
+  options.add_options()
+    ("help,h", "Show help")
+    ("port", po::value(&port), "Port to listen on")
+    ("max-concurrent", po::value(&limits.max_concurrent), "Requests processed at once, the number of cores by default")
+    ("max-queue", po::value(&limits.max_queue), "Requests waiting for processing, further ones are rejected")
+    ("memory-budget", po::value(&memory_budget_mb), "Memory for admitted requests in MiB, half of physical memory by default")
+    ("shared-cache", po::value(&shared_cache_mb), "Memory for broadcast data in MiB, a quarter of the memory budget by default")
+    ("pool-cache", po::value(&pool_cache_mb), "Freed buffers kept for reuse in MiB, a sixteenth of the memory budget by default")
+    ("no-compact", "Send encrypted results at the level computation leaves them");
+  // clang-format on
+  po::positional_options_description positional;
+  positional.add("port", 1);
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv)
+                .options(options)
+                .positional(positional)
+                .run(),
+            vm);
+  po::notify(vm);
+  if (vm.count("help") || !vm.count("port") || !limits.max_concurrent) {
+    std::cerr << "Usage: ./worker <port> [options]\n\n" << options << '\n';
     exit(1);
   }
+  limits.memory_budget = memory_budget_mb << 20;
+  compact_results = !vm.count("no-compact");
+  if (!vm.count("shared-cache"))
+    shared_cache_mb = memory_budget_mb / 4;
+  if (!vm.count("pool-cache"))
+    pool_cache_mb = memory_budget_mb / 16;
+  admission.configure(limits);
+  shared_cache.configure(shared_cache_mb << 20);
+  BufferPool::global().configure(pool_cache_mb << 20);
+  std::cout << "> running up to " << limits.max_concurrent
+            << " requests, queueing up to " << limits.max_queue
+            << ", memory budget " << memory_budget_mb << " MiB, "
+            << shared_cache_mb << " MiB for broadcast data, "
+            << pool_cache_mb << " MiB of freed buffers" << std::endl;
+  std::cout << "> element-wise kernels: " << simd::kernels<double>().Name
+            << std::endl;
+
   boost::asio::io_context io_context;
-  int port = atoi(argv[1]);
   TcpServer server(io_context, port);
   io_context.run();
   return 0;